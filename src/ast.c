@@ -26,6 +26,7 @@
 #include "internal.h"
 #include "memory.h"
 #include "lens.h"
+#include "hash.h"
 
 /* A dictionary that maps key to a list of (skel, dict) */
 struct dict_entry {
@@ -50,18 +51,22 @@ struct dict_node {
     struct dict_entry *mark;  /* Pointer to initial entry, will never change */
 };
 
-/* Nodes are kept sorted by their key, with NULL being smaller than any
-   string */
+/* Nodes are kept in the order in which they were added. Once a dict has
+   more than dict_index_min nodes, INDEX maps the keys of all nodes except
+   the one for the NULL key to their node; smaller dicts are searched
+   linearly. NULL_NODE is the node for the NULL key, if there is one.
+*/
 struct dict {
     struct dict_node **nodes;
     uint32_t          size;
     uint32_t          used;
     bool              marked;
+    struct dict_node *null_node;
+    hash_t           *index;
 };
 
 static const int dict_initial_size = 2;
-static const int dict_max_expansion = 128;
-static const uint32_t dict_max_size = (1<<24) - 1;
+static const uint32_t dict_index_min = 8;
 
 struct dict *make_dict(char *key, struct skel *skel, struct dict *subdict) {
     struct dict *dict = NULL;
@@ -80,6 +85,8 @@ struct dict *make_dict(char *key, struct skel *skel, struct dict *subdict) {
     dict->nodes[0]->entry->skel = skel;
     dict->nodes[0]->entry->dict = subdict;
     dict->nodes[0]->mark = dict->nodes[0]->entry;
+    if (key == NULL)
+        dict->null_node = dict->nodes[0];
 
     return dict;
  error:
@@ -93,10 +100,19 @@ struct dict *make_dict(char *key, struct skel *skel, struct dict *subdict) {
     return NULL;
 }
 
+static void free_dict_index(struct dict *dict) {
+    if (dict->index != NULL) {
+        hash_free_nodes(dict->index);
+        hash_destroy(dict->index);
+        dict->index = NULL;
+    }
+}
+
 void free_dict(struct dict *dict) {
     if (dict == NULL)
         return;
 
+    free_dict_index(dict);
     for (int i=0; i < dict->used; i++) {
         struct dict_node *node = dict->nodes[i];
         if (! dict->marked)
@@ -115,72 +131,78 @@ void free_dict(struct dict *dict) {
     FREE(dict);
 }
 
-/* Return the position of KEY in DICT as an integer between 0 and
-   DICT->USED.  If KEY is not in DICT, return a negative number P such that
-   -(P + 1) is the position at which KEY must be inserted to keep the keys
-   of the nodes in DICT sorted.
-*/
-static int dict_pos(struct dict *dict, const char *key) {
-    if (key == NULL) {
-        return (dict->nodes[0]->key == NULL) ? 0 : -1;
+/* Return the node for KEY in DICT, or NULL if there is none */
+static struct dict_node *dict_find(struct dict *dict, const char *key) {
+    if (key == NULL)
+        return dict->null_node;
+
+    if (dict->index != NULL) {
+        hnode_t *hn = hash_lookup(dict->index, key);
+        return hn == NULL ? NULL : hnode_get(hn);
     }
 
-    int l = dict->nodes[0]->key == NULL ? 1 : 0;
-    int h = dict->used;
-    while (l < h) {
-        int m = (l + h)/2;
-        int cmp = strcmp(dict->nodes[m]->key, key);
-        if (cmp > 0)
-            h = m;
-        else if (cmp < 0)
-            l = m + 1;
-        else
-            return m;
+    for (int i=0; i < dict->used; i++) {
+        if (dict->nodes[i]->key != NULL && STREQ(dict->nodes[i]->key, key))
+            return dict->nodes[i];
     }
-    return -(l + 1);
+    return NULL;
 }
 
-static int dict_expand(struct dict *dict) {
-    uint32_t size = dict->size;
-
-    if (size == dict_max_size)
-        return -1;
-    if (size > dict_max_expansion)
-        size += dict_max_expansion;
-    else
-        size *= 2;
-    if (size > dict_max_size)
-        size = dict_max_size;
-    dict->size = size;
-    return REALLOC_N(dict->nodes, dict->size);
+/* Build the index for DICT, or drop it if we run out of memory; we can
+   always fall back to searching DICT linearly */
+static void dict_index(struct dict *dict, int from) {
+    if (dict->index == NULL) {
+        dict->index = hash_create(HASHCOUNT_T_MAX, NULL, NULL);
+        if (dict->index == NULL)
+            return;
+    }
+    for (int i=from; i < dict->used; i++) {
+        struct dict_node *node = dict->nodes[i];
+        if (node->key != NULL
+            && hash_alloc_insert(dict->index, node->key, node) < 0) {
+            free_dict_index(dict);
+            return;
+        }
+    }
 }
 
-int dict_append(struct dict **dict, struct dict *d2) {
-    if (d2 == NULL)
-        return 0;
-
-    if (*dict == NULL) {
-        *dict = d2;
-        return 0;
+/* Add NODE, whose key is not in DICT yet, to DICT */
+static int dict_add(struct dict *dict, struct dict_node *node) {
+    if (dict->used == dict->size) {
+        if (REALLOC_N(dict->nodes, 2 * dict->size) < 0)
+            return -1;
+        dict->size *= 2;
     }
+    dict->nodes[dict->used] = node;
+    dict->used += 1;
+    if (node->key == NULL)
+        dict->null_node = node;
 
-    struct dict *d1 = *dict;
+    if (dict->index != NULL)
+        dict_index(dict, dict->used - 1);
+    else if (dict->used > dict_index_min)
+        dict_index(dict, 0);
+    return 0;
+}
+
+/* Add the entries of D2 to those of D1, and free D2. If PREPEND, D2's
+   entries for a key go before those of D1, otherwise after them */
+static int dict_merge(struct dict *d1, struct dict *d2, bool prepend) {
+    free_dict_index(d2);
     for (int i2 = 0; i2 < d2->used; i2++) {
         struct dict_node *n2 = d2->nodes[i2];
-        int i1 = dict_pos(d1, n2->key);
-        if (i1 < 0) {
-            i1 = - i1 - 1;
-            if (d1->size == d1->used) {
-                if (dict_expand(d1) < 0)
-                    return -1;
-            }
-            memmove(d1->nodes + i1 + 1, d1->nodes + i1,
-                    sizeof(*d1->nodes) * (d1->used - i1));
-            d1->nodes[i1] = n2;
-            d1->used += 1;
+        struct dict_node *n1 = dict_find(d1, n2->key);
+        if (n1 == NULL) {
+            if (dict_add(d1, n2) < 0)
+                return -1;
         } else {
-            struct dict_node *n1 = d1->nodes[i1];
-            list_tail_cons(n1->entry, n1->mark, n2->entry);
+            if (prepend) {
+                n2->mark->next = n1->entry;
+                n1->entry = n2->entry;
+            } else {
+                n1->mark->next = n2->entry;
+                n1->mark = n2->mark;
+            }
             FREE(n2->key);
             FREE(n2);
         }
@@ -190,20 +212,42 @@ int dict_append(struct dict **dict, struct dict *d2) {
     return 0;
 }
 
+int dict_append(struct dict **dict, struct dict *d2) {
+    if (d2 == NULL)
+        return 0;
+
+    if (*dict == NULL) {
+        *dict = d2;
+        return 0;
+    }
+
+    /* Merge the smaller dict into the bigger one */
+    struct dict *d1 = *dict;
+    if (d1->used < d2->used) {
+        *dict = d2;
+        return dict_merge(d2, d1, true);
+    }
+    return dict_merge(d1, d2, false);
+}
+
+/* Switch DICT from construction to lookup */
+static void dict_mark(struct dict *dict) {
+    if (! dict->marked) {
+        for (int i=0; i < dict->used; i++) {
+            dict->nodes[i]->mark = dict->nodes[i]->entry;
+        }
+        dict->marked = 1;
+    }
+}
+
 void dict_lookup(const char *key, struct dict *dict,
                  struct skel **skel, struct dict **subdict) {
     *skel = NULL;
     *subdict = NULL;
     if (dict != NULL) {
-        if (! dict->marked) {
-            for (int i=0; i < dict->used; i++) {
-                dict->nodes[i]->mark = dict->nodes[i]->entry;
-            }
-            dict->marked = 1;
-        }
-        int p = dict_pos(dict, key);
-        if (p >= 0) {
-            struct dict_node *node = dict->nodes[p];
+        dict_mark(dict);
+        struct dict_node *node = dict_find(dict, key);
+        if (node != NULL) {
             if (node->entry != NULL) {
                 *skel = node->entry->skel;
                 *subdict = node->entry->dict;
@@ -213,7 +257,25 @@ void dict_lookup(const char *key, struct dict *dict,
     }
 }
 
+/* Return the skel that the N-th next call to DICT_LOOKUP for KEY would
+ * return, counting from 0, without looking anything up */
+struct skel *dict_peek(const char *key, struct dict *dict, uint n) {
+    struct dict_entry *entry = NULL;
+    struct dict_node *node;
+
+    if (dict == NULL)
+        return NULL;
+
+    dict_mark(dict);
+    node = dict_find(dict, key);
+    if (node == NULL)
+        return NULL;
 
+    entry = node->entry;
+    for (uint i=0; i < n && entry != NULL; i++)
+        entry = entry->next;
+    return entry == NULL ? NULL : entry->skel;
+}
 
 /*
  * Local variables:
@@ -27,6 +27,7 @@
 #include "syntax.h"
 #include "transform.h"
 #include "errcode.h"
+#include "hash.h"
 
 #include <fnmatch.h>
 #include <argz.h>
@@ -440,6 +441,7 @@ void api_entry(const struct augeas *aug) {
     struct error *err = ((struct augeas *) aug)->error;
 
     ((struct augeas *) aug)->api_entries += 1;
+    ((struct augeas *) aug)->api_calls += 1;
 
     if (aug->api_entries > 1)
         return;
@@ -457,6 +459,14 @@ void api_exit(const struct augeas *aug) {
     }
 }
 
+/* Make all aug_node handles handed out so far stale. Every public API
+ * call that may free tree nodes must call this after api_entry, so that
+ * the aug_node_* accessors never dereference a dangling pointer.
+ */
+static void tree_invalidate_handles(struct augeas *aug) {
+    aug->generation += 1;
+}
+
 static int init_root(struct augeas *aug, const char *root0) {
     if (root0 == NULL)
         root0 = getenv(AUGEAS_ROOT_ENV);
@@ -735,6 +745,7 @@ int aug_load(struct augeas *aug) {
     struct tree *vars = tree_child_cr(meta, s_vars);
 
     api_entry(aug);
+    tree_invalidate_handles(aug);
 
     ERR_NOMEM(load == NULL, aug);
 
@@ -890,6 +901,7 @@ int aug_defvar(augeas *aug, const char *name, const char *expr) {
     int result = -1;
 
     api_entry(aug);
+    tree_invalidate_handles(aug);
 
     if (expr == NULL) {
         result = pathx_symtab_undefine(&(aug->symtab), name);
@@ -916,6 +928,7 @@ int aug_defnode(augeas *aug, const char *name, const char *expr,
     struct tree *tree;
 
     api_entry(aug);
+    tree_invalidate_handles(aug);
 
     if (expr == NULL)
         goto error;
@@ -978,6 +991,7 @@ int aug_set(struct augeas *aug, const char *path, const char *value) {
     int result;
 
     api_entry(aug);
+    tree_invalidate_handles(aug);
 
     /* Get-out clause, in case context is broken */
     struct tree *root_ctx = NULL;
@@ -1004,6 +1018,7 @@ int aug_setm(struct augeas *aug, const char *base,
     int result, r;
 
     api_entry(aug);
+    tree_invalidate_handles(aug);
 
     bx = pathx_aug_parse(aug, aug->origin, tree_root_ctx(aug), base, true);
     ERR_BAIL(aug);
@@ -1082,6 +1097,7 @@ int aug_insert(struct augeas *aug, const char *path, const char *label,
     int result = -1;
 
     api_entry(aug);
+    tree_invalidate_handles(aug);
 
     p = pathx_aug_parse(aug, aug->origin, tree_root_ctx(aug), path, true);
     ERR_BAIL(aug);
@@ -1093,6 +1109,206 @@ int aug_insert(struct augeas *aug, const char *path, const char *label,
     return result;
 }
 
+/*
+ * Batched operations
+ */
+
+/* Free the parsed paths in PATHS and PATHS itself */
+static void free_batch_paths(hash_t *paths) {
+    hscan_t scan;
+    hnode_t *node;
+
+    if (paths == NULL)
+        return;
+
+    hash_scan_begin(&scan, paths);
+    while ((node = hash_scan_next(&scan)) != NULL)
+        free_pathx(hnode_get(node));
+    hash_free_nodes(paths);
+    hash_destroy(paths);
+}
+
+/* Return PATH parsed against ROOT_CTX. Operations in the same batch often
+ * use the same path, e.g. to append entries with 'foo[last()+1]', and we
+ * only parse each distinct path once and reset it before evaluating it
+ * again. The result is owned by PATHS */
+static struct pathx *batch_path(struct augeas *aug, hash_t *paths,
+                                struct tree *root_ctx, const char *path) {
+    struct pathx *p = NULL;
+    hnode_t *node;
+    int r;
+
+    node = hash_lookup(paths, path);
+    if (node != NULL) {
+        p = hnode_get(node);
+        pathx_reset(p);
+        return p;
+    }
+
+    p = pathx_aug_parse(aug, aug->origin, root_ctx, path, true);
+    ERR_BAIL(aug);
+
+    r = hash_alloc_insert(paths, path, p);
+    ERR_NOMEM(r < 0, aug);
+    return p;
+ error:
+    free_pathx(p);
+    return NULL;
+}
+
+/* Return true if TREE is the node holding AUGEAS_CONTEXT */
+static bool tree_is_context_meta(const struct augeas *aug,
+                                 const struct tree *tree) {
+    return tree->parent != NULL
+        && tree->parent->parent == aug->origin
+        && streqv(tree->parent->label, s_augeas)
+        && streqv(tree->label, "context");
+}
+
+/* Return true if ANC is TREE or one of its ancestors */
+static bool tree_contains(const struct tree *anc, const struct tree *tree) {
+    while (tree != anc && tree != tree->parent)
+        tree = tree->parent;
+    return tree == anc;
+}
+
+/* Return true if removing the nodes matching P would remove ROOT_CTX or
+ * the node holding AUGEAS_CONTEXT */
+static bool batch_rm_changes_ctx(const struct augeas *aug, struct pathx *p,
+                                 struct tree *root_ctx) {
+    for (struct tree *t = pathx_first(p); t != NULL; t = pathx_next(p)) {
+        if (root_ctx != NULL && tree_contains(t, root_ctx))
+            return true;
+        if (tree_is_context_meta(aug, t))
+            return true;
+        if (t->parent == aug->origin && streqv(t->label, s_augeas))
+            return true;
+    }
+    return false;
+}
+
+static int batch_op(struct augeas *aug, struct aug_op *op, hash_t *paths,
+                    struct tree *root_ctx, bool *ctx_changed) {
+    struct pathx *p;
+    struct tree *tree;
+    int r;
+
+    ARG_CHECK(op->path == NULL, aug, "aug_batch: PATH must be non-NULL");
+
+    p = batch_path(aug, paths, root_ctx, op->path);
+    ERR_BAIL(aug);
+
+    switch (op->op) {
+    case AUG_OP_SET:
+        tree = tree_set(p, op->value);
+        ERR_BAIL(aug);
+        ERR_NOMEM(tree == NULL, aug);
+        if (tree_is_context_meta(aug, tree))
+            *ctx_changed = true;
+        return 0;
+    case AUG_OP_RM:
+        if (batch_rm_changes_ctx(aug, p, root_ctx))
+            *ctx_changed = true;
+        ERR_BAIL(aug);
+        r = tree_rm(p);
+        ERR_BAIL(aug);
+        ERR_NOMEM(r < 0, aug);
+        return r;
+    case AUG_OP_INSERT:
+        ARG_CHECK(op->label == NULL, aug,
+                  "aug_batch: LABEL must be non-NULL for AUG_OP_INSERT");
+        ERR_THROW(strchr(op->label, SEP) != NULL, aug, AUG_ELABEL,
+                  "Label %s contains a /", op->label);
+        r = tree_insert(p, op->label, op->before);
+        ERR_BAIL(aug);
+        ERR_NOMEM(r < 0, aug);
+        return 0;
+    default:
+        ARG_CHECK(true, aug, "aug_batch: unknown operation %d", op->op);
+    }
+ error:
+    return -1;
+}
+
+int aug_batch(struct augeas *aug, struct aug_op *ops, size_t nops) {
+    struct error *err = aug->error;
+    struct error first = { .code = AUG_NOERROR };
+    hash_t *paths = NULL;
+    struct tree *root_ctx = NULL;
+    bool have_ctx = false, ctx_changed = false;
+    int failed = 0;
+    size_t nrun = 0;
+
+    api_entry(aug);
+    tree_invalidate_handles(aug);
+
+    paths = hash_create(HASHCOUNT_T_MAX, NULL, NULL);
+    ERR_NOMEM(paths == NULL, aug);
+
+    for (size_t i = 0; i < nops; i++) {
+        struct aug_op *op = ops + i;
+
+        /* Like aug_set, setting AUGEAS_CONTEXT does not need the context,
+         * so that a broken context can be repaired from within a batch */
+        if (! have_ctx && op->path != NULL
+            && STRNEQ(op->path, AUGEAS_CONTEXT)) {
+            root_ctx = tree_root_ctx(aug);
+            have_ctx = ! HAS_ERR(aug);
+        }
+        if (HAS_ERR(aug))
+            op->result = -1;
+        else
+            op->result = batch_op(aug, op, paths, root_ctx, &ctx_changed);
+        op->error = err->code;
+        nrun += 1;
+        if (err->code == AUG_ENOMEM)
+            goto error;
+
+        if (op->result < 0) {
+            failed += 1;
+            if (first.code == AUG_NOERROR) {
+                /* Remember the first failure and report it on return */
+                first = *err;
+                err->details = NULL;
+            }
+            reset_error(err);
+        }
+
+        if (ctx_changed) {
+            /* Cached paths may refer to the old context node; look the
+             * context up again when the next operation needs it */
+            free_batch_paths(paths);
+            paths = NULL;
+            ctx_changed = false;
+            root_ctx = NULL;
+            have_ctx = false;
+
+            paths = hash_create(HASHCOUNT_T_MAX, NULL, NULL);
+            ERR_NOMEM(paths == NULL, aug);
+        }
+    }
+
+    free_batch_paths(paths);
+    if (first.code != AUG_NOERROR) {
+        err->code = first.code;
+        err->minor = first.minor;
+        err->details = first.details;
+        err->minor_details = first.minor_details;
+    }
+    api_exit(aug);
+    return failed;
+ error:
+    /* The operations we did not get to fail with the reason we stopped */
+    for (size_t i = nrun; i < nops; i++) {
+        ops[i].result = -1;
+        ops[i].error = err->code;
+    }
+    free(first.details);
+    free_batch_paths(paths);
+    api_exit(aug);
+    return -1;
+}
+
 struct tree *make_tree(char *label, char *value, struct tree *parent,
                        struct tree *children) {
     struct tree *tree;
@@ -1175,6 +1391,7 @@ int aug_rm(struct augeas *aug, const char *path) {
     int result;
 
     api_entry(aug);
+    tree_invalidate_handles(aug);
 
     p = pathx_aug_parse(aug, aug->origin, tree_root_ctx(aug), path, true);
     ERR_BAIL(aug);
@@ -1253,6 +1470,7 @@ int aug_mv(struct augeas *aug, const char *src, const char *dst) {
     int r, ret;
 
     api_entry(aug);
+    tree_invalidate_handles(aug);
 
     ret = -1;
     s = pathx_aug_parse(aug, aug->origin, tree_root_ctx(aug), src, true);
@@ -1317,6 +1535,7 @@ int aug_cp(struct augeas *aug, const char *src, const char *dst) {
     int r, ret;
 
     api_entry(aug);
+    tree_invalidate_handles(aug);
 
     ret = -1;
     s = pathx_aug_parse(aug, aug->origin, tree_root_ctx(aug), src, true);
@@ -1362,6 +1581,7 @@ int aug_rename(struct augeas *aug, const char *src, const char *lbl) {
     int count = 0;
 
     api_entry(aug);
+    tree_invalidate_handles(aug);
 
     ret = -1;
     ERR_THROW(strchr(lbl, '/') != NULL, aug, AUG_ELABEL,
@@ -1444,8 +1664,188 @@ int aug_match(const struct augeas *aug, const char *pathin, char ***matches) {
     return -1;
 }
 
+static void node_handle(const struct augeas *aug, struct tree *tree,
+                        aug_node *node) {
+    node->priv = tree;
+    node->generation = aug->generation;
+}
+
+/* Return the tree node behind NODE, or report an error and return NULL
+ * if NODE was handed out before the tree was last modified */
+static struct tree *node_tree(const struct augeas *aug,
+                              const aug_node *node) {
+    ARG_CHECK(node == NULL || node->priv == NULL, aug,
+              "invalid node handle");
+    ARG_CHECK(node->generation != aug->generation, aug,
+              "stale node handle: the tree was modified since it was created");
+    return node->priv;
+ error:
+    return NULL;
+}
+
+int aug_match_nodes(const struct augeas *aug, const char *pathin,
+                    aug_node **nodes) {
+    struct pathx *p = NULL;
+    struct tree *tree;
+    int cnt = 0, r;
+
+    api_entry(aug);
+
+    if (nodes != NULL)
+        *nodes = NULL;
+
+    if (STREQ(pathin, "/")) {
+        pathin = "/*";
+    }
+
+    p = pathx_aug_parse(aug, aug->origin, tree_root_ctx(aug), pathin, true);
+    ERR_BAIL(aug);
+
+    /* The number of matches including hidden nodes is an upper bound for
+     * the size of the result, which lets us fill it in a single pass */
+    r = pathx_find_one(p, &tree);
+    ERR_BAIL(aug);
+
+    if (nodes != NULL && r > 0) {
+        r = ALLOC_N(*nodes, r);
+        ERR_NOMEM(r < 0, aug);
+    }
+
+    for (; tree != NULL; tree = pathx_next(p)) {
+        if (TREE_HIDDEN(tree))
+            continue;
+        if (nodes != NULL)
+            node_handle(aug, tree, (*nodes) + cnt);
+        cnt += 1;
+    }
+
+    free_pathx(p);
+    api_exit(aug);
+    return cnt;
+
+ error:
+    if (nodes != NULL) {
+        free(*nodes);
+        *nodes = NULL;
+    }
+    free_pathx(p);
+    api_exit(aug);
+    return -1;
+}
+
+int aug_node_label(const struct augeas *aug, const aug_node *node,
+                   const char **label) {
+    struct tree *tree;
+
+    api_entry(aug);
+
+    tree = node_tree(aug, node);
+    ERR_BAIL(aug);
+
+    if (label != NULL)
+        *label = tree->label;
+
+    api_exit(aug);
+    return 0;
+ error:
+    api_exit(aug);
+    return -1;
+}
+
+int aug_node_value(const struct augeas *aug, const aug_node *node,
+                   const char **value) {
+    struct tree *tree;
+
+    api_entry(aug);
+
+    tree = node_tree(aug, node);
+    ERR_BAIL(aug);
+
+    if (value != NULL)
+        *value = tree->value;
+
+    api_exit(aug);
+    return 0;
+ error:
+    api_exit(aug);
+    return -1;
+}
+
+int aug_node_children(const struct augeas *aug, const aug_node *node,
+                      aug_node **children) {
+    struct tree *tree;
+    int cnt = 0, r;
+
+    api_entry(aug);
+
+    if (children != NULL)
+        *children = NULL;
+
+    tree = node_tree(aug, node);
+    ERR_BAIL(aug);
+
+    list_for_each(c, tree->children) {
+        if (! TREE_HIDDEN(c))
+            cnt += 1;
+    }
+
+    if (children != NULL && cnt > 0) {
+        int i = 0;
+        r = ALLOC_N(*children, cnt);
+        ERR_NOMEM(r < 0, aug);
+        list_for_each(c, tree->children) {
+            if (! TREE_HIDDEN(c))
+                node_handle(aug, c, (*children) + i++);
+        }
+    }
+
+    api_exit(aug);
+    return cnt;
+ error:
+    api_exit(aug);
+    return -1;
+}
+
+int aug_node_path(const struct augeas *aug, const aug_node *node,
+                  char **path) {
+    struct tree *tree;
+
+    api_entry(aug);
+
+    ARG_CHECK(path == NULL, aug, "aug_node_path: PATH must be non-NULL");
+    *path = NULL;
+
+    tree = node_tree(aug, node);
+    ERR_BAIL(aug);
+
+    *path = path_of_tree(tree);
+    ERR_NOMEM(*path == NULL, aug);
+
+    api_exit(aug);
+    return 0;
+ error:
+    api_exit(aug);
+    return -1;
+}
+
+/* The files that need to be written by aug_save */
+struct save_list {
+    struct save_file *files;
+    size_t            nfiles;
+    size_t            size;
+};
+
+static void free_save_list(struct save_list *list) {
+    for (size_t i=0; i < list->nfiles; i++)
+        free(list->files[i].path);
+    free(list->files);
+}
+
+/* Add the dirty files underneath TREE to LIST. PATH is the path of
+ * TREE's parent. On success, LIST owns the path of every file added
+ * to it */
 static int tree_save(struct augeas *aug, struct tree *tree,
-                     const char *path) {
+                     const char *path, struct save_list *list) {
     int result = 0;
     struct tree *meta = tree_child_cr(aug->origin, s_augeas);
     struct tree *load = tree_child_cr(meta, s_load);
@@ -1464,7 +1864,10 @@ static int tree_save(struct augeas *aug, struct tree *tree,
                 continue;
             }
             list_for_each(xfm, load->children) {
-                if (transform_applies(xfm, tpath)) {
+                int r = transform_applies(aug, xfm, tpath);
+                if (r < 0) {
+                    result = -1;
+                } else if (r > 0) {
                     if (transform == NULL || transform == xfm) {
                         transform = xfm;
                     } else {
@@ -1484,11 +1887,23 @@ static int tree_save(struct augeas *aug, struct tree *tree,
                 }
             }
             if (transform != NULL) {
-                int r = transform_save(aug, transform, tpath, t);
-                if (r == -1)
-                    result = -1;
+                if (list->nfiles >= list->size) {
+                    size_t size = 2 * list->size;
+                    if (size < 8) size = 8;
+                    if (REALLOC_N(list->files, size) < 0) {
+                        free(tpath);
+                        result = -1;
+                        continue;
+                    }
+                    list->size = size;
+                }
+                list->files[list->nfiles].xfm = transform;
+                list->files[list->nfiles].path = tpath;
+                list->files[list->nfiles].tree = t;
+                list->nfiles += 1;
+                tpath = NULL;
             } else {
-                if (tree_save(aug, t->children, tpath) == -1)
+                if (tree_save(aug, t->children, tpath, list) == -1)
                     result = -1;
             }
             free(tpath);
@@ -1529,13 +1944,38 @@ static int unlink_removed_files(struct augeas *aug,
         "descendant-or-self::*[path][count(error) = 0]";
 
     int result = 0;
+    hash_t *labels = NULL;
 
     if (! files->dirty)
         return 0;
 
+    /* Directories can hold thousands of files; index the children of
+     * FILES by label so that matching them up with the children of META
+     * does not take time quadratic in the size of the directory. If we
+     * can't build the index, we fall back to tree_child */
+    labels = hash_create(HASHCOUNT_T_MAX, NULL, NULL);
+    list_for_each(tf, files->children) {
+        if (labels == NULL)
+            break;
+        if (tf->label == NULL || hash_lookup(labels, tf->label) != NULL)
+            continue;
+        if (hash_alloc_insert(labels, tf->label, tf) < 0) {
+            hash_free_nodes(labels);
+            hash_destroy(labels);
+            labels = NULL;
+        }
+    }
+
     for (struct tree *tm = meta->children; tm != NULL;) {
-        struct tree *tf = tree_child(files, tm->label);
+        struct tree *tf = NULL;
         struct tree *next = tm->next;
+        if (labels != NULL) {
+            hnode_t *node = hash_lookup(labels, tm->label);
+            if (node != NULL)
+                tf = hnode_get(node);
+        } else {
+            tf = tree_child(files, tm->label);
+        }
         if (tf == NULL) {
             /* Unlink all files in tm */
             struct pathx *px = NULL;
@@ -1557,6 +1997,10 @@ static int unlink_removed_files(struct augeas *aug,
         }
         tm = next;
     }
+    if (labels != NULL) {
+        hash_free_nodes(labels);
+        hash_destroy(labels);
+    }
     return result;
 }
 
@@ -1568,6 +2012,7 @@ int aug_save(struct augeas *aug) {
     struct tree *load = tree_child_cr(meta, s_load);
 
     api_entry(aug);
+    tree_invalidate_handles(aug);
 
     if (update_save_flags(aug) < 0)
         goto error;
@@ -1581,8 +2026,14 @@ int aug_save(struct augeas *aug) {
         transform_validate(aug, xfm);
 
     if (files->dirty) {
-        if (tree_save(aug, files->children, AUGEAS_FILES_TREE) == -1)
+        struct save_list list;
+
+        MEMZERO(&list, 1);
+        if (tree_save(aug, files->children, AUGEAS_FILES_TREE, &list) == -1)
+            ret = -1;
+        if (transform_save_files(aug, list.files, list.nfiles) == -1)
             ret = -1;
+        free_save_list(&list);
 
         /* Remove files whose entire subtree was removed. */
         if (meta_files != NULL) {
@@ -1837,6 +2288,7 @@ int aug_text_store(augeas *aug, const char *lens, const char *node,
     int result = -1, r;
 
     api_entry(aug);
+    tree_invalidate_handles(aug);
 
     /* Validate PATH is syntactically correct */
     p = pathx_aug_parse(aug, aug->origin, tree_root_ctx(aug), path, true);
@@ -1866,6 +2318,7 @@ int aug_text_retrieve(struct augeas *aug, const char *lens,
     int r;
 
     api_entry(aug);
+    tree_invalidate_handles(aug);
 
     tree = tree_find(aug, path);
     ERR_BAIL(aug);
@@ -1936,6 +2389,7 @@ int aug_transform(struct augeas *aug, const char *lens,
     char *lensname = NULL, *xfmname = NULL;
 
     api_entry(aug);
+    tree_invalidate_handles(aug);
 
     ERR_NOMEM(meta == NULL || load == NULL, aug);
 
@@ -2028,6 +2482,7 @@ void aug_close(struct augeas *aug) {
 
     /* There's no point in bothering with api_entry/api_exit here */
     free_tree(aug->origin);
+    free_xfm_filters(aug);
     unref(aug->modules, module);
     if (aug->error->exn != NULL) {
         aug->error->exn->ref = 0;
@@ -2036,6 +2491,8 @@ void aug_close(struct augeas *aug) {
     }
     free((void *) aug->root);
     free(aug->modpathz);
+    free(aug->tc_cache);
+    free(aug->tc_keys);
     free_symtab(aug->symtab);
     unref(aug->error->info, info);
     free(aug->error->details);
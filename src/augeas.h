@@ -226,6 +226,58 @@ int aug_insert(augeas *aug, const char *path, const char *label, int before);
  */
 int aug_rm(augeas *aug, const char *path);
 
+/* Type: aug_op_t
+ *
+ * The kind of operation performed by an entry in the array passed to
+ * AUG_BATCH
+ */
+typedef enum {
+    AUG_OP_SET,         /* aug_set(PATH, VALUE) */
+    AUG_OP_RM,          /* aug_rm(PATH) */
+    AUG_OP_INSERT       /* aug_insert(PATH, LABEL, BEFORE) */
+} aug_op_t;
+
+/* Type: aug_op
+ *
+ * One operation for AUG_BATCH. The caller fills in OP and the arguments
+ * for that operation; AUG_BATCH fills in RESULT with what the
+ * corresponding single call would have returned, and ERROR with the
+ * error code that call would have reported.
+ */
+struct aug_op {
+    aug_op_t     op;
+    const char  *path;
+    const char  *value;     /* Only used for AUG_OP_SET */
+    const char  *label;     /* Only used for AUG_OP_INSERT */
+    int          before;    /* Only used for AUG_OP_INSERT */
+    int          result;
+    int          error;
+};
+
+/* Function: aug_batch
+ *
+ * Perform the NOPS operations in OPS in order, as if each of them had been
+ * made with a separate call to aug_set, aug_rm or aug_insert. The batch
+ * is much cheaper than the individual calls: the path in AUGEAS_CONTEXT
+ * is only looked up once, and operations that use the same path share
+ * one parsed copy of it. The context is looked up again when an
+ * operation changes /augeas/context or removes the context node.
+ *
+ * A failing operation does not stop the batch; its RESULT is set to -1
+ * and its ERROR to the reason for the failure, and the remaining
+ * operations are still performed. That includes failing to look up the
+ * context; as with aug_set, an operation on AUGEAS_CONTEXT itself does
+ * not need the context and can repair it. After the call, AUG_ERROR
+ * reports the first failure. If the batch has to stop early because it
+ * ran out of memory, the operations it did not perform have their
+ * RESULT set to -1 and their ERROR to AUG_ENOMEM.
+ *
+ * Returns:
+ * the number of operations that failed, which is 0 if all of them
+ * succeeded, or -1 if the batch could not be run at all.
+ */
+int aug_batch(augeas *aug, struct aug_op *ops, size_t nops);
+
 /* Function: aug_mv
  *
  * Move the node SRC to DST. SRC must match exactly one node in the
@@ -295,6 +347,78 @@ int aug_rename(augeas *aug, const char *src, const char *lbl);
  */
 int aug_match(const augeas *aug, const char *path, char ***matches);
 
+/* Type: aug_node
+ *
+ * An opaque handle to a node in the tree, filled in by AUG_MATCH_NODES and
+ * AUG_NODE_CHILDREN. Handles can be copied freely and are only valid until
+ * the next call that may modify the tree, such as aug_set, aug_rm or
+ * aug_load; after that, passing them to any of the aug_node functions
+ * fails with AUG_EBADARG. The fields are private and must not be used by
+ * callers.
+ */
+typedef struct aug_node {
+    void        *priv;
+    unsigned int generation;
+} aug_node;
+
+/* Function: aug_match_nodes
+ *
+ * Like AUG_MATCH, but return handles to the matching nodes instead of
+ * their paths. This avoids constructing a path for every match and
+ * parsing it again when its label or value are read, and is therefore
+ * much faster when reading many nodes.
+ *
+ * If NODES is non-NULL, an array with the returned number of elements
+ * will be allocated and filled with handles to the matches. The caller
+ * must free the array, but not the handles in it.
+ *
+ * Returns:
+ * -1 on error, or the total number of matches (which might be 0).
+ */
+int aug_match_nodes(const augeas *aug, const char *path, aug_node **nodes);
+
+/* Function: aug_node_label
+ *
+ * Lookup the label of the node NODE and store it in *LABEL.
+ *
+ * Returns:
+ * 0 on success, or -1 if NODE is stale or invalid
+ */
+int aug_node_label(const augeas *aug, const aug_node *node,
+                   const char **label);
+
+/* Function: aug_node_value
+ *
+ * Lookup the value of the node NODE and store it in *VALUE, which might
+ * be NULL if the node has no value.
+ *
+ * Returns:
+ * 0 on success, or -1 if NODE is stale or invalid
+ */
+int aug_node_value(const augeas *aug, const aug_node *node,
+                   const char **value);
+
+/* Function: aug_node_children
+ *
+ * If CHILDREN is non-NULL, allocate an array and fill it with handles to
+ * the children of NODE, in tree order. The caller must free the array.
+ *
+ * Returns:
+ * -1 on error, or the number of children of NODE (which might be 0).
+ */
+int aug_node_children(const augeas *aug, const aug_node *node,
+                      aug_node **children);
+
+/* Function: aug_node_path
+ *
+ * Store a path that matches exactly NODE in *PATH, in the same form
+ * that AUG_MATCH uses. The caller must free *PATH.
+ *
+ * Returns:
+ * 0 on success, or -1 on error
+ */
+int aug_node_path(const augeas *aug, const aug_node *node, char **path);
+
 /* Function: aug_save
  *
  * Write all pending changes to disk.
@@ -311,6 +435,10 @@ int aug_match(const augeas *aug, const char *path, char ***matches);
  * move the original file to a new file with extension ".augsave".
  *
  * If neither of these flags is set, overwrite the original file.
+ *
+ * If AUG_SAVE_NOOP is set, nothing is written to disk. Instead, the
+ * changes that would have been made to each file are stored as a unified
+ * diff in /augeas/files/PATH/diff, where PATH is the path of the file.
  */
 int aug_save(augeas *aug);
 
@@ -41,6 +41,9 @@ static void usage(void) {
     fprintf(stderr, "  -t, --trace        trace module loading\n");
     fprintf(stderr, "  --nostdinc         do not search the builtin default directories for modules\n");
     fprintf(stderr, "  --notypecheck      do not typecheck lenses\n");
+    fprintf(stderr, "  --typecheck-cache FILE\n"
+                    "                     remember lens typecheck results in FILE and skip\n"
+                    "                     typechecks of modules that have not changed\n");
     fprintf(stderr, "  --version          print version information and exit\n");
 
     exit(EXIT_FAILURE);
@@ -74,7 +77,8 @@ int main(int argc, char **argv) {
     enum {
         VAL_NO_STDINC = CHAR_MAX + 1,
         VAL_NO_TYPECHECK = VAL_NO_STDINC + 1,
-        VAL_VERSION = VAL_NO_TYPECHECK + 1
+        VAL_VERSION = VAL_NO_TYPECHECK + 1,
+        VAL_TYPECHECK_CACHE = VAL_VERSION + 1
     };
     struct option options[] = {
         { "help",      0, 0, 'h' },
@@ -83,6 +87,7 @@ int main(int argc, char **argv) {
         { "nostdinc",  0, 0, VAL_NO_STDINC },
         { "notypecheck",  0, 0, VAL_NO_TYPECHECK },
         { "version",  0, 0, VAL_VERSION },
+        { "typecheck-cache", 1, 0, VAL_TYPECHECK_CACHE },
         { 0, 0, 0, 0}
     };
     int idx;
@@ -110,6 +115,12 @@ int main(int argc, char **argv) {
         case VAL_VERSION:
             print_version = true;
             break;
+        case VAL_TYPECHECK_CACHE:
+            if (setenv(AUGEAS_TYPECHECK_CACHE_ENV, optarg, 1) < 0) {
+                fprintf(stderr, "Memory exhausted\n");
+                return 2;
+            }
+            break;
         default:
             usage();
             break;
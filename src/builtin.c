@@ -209,22 +209,25 @@ static struct value *lens_put(struct info *info, struct value *l,
     assert(tree->tag == V_TREE);
     assert(str->tag == V_STRING);
 
-    struct memstream ms;
     struct value *v;
     struct lns_error *err;
+    char *text;
+    size_t size;
+    int r;
 
-    init_memstream(&ms);
-    lns_put(ms.stream, l->lens, tree->origin->children,
-            str->string->str, &err);
-    close_memstream(&ms);
+    r = lns_put(l->lens, tree->origin->children, str->string->str,
+                &text, &size, &err);
 
-    if (err == NULL && ! HAS_ERR(info)) {
+    if (r < 0) {
+        v = make_exn_value(ref(info), "Out of memory");
+        free_lns_error(err);
+    } else if (err == NULL && ! HAS_ERR(info)) {
         v = make_value(V_STRING, ref(info));
-        v->string = make_string(ms.buf);
+        v->string = make_string(text);
     } else {
         v = make_exn_lns_error(info, err, str->string->str);
         free_lns_error(err);
-        FREE(ms.buf);
+        FREE(text);
     }
     return v;
 }
@@ -33,6 +33,8 @@
 #include <limits.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <strings.h>
 
 #include "internal.h"
 #include "memory.h"
@@ -48,7 +50,7 @@ typedef unsigned char uchar;
 #define F(expr) if ((expr) < 0) goto error
 
 /* Which algorithm to use in FA_MINIMIZE */
-int fa_minimization_algorithm = FA_MIN_HOPCROFT;
+int fa_minimization_algorithm = FA_MIN_VALMARI;
 
 /* A finite automaton. INITIAL is both the initial state and the head of
  * the list of all states. Any state that is allocated for this automaton
@@ -82,6 +84,9 @@ struct state {
     unsigned int  live : 1;
     unsigned int  reachable : 1;
     unsigned int  visited : 1;   /* Used in various places to track progress */
+    /* The number of the state, for algorithms that need to look states
+       up by number; set by csr_make and mark_live */
+    unsigned int  index;
     /* Array of transitions. The TUSED first entries are used, the array
        has allocated room for TSIZE */
     size_t        tused;
@@ -118,11 +123,11 @@ static bitset *bitset_init(size_t nbits) {
 }
 
 static inline void bitset_clr(bitset *bs, unsigned int bit) {
-    bs[bit/UINT_BIT] &= ~(1 << (bit % UINT_BIT));
+    bs[bit/UINT_BIT] &= ~(1U << (bit % UINT_BIT));
 }
 
 static inline void bitset_set(bitset *bs, unsigned int bit) {
-    bs[bit/UINT_BIT] |= 1 << (bit % UINT_BIT);
+    bs[bit/UINT_BIT] |= 1U << (bit % UINT_BIT);
 }
 
 ATTRIBUTE_PURE
@@ -130,24 +135,119 @@ static inline int bitset_get(const bitset * const bs, unsigned int bit) {
     return (bs[bit/UINT_BIT] >> bit % UINT_BIT) & 1;
 }
 
+static void bitset_free(bitset *bs) {
+    free(bs);
+}
+
+/*
+ * Character sets
+ *
+ * A set of characters is a bitset of UCHAR_NUM bits in 64 bit words, so
+ * that operations on whole sets and on ranges of characters work a word
+ * at a time, and iterating over a set skips the characters that are not
+ * in it.
+ */
+#define CHARSET_WORD_BIT 64
+#define CHARSET_WORDS (UCHAR_NUM / CHARSET_WORD_BIT)
+
+struct charset {
+    uint64_t words[CHARSET_WORDS];
+};
+
 ATTRIBUTE_PURE
-static inline bool bitset_disjoint(const bitset *const bs1,
-                                   const bitset *const bs2,
-                                   size_t nbits) {
-    for (int i=0; i < (nbits + UINT_BIT) / UINT_BIT; i++) {
-        if (bs1[i] & bs2[i])
-            return false;
+static inline bool charset_has(const struct charset *cs, uchar c) {
+    return (cs->words[c / CHARSET_WORD_BIT] >> (c % CHARSET_WORD_BIT)) & 1;
+}
+
+static inline void charset_add(struct charset *cs, uchar c) {
+    cs->words[c / CHARSET_WORD_BIT] |= UINT64_C(1) << (c % CHARSET_WORD_BIT);
+}
+
+/* Bits MIN % 64 up to MAX % 64 of one word, for MIN and MAX in the
+ * same word */
+static inline uint64_t charset_mask(unsigned int min, unsigned int max) {
+    return (~UINT64_C(0) << (min % CHARSET_WORD_BIT))
+        & (~UINT64_C(0) >> (CHARSET_WORD_BIT - 1 - max % CHARSET_WORD_BIT));
+}
+
+/* Add the characters in [MIN, MAX] to CS */
+static void charset_add_range(struct charset *cs, uchar min, uchar max) {
+    unsigned int wmin = min / CHARSET_WORD_BIT;
+    unsigned int wmax = max / CHARSET_WORD_BIT;
+
+    if (wmin == wmax) {
+        cs->words[wmin] |= charset_mask(min, max);
+    } else {
+        cs->words[wmin] |= charset_mask(min, CHARSET_WORD_BIT - 1);
+        for (unsigned int w = wmin + 1; w < wmax; w++)
+            cs->words[w] = ~UINT64_C(0);
+        cs->words[wmax] |= charset_mask(0, max);
     }
-    return true;
 }
 
-static void bitset_free(bitset *bs) {
-    free(bs);
+/* Remove the characters in [MIN, MAX] from CS */
+static void charset_del_range(struct charset *cs, uchar min, uchar max) {
+    struct charset range;
+
+    MEMZERO(&range, 1);
+    charset_add_range(&range, min, max);
+    for (int w = 0; w < CHARSET_WORDS; w++)
+        cs->words[w] &= ~range.words[w];
+}
+
+static void charset_negate(struct charset *cs) {
+    for (int w = 0; w < CHARSET_WORDS; w++)
+        cs->words[w] = ~cs->words[w];
 }
 
-static void bitset_negate(bitset *bs, size_t nbits) {
-    for (int i=0; i < (nbits + UINT_BIT) / UINT_BIT; i++)
-        bs[i] = ~ bs[i];
+ATTRIBUTE_PURE
+static bool charset_disjoint(const struct charset *cs1,
+                             const struct charset *cs2) {
+    uint64_t common = 0;
+    for (int w = 0; w < CHARSET_WORDS; w++)
+        common |= cs1->words[w] & cs2->words[w];
+    return common == 0;
+}
+
+ATTRIBUTE_PURE
+static unsigned int charset_count(const struct charset *cs) {
+    unsigned int count = 0;
+    for (int w = 0; w < CHARSET_WORDS; w++)
+        for (uint64_t bits = cs->words[w]; bits != 0; bits &= bits - 1)
+            count += 1;
+    return count;
+}
+
+/* Return the smallest character that is at least C and that is in CS if
+ * MEMBER is true, or not in CS if MEMBER is false. Return UCHAR_NUM if
+ * there is no such character */
+ATTRIBUTE_PURE
+static int charset_next(const struct charset *cs, int c, bool member) {
+    while (c < UCHAR_NUM) {
+        uint64_t bits = cs->words[c / CHARSET_WORD_BIT];
+        if (! member)
+            bits = ~bits;
+        bits &= ~UINT64_C(0) << (c % CHARSET_WORD_BIT);
+        if (bits != 0)
+            return c - c % CHARSET_WORD_BIT + ffsll(bits) - 1;
+        c += CHARSET_WORD_BIT - c % CHARSET_WORD_BIT;
+    }
+    return UCHAR_NUM;
+}
+
+/* Add the other case of every ASCII letter in CS to it. Return true if
+ * CS contains any letters. All letters are in the same word, and each
+ * lower case letter is 'a' - 'A' bits after its upper case letter */
+static bool charset_case_expand(struct charset *cs) {
+    const unsigned int w = 'A' / CHARSET_WORD_BIT;
+    const unsigned int shift = 'a' - 'A';
+    const uint64_t upper = charset_mask('A', 'Z');
+    uint64_t letters;
+
+    assert('z' / CHARSET_WORD_BIT == w);
+    letters = (cs->words[w] & upper) | ((cs->words[w] >> shift) & upper);
+    cs->words[w] |= letters | (letters << shift);
+    return letters != 0;
 }
 
 /*
@@ -191,8 +291,8 @@ struct re {
             struct re *exp2;
         };
         struct {                  /* CSET */
-            bool    negate;
-            bitset *cset;
+            bool            negate;
+            struct charset *cset;
             /* Whether we can use character ranges when converting back
              * to a string */
             unsigned int no_ranges:1;
@@ -225,9 +325,6 @@ struct re_str {
 
 static struct re *parse_regexp(struct re_parse *parse);
 
-/* A map from a set of states to a state. */
-typedef hash_t state_set_hash;
-
 static hash_val_t ptr_hash(const void *p);
 
 static const int array_initial_size = 4;
@@ -248,11 +345,6 @@ struct state_set {
     void            **data;
 };
 
-struct state_set_list {
-    struct state_set_list *next;
-    struct state_set      *set;
-};
-
 /* Clean up FA by removing dead transitions and states and reducing
  * transitions. Unreachable states are freed. The return value is the same
  * as FA; returning it is merely a convenience.
@@ -299,13 +391,10 @@ static void print_char_set(struct re *set) {
     else
         printf("[");
     for (from = UCHAR_MIN; from <= UCHAR_MAX; from = to+1) {
-        while (bitset_get(set->cset, from) == set->negate)
-            from += 1;
+        from = charset_next(set->cset, from, !set->negate);
         if (from > UCHAR_MAX)
             break;
-        for (to = from;
-             to < UCHAR_MAX && (bitset_get(set->cset, to+1) == !set->negate);
-             to++);
+        to = charset_next(set->cset, from, set->negate) - 1;
         if (to == from) {
             printf("%c", from);
         } else {
@@ -639,6 +728,7 @@ static void state_set_remove(struct state_set *set,
        if (set->data != NULL)
            memmove(set->data + p, set->data + p + 1,
                    sizeof(*set->data) * (set->used - p - 1));
+       set->used -= 1;
    } else {
        int p = state_set_index(set, s);
        if (p >= 0) {
@@ -647,42 +737,6 @@ static void state_set_remove(struct state_set *set,
    }
 }
 
-/* Only add S if it's not in SET yet. Return 1 if S was added, 0 if it was
-   already in the set and -1 on error. */
-ATTRIBUTE_RETURN_CHECK
-static int state_set_add(struct state_set *set, struct state *s) {
-    if (set->sorted) {
-        int p = state_set_pos(set, s);
-        if (p < set->used && set->states[p] == s)
-            return 0;
-        if (set->size == set->used)
-            if (state_set_expand(set) < 0)
-                return -1;
-        while (p < set->used && set->states[p] <= s)
-            p += 1;
-        if (p < set->used) {
-            memmove(set->states + p + 1, set->states + p,
-                    sizeof(*set->states) * (set->used - p));
-            if (set->data != NULL)
-                memmove(set->data + p + 1, set->data + p,
-                        sizeof(*set->data) * (set->used - p));
-        }
-        set->states[p] = s;
-        set->used += 1;
-    } else {
-        if (state_set_index(set, s) >= 0)
-            return 0;
-        if (state_set_push(set, s) < 0)
-            goto error;
-    }
-    return 1;
- error:
-    /* We do this to provoke a SEGV as early as possible */
-    FREE(set->states);
-    FREE(set->data);
-    return -1;
-}
-
 static struct state *state_set_pop(struct state_set *set) {
     struct state *s = NULL;
     if (set->used > 0)
@@ -690,13 +744,6 @@ static struct state *state_set_pop(struct state_set *set) {
     return s;
 }
 
-static struct state *state_set_pop_data(struct state_set *set, void **d) {
-    struct state *s = NULL;
-    s = state_set_pop(set);
-    *d = set->data[set->used];
-    return s;
-}
-
 static void *state_set_find_data(struct state_set *set, struct state *s) {
     int i = state_set_index(set, s);
     if (i >= 0)
@@ -705,23 +752,6 @@ static void *state_set_find_data(struct state_set *set, struct state *s) {
         return NULL;
 }
 
-static int state_set_equal(const struct state_set *set1,
-                           const struct state_set *set2) {
-    if (set1->used != set2->used)
-        return 0;
-    if (set1->sorted && set2->sorted) {
-        for (int i = 0; i < set1->used; i++)
-            if (set1->states[i] != set2->states[i])
-                return 0;
-        return 1;
-    } else {
-        for (int i=0; i < set1->used; i++)
-            if (state_set_index(set2, set1->states[i]) == -1)
-                return 0;
-        return 1;
-    }
-}
-
 #if 0
 static void state_set_compact(struct state_set *set) {
     while (set->used > 0 && set->states[set->used] == NULL)
@@ -739,35 +769,6 @@ static void state_set_compact(struct state_set *set) {
 }
 #endif
 
-/* Add an entry (FST, SND) to SET. FST is stored in SET->STATES, and SND is
-   stored in SET->DATA at the same index.
-*/
-ATTRIBUTE_RETURN_CHECK
-static int state_pair_push(struct state_set **set,
-                           struct state *fst, struct state *snd) {
-    if (*set == NULL)
-        *set = state_set_init(-1, S_DATA);
-    if (*set == NULL)
-        return -1;
-    int i = state_set_push(*set, fst);
-    if (i == -1)
-        return -1;
-    (*set)->data[i] = snd;
-
-    return 0;
-}
-
-/* Return the index of the pair (FST, SND) in SET, or -1 if SET contains no
-   such pair.
- */
-static int state_pair_find(struct state_set *set, struct state *fst,
-                           struct state *snd) {
-    for (int i=0; i < set->used; i++)
-        if (set->states[i] == fst && set->data[i] == snd)
-            return i;
-    return -1;
-}
-
 /* Jenkins' hash for void* */
 static hash_val_t ptr_hash(const void *p) {
     hash_val_t hash = 0;
@@ -783,63 +784,6 @@ static hash_val_t ptr_hash(const void *p) {
     return hash;
 }
 
-typedef hash_t state_triple_hash;
-
-static hash_val_t pair_hash(const void *key) {
-    register struct state *const *pair = key;
-    return pair[0]->hash + pair[1]->hash;
-}
-
-static int pair_cmp(const void *key1, const void *key2) {
-    return memcmp(key1, key2, 2*sizeof(struct state *));
-}
-
-static void state_triple_node_free(hnode_t *node, ATTRIBUTE_UNUSED void *ctx) {
-    free((void *) hnode_getkey(node));
-    free(node);
-}
-
-static state_triple_hash *state_triple_init(void) {
-    state_triple_hash *hash;
-
-    hash = hash_create(HASHCOUNT_T_MAX, pair_cmp, pair_hash);
-    if (hash == NULL)
-        return NULL;
-    hash_set_allocator(hash, NULL, state_triple_node_free, NULL);
-    return hash;
-}
-
-ATTRIBUTE_RETURN_CHECK
-static int state_triple_push(state_triple_hash *hash,
-                             struct state *s1,
-                             struct state *s2,
-                             struct state *s3) {
-    struct state **pair;
-    if (ALLOC_N(pair, 2) < 0)
-        return -1;
-    pair[0] = s1;
-    pair[1] = s2;
-    return hash_alloc_insert(hash, pair, s3);
-}
-
-static struct state * state_triple_thd(state_triple_hash *hash,
-                                       struct state *s1,
-                                       struct state *s2) {
-    struct state *pair[2];
-    hnode_t *node;
-    pair[0] = s1;
-    pair[1] = s2;
-    node = hash_lookup(hash, pair);
-    return (node == NULL) ? NULL : (struct state *) hnode_get(node);
-}
-
-static void state_triple_free(state_triple_hash *hash) {
-    if (hash != NULL) {
-        hash_free_nodes(hash);
-        hash_destroy(hash);
-    }
-}
-
 /*
  * State operations
  */
@@ -914,34 +858,73 @@ static struct state_set *fa_accept_states(struct fa *fa) {
 /* Mark all live states, i.e. states from which an accepting state can be
    reached. All states have their REACHABLE and LIVE flags set
    appropriately.
+
+   We search backwards from the accepting states, along the edges of a
+   reverse graph in CSR form: the predecessors of state Q are PREDS[I] for
+   PSTART[Q] <= I < PSTART[Q+1]
  */
 ATTRIBUTE_RETURN_CHECK
 static int mark_live(struct fa *fa) {
-    int changed;
+    struct state **states = NULL;
+    unsigned int *pstart = NULL, *preds = NULL, *worklist = NULL;
+    unsigned int nstates = 0, ntrans = 0, nworklist = 0;
+    int result = -1;
 
     F(mark_reachable(fa));
 
     list_for_each(s, fa->initial) {
+        s->index = nstates++;
         s->live = s->reachable && s->accept;
+        if (s->reachable)
+            ntrans += s->tused;
     }
 
-    do {
-        changed = 0;
-        list_for_each(s, fa->initial) {
-            if (! s->live && s->reachable) {
-                for_each_trans(t, s) {
-                    if (t->to->live) {
-                        s->live = 1;
-                        changed = 1;
-                        break;
-                    }
-                }
+    F(ALLOC_N(states, nstates));
+    F(ALLOC_N(pstart, nstates + 1));
+    F(ALLOC_N(preds, ntrans));
+    F(ALLOC_N(worklist, nstates));
+
+    /* Count the predecessors of each state in PSTART[Q+1], turn the
+     * counts into offsets, and fill PREDS. Filling moves each PSTART[Q]
+     * to where PSTART[Q+1] was */
+    list_for_each(s, fa->initial) {
+        states[s->index] = s;
+        if (s->reachable)
+            for_each_trans(t, s)
+                pstart[t->to->index + 1] += 1;
+    }
+    for (unsigned int q = 0; q < nstates; q++)
+        pstart[q + 1] += pstart[q];
+    list_for_each(s, fa->initial) {
+        if (s->reachable)
+            for_each_trans(t, s)
+                preds[pstart[t->to->index]++] = s->index;
+    }
+    memmove(pstart + 1, pstart, nstates * sizeof(*pstart));
+    pstart[0] = 0;
+
+    list_for_each(s, fa->initial) {
+        if (s->live)
+            worklist[nworklist++] = s->index;
+    }
+    while (nworklist > 0) {
+        unsigned int q = worklist[--nworklist];
+        for (unsigned int i = pstart[q]; i < pstart[q + 1]; i++) {
+            struct state *p = states[preds[i]];
+            if (! p->live) {
+                p->live = 1;
+                worklist[nworklist++] = preds[i];
             }
         }
-    } while (changed);
-    return 0;
+    }
+    result = 0;
+
  error:
-    return -1;
+    free(states);
+    free(pstart);
+    free(preds);
+    free(worklist);
+    return result;
 }
 
 /*
@@ -1011,30 +994,28 @@ static struct state_set *fa_reverse(struct fa *fa) {
  * array is a string (null terminated)
  */
 static uchar* start_points(struct fa *fa, int *npoints) {
-    char pointset[UCHAR_NUM];
+    struct charset pointset;
     uchar *points = NULL;
 
     F(mark_reachable(fa));
-    MEMZERO(pointset, UCHAR_NUM);
+    MEMZERO(&pointset, 1);
+    charset_add(&pointset, 0);
     list_for_each(s, fa->initial) {
         if (! s->reachable)
             continue;
-        pointset[0] = 1;
         for_each_trans(t, s) {
-            pointset[t->min] = 1;
+            charset_add(&pointset, t->min);
             if (t->max < UCHAR_MAX)
-                pointset[t->max+1] = 1;
+                charset_add(&pointset, t->max + 1);
         }
     }
 
-    *npoints = 0;
-    for(int i=0; i < UCHAR_NUM; *npoints += pointset[i], i++);
+    *npoints = charset_count(&pointset);
 
     F(ALLOC_N(points, *npoints+1));
-    for (int i=0, n=0; i < UCHAR_NUM; i++) {
-        if (pointset[i])
-            points[n++] = (uchar) i;
-    }
+    for (int i = charset_next(&pointset, 0, true), n = 0; i < UCHAR_NUM;
+         i = charset_next(&pointset, i + 1, true))
+        points[n++] = (uchar) i;
 
     return points;
  error:
@@ -1042,105 +1023,6 @@ static uchar* start_points(struct fa *fa, int *npoints) {
     return NULL;
 }
 
-/*
- * Operations on STATE_SET_HASH
- */
-static int state_set_hash_contains(state_set_hash *smap,
-                               struct state_set *set) {
-    return hash_lookup(smap, set) != NULL;
-}
-
-/*
- * Find the set in SMAP that has the same states as SET. If the two are
- * different, i.e. they point to different memory locations, free SET and
- * return the set found in SMAP
- */
-static struct state_set *state_set_hash_uniq(state_set_hash *smap,
-                                             struct state_set *set) {
-    hnode_t *node = hash_lookup(smap, set);
-    const struct state_set *orig_set = hnode_getkey(node);
-    if (orig_set != set) {
-        state_set_free(set);
-    }
-    return (struct state_set *) orig_set;
-}
-
-static struct state *state_set_hash_get_state(state_set_hash *smap,
-                                             struct state_set *set) {
-    hnode_t *node = hash_lookup(smap, set);
-    return (struct state *) hnode_get(node);
-}
-
-static hash_val_t set_hash(const void *key) {
-    hash_val_t hash = 0;
-    const struct state_set *set = key;
-
-    for (int i = 0; i < set->used; i++) {
-        hash += set->states[i]->hash;
-    }
-    return hash;
-}
-
-static int set_cmp(const void *key1, const void *key2) {
-    const struct state_set *set1 = key1;
-    const struct state_set *set2 = key2;
-
-    return state_set_equal(set1, set2) ? 0 : 1;
-}
-
-static void set_destroy(hnode_t *node, ATTRIBUTE_UNUSED void *ctx) {
-    struct state_set *set = (struct state_set *) hnode_getkey(node);
-    state_set_free(set);
-    free(node);
-}
-
-ATTRIBUTE_RETURN_CHECK
-static int state_set_hash_add(state_set_hash **smap,
-                              struct state_set *set, struct fa *fa) {
-    if (*smap == NULL) {
-        *smap = hash_create(HASHCOUNT_T_MAX, set_cmp, set_hash);
-        E(*smap == NULL);
-        hash_set_allocator(*smap, NULL, set_destroy, NULL);
-    }
-    struct state *s = add_state(fa, 0);
-    E(s == NULL);
-    F(hash_alloc_insert(*smap, set, s));
-    return 0;
- error:
-    return -1;
-}
-
-static void state_set_hash_free(state_set_hash *smap,
-                                struct state_set *protect) {
-    if (protect != NULL) {
-        hnode_t *node = hash_lookup(smap, protect);
-        hash_delete(smap, node);
-        hnode_getkey(node) = NULL;
-        set_destroy(node, NULL);
-    }
-    hash_free_nodes(smap);
-    hash_destroy(smap);
-}
-
-static int state_set_list_add(struct state_set_list **list,
-                              struct state_set *set) {
-    struct state_set_list *elt;
-    if (ALLOC(elt) < 0)
-        return -1;
-    elt->set = set;
-    list_cons(*list, elt);
-    return 0;
-}
-
-static struct state_set *state_set_list_pop(struct state_set_list **list) {
-    struct state_set_list *elt = *list;
-    struct state_set      *set = elt->set;
-
-    *list = elt->next;
-    free(elt);
-    return set;
-}
-
 /* Compare transitions lexicographically by (to, min, reverse max) */
 static int trans_to_cmp(const void *v1, const void *v2) {
     const struct trans *t1 = v1;
@@ -1277,12 +1159,186 @@ static int collect(struct fa *fa) {
     return -1;
 }
 
-static void swap_initial(struct fa *fa) {
-    struct state *s = fa->initial;
-    if (s->next != NULL) {
-        fa->initial = s->next;
-        s->next = fa->initial->next;
-        fa->initial->next = s;
+static void sort_transition_intervals(struct fa *fa) {
+    list_for_each(s, fa->initial) {
+        qsort(s->trans, s->tused, sizeof(*s->trans), trans_intv_cmp);
+    }
+}
+
+/*
+ * Compact representation of automata
+ *
+ * Algorithms that need to get from a state to its number, or that walk
+ * the transitions of all states many times, work on a CSR ("compressed
+ * sparse row") copy of the automaton. States are numbered in the order of
+ * the list of states, so that the initial state is state 0, and each
+ * state's number is also stored in its INDEX field. The transitions of
+ * state Q are TRANS[TSTART[Q]] up to, but not including,
+ * TRANS[TSTART[Q+1]], sorted by MIN.
+ *
+ * A CSR copy does not own the states it points to, and is only valid
+ * until its automaton is changed.
+ */
+struct csr_trans {
+    unsigned int to;
+    uchar        min;
+    uchar        max;
+};
+
+struct csr {
+    unsigned int      nstates;
+    struct state    **states;
+    unsigned int     *tstart;
+    struct csr_trans *trans;
+};
+
+static void csr_free(struct csr *csr) {
+    if (csr == NULL)
+        return;
+    free(csr->states);
+    free(csr->tstart);
+    free(csr->trans);
+    free(csr);
+}
+
+/* Make a CSR copy of FA. As a side effect, sorts the transitions of every
+ * state of FA by their intervals */
+static struct csr *csr_make(struct fa *fa) {
+    struct csr *csr = NULL;
+    unsigned int nstates = 0, ntrans = 0;
+
+    sort_transition_intervals(fa);
+    list_for_each(s, fa->initial) {
+        s->index = nstates++;
+        ntrans += s->tused;
+    }
+
+    F(ALLOC(csr));
+    csr->nstates = nstates;
+    F(ALLOC_N(csr->states, nstates));
+    F(ALLOC_N(csr->tstart, nstates + 1));
+    F(ALLOC_N(csr->trans, ntrans));
+
+    unsigned int n = 0;
+    list_for_each(s, fa->initial) {
+        csr->states[s->index] = s;
+        csr->tstart[s->index] = n;
+        for_each_trans(t, s) {
+            csr->trans[n].to = t->to->index;
+            csr->trans[n].min = t->min;
+            csr->trans[n].max = t->max;
+            n += 1;
+        }
+    }
+    csr->tstart[nstates] = n;
+    return csr;
+ error:
+    csr_free(csr);
+    return NULL;
+}
+
+#define csr_first_trans(csr, q) ((csr)->trans + (csr)->tstart[q])
+#define csr_end_trans(csr, q) ((csr)->trans + (csr)->tstart[(q) + 1])
+
+/* A set of states of the automaton being determinized, as a bitset over
+ * the numbers of the states in its CSR copy. SIZE is the number of states
+ * in the set, and HASH the sum of their hashes. STATE is the state of the
+ * deterministic automaton that stands for the set. */
+struct subset {
+    hash_val_t    hash;
+    unsigned int  size;
+    unsigned int  nwords;
+    bitset       *bits;
+    struct state *state;
+};
+
+static hash_val_t subset_hash(const void *key) {
+    const struct subset *set = key;
+    return set->hash;
+}
+
+static int subset_cmp(const void *key1, const void *key2) {
+    const struct subset *set1 = key1;
+    const struct subset *set2 = key2;
+
+    if (set1->size != set2->size)
+        return 1;
+    return memcmp(set1->bits, set2->bits, set1->nwords * sizeof(bitset));
+}
+
+static void subset_free(struct subset *set) {
+    if (set == NULL)
+        return;
+    free(set->bits);
+    free(set);
+}
+
+static void subset_node_free(hnode_t *node, ATTRIBUTE_UNUSED void *ctx) {
+    subset_free((struct subset *) hnode_getkey(node));
+    free(node);
+}
+
+/* Add state Q of CSR to SET */
+static void subset_add_state(struct subset *set, struct csr *csr,
+                             unsigned int q) {
+    if (! bitset_get(set->bits, q)) {
+        bitset_set(set->bits, q);
+        set->hash += csr->states[q]->hash;
+        set->size += 1;
+    }
+}
+
+/* Enter a copy of SET into SUBSETS, together with a new state for it.
+ * Return the copy, or NULL if we run out of memory */
+static struct subset *subset_enter(hash_t *subsets,
+                                   const struct subset *set) {
+    struct subset *copy = NULL;
+
+    F(ALLOC(copy));
+    *copy = *set;
+    copy->bits = NULL;
+    copy->state = NULL;
+    F(ALLOC_N(copy->bits, set->nwords));
+    memcpy(copy->bits, set->bits, set->nwords * sizeof(bitset));
+    copy->state = make_state();
+    E(copy->state == NULL);
+    F(hash_alloc_insert(subsets, copy, NULL));
+    return copy;
+ error:
+    if (copy != NULL)
+        free(copy->state);
+    subset_free(copy);
+    return NULL;
+}
+
+/* A point where the set of states reachable from a set of states changes
+ * as we sweep over the characters: at character POS, a transition to state
+ * number TO starts (DELTA == 1) or ends (DELTA == -1) */
+struct sweep_event {
+    int           pos;
+    int           delta;
+    unsigned int  to;
+};
+
+static int sweep_event_cmp(const void *v1, const void *v2) {
+    const struct sweep_event *e1 = v1, *e2 = v2;
+
+    return e1->pos - e2->pos;
+}
+
+/* Apply event E to ACTIVE, the set of states reachable on the current
+ * character. COUNT[Q] is the number of active transitions to state Q */
+static void sweep_apply(struct subset *active, unsigned int *count,
+                        struct csr *csr, const struct sweep_event *e) {
+    unsigned int q = e->to;
+
+    if (e->delta > 0) {
+        if (count[q]++ == 0)
+            subset_add_state(active, csr, q);
+    } else if (--count[q] == 0) {
+        bitset_clr(active->bits, q);
+        active->hash -= csr->states[q]->hash;
+        active->size -= 1;
     }
 }
 
@@ -1290,67 +1346,137 @@ static void swap_initial(struct fa *fa) {
  * Make a finite automaton deterministic using the given set of initial
  * states with the subset construction. This also eliminates dead states
  * and transitions and reduces and orders the transitions for each state
+ *
+ * The sets of states are bitsets over the numbers of the states in a CSR
+ * copy of FA. For each set SSET, we sort the boundaries of the transitions
+ * leaving SSET once, and sweep over them in order; between two boundaries,
+ * all characters lead to the same set of states. Characters that do not
+ * lead anywhere do not get a transition.
  */
 static int determinize(struct fa *fa, struct state_set *ini) {
-    int npoints;
-    int make_ini = (ini == NULL);
-    const uchar *points = NULL;
-    state_set_hash *newstate = NULL;
-    struct state_set_list *worklist = NULL;
+    struct csr *csr = NULL;
+    hash_t *subsets = NULL;
+    struct subset **worklist = NULL;
+    size_t nworklist = 0, worklist_size = 0;
+    struct subset active;
+    unsigned int *count = NULL;
+    struct sweep_event *events = NULL;
+    size_t events_size = 0;
+    struct state *initial = NULL;
     int ret = 0;
 
     if (fa->deterministic)
         return 0;
 
-    points = start_points(fa, &npoints);
-    E(points == NULL);
-    if (make_ini) {
-        ini = state_set_init(-1, S_NONE);
-        if (ini == NULL || state_set_push(ini, fa->initial) < 0)
-            goto error;
-    }
+    MEMZERO(&active, 1);
+    csr = csr_make(fa);
+    E(csr == NULL);
+    active.nwords = (csr->nstates + UINT_BIT) / UINT_BIT;
+    active.bits = bitset_init(csr->nstates);
+    E(active.bits == NULL);
+    F(ALLOC_N(count, csr->nstates));
 
-    F(state_set_list_add(&worklist, ini));
-    F(state_set_hash_add(&newstate, ini, fa));
-    // Make the new state the initial state
-    swap_initial(fa);
-    while (worklist != NULL) {
-        struct state_set *sset = state_set_list_pop(&worklist);
-        struct state *r = state_set_hash_get_state(newstate, sset);
-        for (int q=0; q < sset->used; q++) {
-            r->accept |= sset->states[q]->accept;
-        }
-        for (int n=0; n < npoints; n++) {
-            struct state_set *pset = state_set_init(-1, S_SORTED);
-            E(pset == NULL);
-            for(int q=0 ; q < sset->used; q++) {
-                for_each_trans(t, sset->states[q]) {
-                    if (t->min <= points[n] && points[n] <= t->max) {
-                        F(state_set_add(pset, t->to));
-                    }
+    subsets = hash_create(HASHCOUNT_T_MAX, subset_cmp, subset_hash);
+    E(subsets == NULL);
+    hash_set_allocator(subsets, NULL, subset_node_free, NULL);
+
+    if (ini == NULL) {
+        subset_add_state(&active, csr, 0);
+    } else {
+        for (int i=0; i < ini->used; i++)
+            subset_add_state(&active, csr, ini->states[i]->index);
+    }
+    F(ALLOC_N(worklist, 1));
+    worklist_size = 1;
+    worklist[0] = subset_enter(subsets, &active);
+    E(worklist[0] == NULL);
+    nworklist = 1;
+    initial = worklist[0]->state;
+    MEMZERO(active.bits, active.nwords);
+    active.size = 0;
+    active.hash = 0;
+
+    while (nworklist > 0) {
+        struct subset *sset = worklist[--nworklist];
+        struct state *r = sset->state;
+        size_t nevents = 0;
+
+        for (unsigned int w=0; w < sset->nwords; w++) {
+            for (bitset bits = sset->bits[w]; bits != 0; bits &= bits - 1) {
+                unsigned int q = w * UINT_BIT + ffs(bits) - 1;
+                struct csr_trans *first = csr_first_trans(csr, q);
+                struct csr_trans *end = csr_end_trans(csr, q);
+
+                r->accept |= csr->states[q]->accept;
+                if (nevents + 2 * (end - first) > events_size) {
+                    events_size = 2 * (nevents + 2 * (end - first));
+                    F(REALLOC_N(events, events_size));
+                }
+                for (struct csr_trans *t = first; t < end; t++) {
+                    events[nevents].pos = t->min;
+                    events[nevents].delta = 1;
+                    events[nevents].to = t->to;
+                    nevents += 1;
+                    events[nevents].pos = t->max + 1;
+                    events[nevents].delta = -1;
+                    events[nevents].to = t->to;
+                    nevents += 1;
                 }
             }
-            if (!state_set_hash_contains(newstate, pset)) {
-                F(state_set_list_add(&worklist, pset));
-                F(state_set_hash_add(&newstate, pset, fa));
+        }
+        qsort(events, nevents, sizeof(*events), sweep_event_cmp);
+
+        for (size_t i=0; i < nevents; ) {
+            int min = events[i].pos;
+            while (i < nevents && events[i].pos == min) {
+                sweep_apply(&active, count, csr, events + i);
+                i += 1;
             }
-            pset = state_set_hash_uniq(newstate, pset);
-
-            struct state *q = state_set_hash_get_state(newstate, pset);
-            uchar min = points[n];
-            uchar max = UCHAR_MAX;
-            if (n+1 < npoints)
-                max = points[n+1] - 1;
-            if (add_new_trans(r, q, min, max) < 0)
-                goto error;
+            if (active.size == 0 || min > UCHAR_MAX)
+                continue;
+            /* All events at UCHAR_MAX + 1 end transitions, and there is
+             * therefore always another event after MIN */
+            int max = events[i].pos - 1;
+
+            struct subset *pset;
+            hnode_t *node = hash_lookup(subsets, &active);
+            if (node == NULL) {
+                pset = subset_enter(subsets, &active);
+                E(pset == NULL);
+                list_cons(initial->next, pset->state);
+                if (nworklist == worklist_size) {
+                    worklist_size *= 2;
+                    F(REALLOC_N(worklist, worklist_size));
+                }
+                worklist[nworklist++] = pset;
+            } else {
+                pset = (struct subset *) hnode_getkey(node);
+            }
+            F(add_new_trans(r, pset->state, min, max));
         }
     }
+
+    gut(fa);
+    fa->initial = initial;
+    initial = NULL;
     fa->deterministic = 1;
 
  done:
-    if (newstate)
-        state_set_hash_free(newstate, make_ini ? NULL : ini);
-    free((void *) points);
+    if (initial != NULL) {
+        list_for_each(s, initial) {
+            free_trans(s);
+        }
+        list_free(initial);
+    }
+    if (subsets != NULL) {
+        hash_free_nodes(subsets);
+        hash_destroy(subsets);
+    }
+    csr_free(csr);
+    free(active.bits);
+    free(count);
+    free(worklist);
+    free(events);
     if (collect(fa) < 0)
         ret = -1;
     return ret;
@@ -1364,14 +1490,6 @@ static int determinize(struct fa *fa, struct state_set *ini) {
  * reduced and ordered.
  */
 
-static struct state *step(struct state *s, uchar c) {
-    for_each_trans(t, s) {
-        if (t->min <= c && c <= t->max)
-            return t->to;
-    }
-    return NULL;
-}
-
 struct state_list {
     struct state_list_node *first;
     struct state_list_node *last;
@@ -1431,10 +1549,10 @@ static void state_list_free(struct state_list *sl) {
 #define INDEX(q, c) (q * nsigma + c)
 
 static int minimize_hopcroft(struct fa *fa) {
-    struct state_set *states = NULL;
+    struct csr *csr = NULL;
     uchar *sigma = NULL;
-    struct state_set **reverse = NULL;
-    bitset *reverse_nonempty = NULL;
+    unsigned int *rstart = NULL;
+    unsigned int *reverse = NULL;
     struct state_set **partition = NULL;
     unsigned int *block = NULL;
     struct state_list **active = NULL;
@@ -1462,14 +1580,10 @@ static int minimize_hopcroft(struct fa *fa) {
 
     F(totalize(fa));
 
-    /* make arrays for numbered states and effective alphabet */
-    states = state_set_init(-1, S_NONE);
-    E(states == NULL);
-
-    list_for_each(s, fa->initial) {
-        F(state_set_push(states, s));
-    }
-    unsigned int nstates = states->used;
+    /* number states and find the effective alphabet */
+    csr = csr_make(fa);
+    E(csr == NULL);
+    unsigned int nstates = csr->nstates;
 
     int nsigma;
     sigma = start_points(fa, &nsigma);
@@ -1477,10 +1591,12 @@ static int minimize_hopcroft(struct fa *fa) {
 
     /* initialize data structures */
 
-    /* An ss->used x nsigma matrix of lists of states */
+    /* The reverse edges, in CSR form: the states that go to state Q on
+     * character SIGMA[X] are REVERSE[RSTART[INDEX(Q, X)]] up to, but not
+     * including, REVERSE[RSTART[INDEX(Q, X) + 1]]. Since the automaton is
+     * total, every state has exactly one edge for each character. */
+    F(ALLOC_N(rstart, nstates * nsigma + 1));
     F(ALLOC_N(reverse, nstates * nsigma));
-    reverse_nonempty = bitset_init(nstates * nsigma);
-    E(reverse_nonempty == NULL);
     F(ALLOC_N(partition, nstates));
     F(ALLOC_N(block, nstates));
 
@@ -1511,15 +1627,16 @@ static int minimize_hopcroft(struct fa *fa) {
         partition[q] = state_set_init(-1, S_NONE);
         E(splitblock[q] == NULL || partition[q] == NULL);
         for (int x = 0; x < nsigma; x++) {
-            reverse[INDEX(q, x)] = state_set_init(-1, S_NONE);
-            E(reverse[INDEX(q, x)] == NULL);
             F(ALLOC_N(active[INDEX(q, x)], 1));
         }
     }
 
-    /* find initial partition and reverse edges */
+    /* find initial partition and reverse edges. The transitions of each
+     * state are sorted and cover all characters, so that we can walk them
+     * in step with SIGMA. We first count the edges into each (Q, X) in
+     * RSTART[INDEX(Q, X) + 1], and then turn the counts into offsets */
     for (int q = 0; q < nstates; q++) {
-        struct state *qq = states->states[q];
+        struct state *qq = csr->states[q];
         int j;
         if (qq->accept)
             j = 0;
@@ -1527,24 +1644,35 @@ static int minimize_hopcroft(struct fa *fa) {
             j = 1;
         F(state_set_push(partition[j], qq));
         block[q] = j;
+        struct csr_trans *t = csr_first_trans(csr, q);
         for (int x = 0; x < nsigma; x++) {
-            uchar y = sigma[x];
-            struct state *p = step(qq, y);
-            assert(p != NULL);
-            int pn = state_set_index(states, p);
-            assert(pn >= 0);
-            F(state_set_push(reverse[INDEX(pn, x)], qq));
-            bitset_set(reverse_nonempty, INDEX(pn, x));
+            while (t->max < sigma[x])
+                t++;
+            assert(t < csr_end_trans(csr, q));
+            rstart[INDEX(t->to, x) + 1] += 1;
         }
     }
+    for (int i = 0; i < nstates * nsigma; i++)
+        rstart[i + 1] += rstart[i];
+    for (int q = 0; q < nstates; q++) {
+        struct csr_trans *t = csr_first_trans(csr, q);
+        for (int x = 0; x < nsigma; x++) {
+            while (t->max < sigma[x])
+                t++;
+            reverse[rstart[INDEX(t->to, x)]++] = q;
+        }
+    }
+    /* Filling REVERSE moved each RSTART[I] to where RSTART[I+1] was */
+    memmove(rstart + 1, rstart, nstates * nsigma * sizeof(*rstart));
+    rstart[0] = 0;
 
     /* initialize active sets */
     for (int j = 0; j <= 1; j++)
         for (int x = 0; x < nsigma; x++)
             for (int q = 0; q < partition[j]->used; q++) {
                 struct state *qq = partition[j]->states[q];
-                int qn = state_set_index(states, qq);
-                if (bitset_get(reverse_nonempty, INDEX(qn, x))) {
+                int qn = qq->index;
+                if (rstart[INDEX(qn, x)] < rstart[INDEX(qn, x) + 1]) {
                     active2[INDEX(qn, x)] =
                         state_list_add(active[INDEX(j, x)], qq);
                     E(active2[INDEX(qn, x)] == NULL);
@@ -1578,11 +1706,11 @@ static int minimize_hopcroft(struct fa *fa) {
         /* find states that need to be split off their blocks */
         struct state_list *sh = active[INDEX(p,x)];
         for (struct state_list_node *m = sh->first; m != NULL; m = m->next) {
-            int q = state_set_index(states, m->state);
-            struct state_set *rev = reverse[INDEX(q, x)];
-            for (int r =0; r < rev->used; r++) {
-                struct state *rs = rev->states[r];
-                int s = state_set_index(states, rs);
+            int q = m->state->index;
+            for (int r = rstart[INDEX(q, x)]; r < rstart[INDEX(q, x) + 1];
+                 r++) {
+                int s = reverse[r];
+                struct state *rs = csr->states[s];
                 if (! bitset_get(split2, s)) {
                     bitset_set(split2, s);
                     F(state_set_push(split, rs));
@@ -1605,7 +1733,7 @@ static int minimize_hopcroft(struct fa *fa) {
                 for (int s = 0; s < sp->used; s++) {
                     state_set_remove(b1, sp->states[s]);
                     F(state_set_push(b2, sp->states[s]));
-                    int snum = state_set_index(states, sp->states[s]);
+                    int snum = sp->states[s]->index;
                     block[snum] = k;
                     for (int c = 0; c < nsigma; c++) {
                         struct state_list_node *sn = active2[INDEX(snum, c)];
@@ -1640,8 +1768,7 @@ static int minimize_hopcroft(struct fa *fa) {
                 k++;
             }
             for (int s = 0; s < sp->used; s++) {
-                int snum = state_set_index(states, sp->states[s]);
-                bitset_clr(split2, snum);
+                bitset_clr(split2, sp->states[s]->index);
             }
             bitset_clr(refine2, j);
             sp->used = 0;
@@ -1662,7 +1789,7 @@ static int minimize_hopcroft(struct fa *fa) {
         struct state_set *partn = partition[n];
         for (int q=0; q < partn->used; q++) {
             struct state *qs = partn->states[q];
-            int qnum = state_set_index(states, qs);
+            int qnum = qs->index;
             if (qs == fa->initial)
                 s->live = 1;     /* Abuse live to flag the new intial state */
             nsnum[n] = qnum;     /* select representative */
@@ -1673,10 +1800,9 @@ static int minimize_hopcroft(struct fa *fa) {
     /* build transitions and set acceptance */
     for (int n = 0; n < k; n++) {
         struct state *s = newstates->states[n];
-        s->accept = states->states[nsnum[n]]->accept;
-        for_each_trans(t, states->states[nsnum[n]]) {
-            int toind = state_set_index(states, t->to);
-            struct state *nto = newstates->states[nsind[toind]];
+        s->accept = csr->states[nsnum[n]]->accept;
+        for_each_trans(t, csr->states[nsnum[n]]) {
+            struct state *nto = newstates->states[nsind[t->to->index]];
             F(add_new_trans(s, nto, t->min, t->max));
         }
     }
@@ -1700,16 +1826,13 @@ static int minimize_hopcroft(struct fa *fa) {
  done:
     free(nsind);
     free(nsnum);
-    state_set_free(states);
+    csr_free(csr);
     free(sigma);
-    bitset_free(reverse_nonempty);
     free(block);
-    for (int i=0; i < nstates*nsigma; i++) {
-        if (reverse)
-            state_set_free(reverse[i]);
-        if (active)
+    if (active)
+        for (int i=0; i < nstates*nsigma; i++)
             state_list_free(active[i]);
-    }
+    free(rstart);
     free(reverse);
     free(active);
     free(active2);
@@ -1737,6 +1860,266 @@ static int minimize_hopcroft(struct fa *fa) {
     goto done;
 }
 
+/*
+ * Minimization following Valmari and Lehtinen, "Efficient minimization of
+ * DFAs with partial transition functions". States are refined into blocks,
+ * and transitions, labelled with the classes of characters from
+ * START_POINTS, into cords; each new cord splits blocks by the tails of its
+ * transitions, and each new block splits cords by the transitions into it.
+ * Everything is kept in index arrays, and the automaton is not made total:
+ * determinize leaves only live states, and a missing transition then tells
+ * states apart just like a transition into a dead state would.
+ */
+
+/* A partition of the numbers 0 .. N-1 that can be refined. The elements of
+ * set S are ELEMS[FIRST[S]] up to, but not including, ELEMS[PAST[S]]; LOC
+ * is the inverse of ELEMS and SET[E] the set containing E. Marking E moves
+ * it to the front of its set, and MARKED[S] counts the marked elements of
+ * S; the NTOUCHED sets with marked elements are listed in TOUCHED.
+ *
+ * MARKED and TOUCHED are only used between marking and splitting, so that
+ * the partitions of one minimization share them.
+ */
+struct partition {
+    unsigned int  nsets;
+    unsigned int *elems;
+    unsigned int *loc;
+    unsigned int *set;
+    unsigned int *first;
+    unsigned int *past;
+    unsigned int *marked;
+    unsigned int *touched;
+    unsigned int  ntouched;
+};
+
+/* Make P a partition of 0 .. N-1 with one set, using 5*N numbers from MEM
+ * for its arrays. Return the unused rest of MEM */
+static unsigned int *partition_init(struct partition *p, unsigned int n,
+                                    unsigned int *mem) {
+    p->elems = mem;
+    p->loc = mem + n;
+    p->set = mem + 2*n;
+    p->first = mem + 3*n;
+    p->past = mem + 4*n;
+    p->nsets = (n > 0);
+    for (unsigned int i = 0; i < n; i++) {
+        p->elems[i] = i;
+        p->loc[i] = i;
+        p->set[i] = 0;
+    }
+    if (n > 0) {
+        p->first[0] = 0;
+        p->past[0] = n;
+    }
+    return mem + 5*n;
+}
+
+static void partition_mark(struct partition *p, unsigned int e) {
+    unsigned int s = p->set[e];
+    unsigned int i = p->loc[e];
+    unsigned int j = p->first[s] + p->marked[s];
+
+    if (i < j)
+        return;
+    p->elems[i] = p->elems[j];
+    p->loc[p->elems[i]] = i;
+    p->elems[j] = e;
+    p->loc[e] = j;
+    if (p->marked[s]++ == 0)
+        p->touched[p->ntouched++] = s;
+}
+
+/* Split every set with marked elements into its marked and unmarked
+ * elements. The smaller part gets the new set number */
+static void partition_split(struct partition *p) {
+    while (p->ntouched > 0) {
+        unsigned int s = p->touched[--p->ntouched];
+        unsigned int j = p->first[s] + p->marked[s];
+
+        if (j == p->past[s]) {
+            p->marked[s] = 0;
+            continue;
+        }
+        unsigned int z = p->nsets++;
+        if (p->marked[s] <= p->past[s] - j) {
+            p->first[z] = p->first[s];
+            p->past[z] = p->first[s] = j;
+        } else {
+            p->past[z] = p->past[s];
+            p->first[z] = p->past[s] = j;
+        }
+        for (unsigned int i = p->first[z]; i < p->past[z]; i++)
+            p->set[p->elems[i]] = z;
+        p->marked[s] = 0;
+        p->marked[z] = 0;
+    }
+}
+
+static int minimize_valmari(struct fa *fa) {
+    struct csr *csr = NULL;
+    uchar *sigma = NULL;
+    unsigned int *mem = NULL;
+    struct state **newstates = NULL;
+    struct partition blocks, cords;
+    unsigned int nstates, ntrans = 0, nblocks = 0;
+    unsigned int chclass[UCHAR_NUM], cstart[UCHAR_NUM + 1], cset[UCHAR_NUM];
+    int nsigma;
+    int result = -1;
+
+    F(determinize(fa, NULL));
+
+    csr = csr_make(fa);
+    E(csr == NULL);
+    nstates = csr->nstates;
+
+    sigma = start_points(fa, &nsigma);
+    E(sigma == NULL);
+    for (int x = 0; x < nsigma; x++) {
+        int end = (x + 1 < nsigma) ? sigma[x + 1] : UCHAR_NUM;
+        for (int c = sigma[x]; c < end; c++)
+            chclass[c] = x;
+    }
+
+    /* Every transition [min, max] becomes one labelled transition for each
+     * class in that interval */
+    for (unsigned int q = 0; q < nstates; q++) {
+        for (struct csr_trans *t = csr_first_trans(csr, q);
+             t < csr_end_trans(csr, q); t++) {
+            for (int x = chclass[t->min]; x < nsigma && sigma[x] <= t->max; x++)
+                ntrans += 1;
+        }
+    }
+
+    /* All the arrays we need, in one allocation: TAIL, HEAD and LABEL of
+     * each labelled transition; the transitions into state Q, which are
+     * INTO[ISTART[Q]] up to, but not including, INTO[ISTART[Q+1]]; the
+     * arrays of BLOCKS and CORDS; and MARKED and TOUCHED, which they
+     * share. */
+    unsigned int nmax = (nstates > ntrans) ? nstates : ntrans;
+    F(ALLOC_N(mem, 4*ntrans + nstates + 1 + 5*nstates + 5*ntrans + 2*nmax));
+    unsigned int *tail = mem;
+    unsigned int *head = tail + ntrans;
+    unsigned int *label = head + ntrans;
+    unsigned int *into = label + ntrans;
+    unsigned int *istart = into + ntrans;
+    unsigned int *rest = istart + nstates + 1;
+    rest = partition_init(&blocks, nstates, rest);
+    rest = partition_init(&cords, ntrans, rest);
+    blocks.marked = cords.marked = rest;
+    blocks.touched = cords.touched = rest + nmax;
+    blocks.ntouched = cords.ntouched = 0;
+
+    unsigned int k = 0;
+    for (unsigned int q = 0; q < nstates; q++) {
+        for (struct csr_trans *t = csr_first_trans(csr, q);
+             t < csr_end_trans(csr, q); t++) {
+            for (int x = chclass[t->min]; x < nsigma && sigma[x] <= t->max;
+                 x++) {
+                tail[k] = q;
+                head[k] = t->to;
+                label[k] = x;
+                istart[t->to] += 1;
+                k += 1;
+            }
+        }
+    }
+    for (unsigned int q = 0; q < nstates; q++)
+        istart[q + 1] += istart[q];
+    for (unsigned int t = ntrans; t-- > 0; )
+        into[--istart[head[t]]] = t;
+
+    /* Initial blocks: accepting and non-accepting states */
+    for (unsigned int q = 0; q < nstates; q++)
+        if (csr->states[q]->accept)
+            partition_mark(&blocks, q);
+    partition_split(&blocks);
+
+    /* Initial cords: transitions with the same label */
+    MEMZERO(cstart, UCHAR_NUM + 1);
+    for (unsigned int t = 0; t < ntrans; t++)
+        cstart[label[t] + 1] += 1;
+    cords.nsets = 0;
+    for (int x = 0; x < nsigma; x++) {
+        cstart[x + 1] += cstart[x];
+        if (cstart[x] < cstart[x + 1]) {
+            cords.first[cords.nsets] = cstart[x];
+            cords.past[cords.nsets] = cstart[x + 1];
+            cset[x] = cords.nsets++;
+        }
+    }
+    for (unsigned int t = 0; t < ntrans; t++) {
+        unsigned int i = cstart[label[t]]++;
+        cords.elems[i] = t;
+        cords.loc[t] = i;
+        cords.set[t] = cset[label[t]];
+    }
+
+    /* Refine until neither blocks nor cords split any further. Block 0
+     * never needs to split cords, since the other blocks already do */
+    unsigned int b = 1, c = 0;
+    while (c < cords.nsets) {
+        for (unsigned int i = cords.first[c]; i < cords.past[c]; i++)
+            partition_mark(&blocks, tail[cords.elems[i]]);
+        partition_split(&blocks);
+        c += 1;
+        while (b < blocks.nsets) {
+            for (unsigned int i = blocks.first[b]; i < blocks.past[b]; i++) {
+                unsigned int q = blocks.elems[i];
+                for (unsigned int j = istart[q]; j < istart[q + 1]; j++)
+                    partition_mark(&cords, into[j]);
+            }
+            partition_split(&cords);
+            b += 1;
+        }
+    }
+
+    /* Make a new state for each block, with the transitions of the first
+     * state in the block */
+    F(ALLOC_N(newstates, blocks.nsets));
+    nblocks = blocks.nsets;
+    for (b = 0; b < nblocks; b++) {
+        newstates[b] = make_state();
+        E(newstates[b] == NULL);
+    }
+    for (b = 0; b < nblocks; b++) {
+        unsigned int q = blocks.elems[blocks.first[b]];
+        newstates[b]->accept = csr->states[q]->accept;
+        for (struct csr_trans *t = csr_first_trans(csr, q);
+             t < csr_end_trans(csr, q); t++) {
+            struct state *to = newstates[blocks.set[t->to]];
+            F(add_new_trans(newstates[b], to, t->min, t->max));
+        }
+    }
+
+    unsigned int init = blocks.set[fa->initial->index];
+    gut(fa);
+    fa->initial = newstates[init];
+    for (b = nblocks; b-- > 0; ) {
+        if (b != init)
+            list_cons(fa->initial->next, newstates[b]);
+    }
+    nblocks = 0;
+    result = 0;
+
+ done:
+    for (b = 0; b < nblocks; b++) {
+        if (newstates[b] != NULL) {
+            free_trans(newstates[b]);
+            free(newstates[b]);
+        }
+    }
+    free(newstates);
+    free(mem);
+    free(sigma);
+    csr_free(csr);
+    if (collect(fa) < 0)
+        result = -1;
+    return result;
+ error:
+    result = -1;
+    goto done;
+}
+
 static int minimize_brzozowski(struct fa *fa) {
     struct state_set *set;
 
@@ -1765,6 +2148,8 @@ int fa_minimize(struct fa *fa) {
 
     if (fa_minimization_algorithm == FA_MIN_BRZOZOWSKI) {
         r = minimize_brzozowski(fa);
+    } else if (fa_minimization_algorithm == FA_MIN_VALMARI) {
+        r = minimize_valmari(fa);
     } else {
         r = minimize_hopcroft(fa);
     }
@@ -1875,7 +2260,7 @@ int fa_is_basic(struct fa *fa, unsigned int basic) {
     return 0;
 }
 
-static struct fa *fa_clone(struct fa *fa) {
+struct fa *fa_clone(struct fa *fa) {
     struct fa *result = NULL;
     struct state_set *set = state_set_init(-1, S_DATA|S_SORTED);
     int r;
@@ -1917,6 +2302,206 @@ static struct fa *fa_clone(struct fa *fa) {
     return NULL;
 }
 
+/*
+ * Serialization
+ *
+ * A serialized automaton is an array of 32 bit unsigned numbers in little
+ * endian byte order, so that it can be used in place when it is mapped
+ * into memory from a file on a little endian machine:
+ *
+ *   MAGIC     the bytes "AuFA"
+ *   VERSION   SER_VERSION; other versions are rejected
+ *   FLAGS     a combination of the SER_* flags. SER_MINIMAL is not
+ *             written, and ignored when reading, since checking it would
+ *             take as long as minimizing; SER_NOCASE is only accepted if
+ *             no transition is on a character in [A-Z]
+ *   NSTATES   the number of states, at least 1; state 0 is initial
+ *   NTRANS    the number of transitions
+ *   TSTART    NSTATES + 1 numbers; the transitions of state Q are
+ *             TRANS[TSTART[Q]] up to, but not including, TRANS[TSTART[Q+1]],
+ *             sorted by their intervals
+ *   TRANS     NTRANS pairs of numbers: the state the transition goes to,
+ *             and its interval as MIN | MAX << 8
+ *   ACCEPT    (NSTATES + 31)/32 words, bit Q % 32 of word Q/32 is set if
+ *             state Q is accepting
+ *
+ * This is the layout of struct csr, so that the same automaton always
+ * produces the same bytes.
+ */
+#define SER_MAGIC "AuFA"
+#define SER_VERSION 1
+#define SER_HEADER 5
+
+enum {
+    SER_DETERMINISTIC = 1 << 0,
+    SER_MINIMAL       = 1 << 1,
+    SER_NOCASE        = 1 << 2
+};
+#define SER_FLAGS (SER_DETERMINISTIC|SER_MINIMAL|SER_NOCASE)
+
+/* Compare transitions by (min, reverse max, to) like TRANS_INTV_CMP, but
+ * by the number of the state they go to rather than its address */
+static int csr_trans_cmp(const void *v1, const void *v2) {
+    const struct csr_trans *t1 = v1;
+    const struct csr_trans *t2 = v2;
+
+    if (t1->min != t2->min)
+        return (t1->min < t2->min) ? -1 : 1;
+    if (t1->max != t2->max)
+        return (t1->max > t2->max) ? -1 : 1;
+    if (t1->to != t2->to)
+        return (t1->to < t2->to) ? -1 : 1;
+    return 0;
+}
+
+static void ser_put(uchar *buf, size_t i, uint32_t v) {
+    buf += 4*i;
+    buf[0] = v & 0xff;
+    buf[1] = (v >> 8) & 0xff;
+    buf[2] = (v >> 16) & 0xff;
+    buf[3] = (v >> 24) & 0xff;
+}
+
+static uint32_t ser_get(const uchar *buf, size_t i) {
+    buf += 4*i;
+    return buf[0] | buf[1] << 8 | buf[2] << 16 | (uint32_t) buf[3] << 24;
+}
+
+int fa_serialize(struct fa *fa, char **buf, size_t *buf_len) {
+    struct csr *csr = NULL;
+    uchar *out = NULL;
+
+    *buf = NULL;
+    *buf_len = 0;
+
+    csr = csr_make(fa);
+    E(csr == NULL);
+
+    size_t nstates = csr->nstates;
+    size_t ntrans = csr->tstart[nstates];
+
+    /* Transitions with the same interval, which only nondeterministic
+     * automata have, were sorted by address */
+    if (! fa->deterministic) {
+        for (size_t q = 0; q < nstates; q++)
+            qsort(csr_first_trans(csr, q), csr->tstart[q + 1] - csr->tstart[q],
+                  sizeof(struct csr_trans), csr_trans_cmp);
+    }
+    size_t tstart = SER_HEADER;
+    size_t trans = tstart + nstates + 1;
+    size_t accept = trans + 2*ntrans;
+    size_t len = accept + (nstates + 31)/32;
+
+    F(ALLOC_N(out, 4*len));
+    memcpy(out, SER_MAGIC, 4);
+    ser_put(out, 1, SER_VERSION);
+    ser_put(out, 2, (fa->deterministic ? SER_DETERMINISTIC : 0)
+                  | (fa->nocase ? SER_NOCASE : 0));
+    ser_put(out, 3, nstates);
+    ser_put(out, 4, ntrans);
+    for (size_t q = 0; q <= nstates; q++)
+        ser_put(out, tstart + q, csr->tstart[q]);
+    for (size_t i = 0; i < ntrans; i++) {
+        ser_put(out, trans + 2*i, csr->trans[i].to);
+        ser_put(out, trans + 2*i + 1,
+                csr->trans[i].min | csr->trans[i].max << 8);
+    }
+    for (size_t q = 0; q < nstates; q += 32) {
+        uint32_t word = 0;
+        for (size_t b = 0; b < 32 && q + b < nstates; b++)
+            if (csr->states[q + b]->accept)
+                word |= (uint32_t) 1 << b;
+        ser_put(out, accept + q/32, word);
+    }
+
+    csr_free(csr);
+    *buf = (char *) out;
+    *buf_len = 4*len;
+    return 0;
+ error:
+    csr_free(csr);
+    free(out);
+    return -1;
+}
+
+int fa_deserialize(const char *buf, size_t buf_len, struct fa **fa) {
+    const uchar *in = (const uchar *) buf;
+    struct fa *result = NULL;
+    struct state **states = NULL;
+    int ret = -2;
+
+    *fa = NULL;
+
+    if (buf_len < 4*SER_HEADER || memcmp(in, SER_MAGIC, 4) != 0)
+        return -2;
+    if (ser_get(in, 1) != SER_VERSION || (ser_get(in, 2) & ~SER_FLAGS))
+        return -2;
+
+    uint32_t flags = ser_get(in, 2);
+    uint64_t nstates = ser_get(in, 3);
+    uint64_t ntrans = ser_get(in, 4);
+    uint64_t tstart = SER_HEADER;
+    uint64_t trans = tstart + nstates + 1;
+    uint64_t accept = trans + 2*ntrans;
+
+    if (nstates == 0 || 4*(accept + (nstates + 31)/32) != buf_len)
+        return -2;
+    if (ser_get(in, tstart) != 0 || ser_get(in, tstart + nstates) != ntrans)
+        return -2;
+    /* Transitions must go to existing states, the transitions of a
+     * deterministic automaton must not overlap, and those of a nocase
+     * automaton must not be on uppercase letters */
+    for (uint64_t q = 0; q < nstates; q++) {
+        uint32_t first = ser_get(in, tstart + q);
+        uint32_t past = ser_get(in, tstart + q + 1);
+        if (first > past || past > ntrans)
+            return -2;
+        for (uint32_t i = first; i < past; i++) {
+            uint32_t intv = ser_get(in, trans + 2*i + 1);
+            if (ser_get(in, trans + 2*i) >= nstates
+                || intv > 0xffff || (intv & 0xff) > (intv >> 8))
+                return -2;
+            if ((flags & SER_DETERMINISTIC) && i > first
+                && (intv & 0xff) <= (ser_get(in, trans + 2*i - 1) >> 8))
+                return -2;
+            if ((flags & SER_NOCASE)
+                && (intv & 0xff) <= 'Z' && (intv >> 8) >= 'A')
+                return -2;
+        }
+    }
+
+    ret = -1;
+    F(ALLOC(result));
+    F(ALLOC_N(states, nstates));
+    for (uint64_t q = 0; q < nstates; q++) {
+        states[q] = make_state();
+        E(states[q] == NULL);
+        if (q == 0)
+            result->initial = states[q];
+        else
+            states[q - 1]->next = states[q];
+        states[q]->accept = (ser_get(in, accept + q/32) >> (q % 32)) & 1;
+    }
+    for (uint64_t q = 0; q < nstates; q++) {
+        for (uint32_t i = ser_get(in, tstart + q);
+             i < ser_get(in, tstart + q + 1); i++) {
+            struct state *to = states[ser_get(in, trans + 2*i)];
+            uint32_t intv = ser_get(in, trans + 2*i + 1);
+            F(add_new_trans(states[q], to, intv & 0xff, intv >> 8));
+        }
+    }
+    result->deterministic = (flags & SER_DETERMINISTIC) != 0;
+    result->nocase = (flags & SER_NOCASE) != 0;
+
+    free(states);
+    *fa = result;
+    return 0;
+ error:
+    free(states);
+    fa_free(result);
+    return ret;
+}
+
 static int case_expand(struct fa *fa);
 
 /* Compute FA1|FA2 and set FA1 to that automaton. FA2 is freed */
@@ -2013,7 +2598,7 @@ struct fa *fa_concat(struct fa *fa1, struct fa *fa2) {
     return NULL;
 }
 
-static struct fa *fa_make_char_set(bitset *cset, int negate) {
+static struct fa *fa_make_char_set(struct charset *cset, int negate) {
     struct fa *fa = fa_make_empty();
     if (!fa)
         return NULL;
@@ -2027,13 +2612,10 @@ static struct fa *fa_make_char_set(bitset *cset, int negate) {
         goto error;
 
     while (from <= UCHAR_MAX) {
-        while (from <= UCHAR_MAX && bitset_get(cset, from) == negate)
-            from += 1;
+        from = charset_next(cset, from, !negate);
         if (from > UCHAR_MAX)
             break;
-        int to = from;
-        while (to < UCHAR_MAX && (bitset_get(cset, to + 1) == !negate))
-            to += 1;
+        int to = charset_next(cset, from, negate) - 1;
         r = add_new_trans(s, t, from, to);
         if (r < 0)
             goto error;
@@ -2193,17 +2775,74 @@ struct fa *fa_iter(struct fa *fa, int min, int max) {
     }
 }
 
-static void sort_transition_intervals(struct fa *fa) {
-    list_for_each(s, fa->initial) {
-        qsort(s->trans, s->tused, sizeof(*s->trans), trans_intv_cmp);
+/*
+ * Product automata
+ *
+ * The states of the product of two automata are pairs (Q1, Q2) of state
+ * numbers in the CSR copies of the two automata. Pairs are entered into a
+ * hash table with the number Q1 * N2 + Q2 as the key, where N2 is the
+ * number of states of the second automaton; the data of an entry is the
+ * state of the product automaton, if one is being built.
+ */
+struct state_pair {
+    unsigned int  q1;
+    unsigned int  q2;
+    struct state *s;
+};
+
+struct pair_stack {
+    size_t             used;
+    size_t             size;
+    struct state_pair *pairs;
+};
+
+#define PAIR_KEY(csr2, q1, q2)                                          \
+    ((void *) (uintptr_t) ((size_t) (q1) * (csr2)->nstates + (q2)))
+
+static int pair_key_cmp(const void *key1, const void *key2) {
+    return key1 != key2;
+}
+
+static hash_t *pair_map_init(void) {
+    return hash_create(HASHCOUNT_T_MAX, pair_key_cmp, ptr_hash);
+}
+
+static void pair_map_free(hash_t *map) {
+    if (map != NULL) {
+        hash_free_nodes(map);
+        hash_destroy(map);
     }
 }
 
+/* Enter the pair (Q1, Q2) with state S into MAP and push it onto
+ * WORKLIST. The pair must not be in MAP yet. */
+ATTRIBUTE_RETURN_CHECK
+static int pair_push(hash_t *map, struct pair_stack *worklist,
+                     struct csr *csr2, unsigned int q1, unsigned int q2,
+                     struct state *s) {
+    if (worklist->used == worklist->size) {
+        size_t size = worklist->size == 0 ? array_initial_size
+                                          : 2 * worklist->size;
+        if (REALLOC_N(worklist->pairs, size) < 0)
+            return -1;
+        worklist->size = size;
+    }
+    if (hash_alloc_insert(map, PAIR_KEY(csr2, q1, q2), s) < 0)
+        return -1;
+    worklist->pairs[worklist->used].q1 = q1;
+    worklist->pairs[worklist->used].q2 = q2;
+    worklist->pairs[worklist->used].s = s;
+    worklist->used += 1;
+    return 0;
+}
+
 struct fa *fa_intersect(struct fa *fa1, struct fa *fa2) {
-    int ret;
     struct fa *fa = NULL;
-    struct state_set *worklist = NULL;
-    state_triple_hash *newstates = NULL;
+    struct csr *csr1 = NULL, *csr2 = NULL;
+    hash_t *newstates = NULL;
+    struct pair_stack worklist;
+
+    MEMZERO(&worklist, 1);
 
     if (fa1 == fa2)
         return fa_clone(fa1);
@@ -2217,52 +2856,44 @@ struct fa *fa_intersect(struct fa *fa1, struct fa *fa2) {
     }
 
     fa = fa_make_empty();
-    worklist = state_set_init(-1, S_NONE);
-    newstates = state_triple_init();
-    if (fa == NULL || worklist == NULL || newstates == NULL)
+    csr1 = csr_make(fa1);
+    csr2 = csr_make(fa2);
+    newstates = pair_map_init();
+    if (fa == NULL || csr1 == NULL || csr2 == NULL || newstates == NULL)
         goto error;
 
-    sort_transition_intervals(fa1);
-    sort_transition_intervals(fa2);
-
-    F(state_set_push(worklist, fa1->initial));
-    F(state_set_push(worklist, fa2->initial));
-    F(state_set_push(worklist, fa->initial));
-    F(state_triple_push(newstates,
-                         fa1->initial, fa2->initial, fa->initial));
-    while (worklist->used) {
-        struct state *s  = state_set_pop(worklist);
-        struct state *p2 = state_set_pop(worklist);
-        struct state *p1 = state_set_pop(worklist);
-        s->accept = p1->accept && p2->accept;
-
-        struct trans *t1 = p1->trans;
-        struct trans *t2 = p2->trans;
-        for (int n1 = 0, b2 = 0; n1 < p1->tused; n1++) {
-            while (b2 < p2->tused && t2[b2].max < t1[n1].min)
+    F(pair_push(newstates, &worklist, csr2, 0, 0, fa->initial));
+    while (worklist.used > 0) {
+        struct state_pair *pair = worklist.pairs + --worklist.used;
+        unsigned int q1 = pair->q1, q2 = pair->q2;
+        struct state *s = pair->s;
+        s->accept = csr1->states[q1]->accept && csr2->states[q2]->accept;
+
+        struct csr_trans *t1 = csr_first_trans(csr1, q1);
+        struct csr_trans *end1 = csr_end_trans(csr1, q1);
+        struct csr_trans *b2 = csr_first_trans(csr2, q2);
+        struct csr_trans *end2 = csr_end_trans(csr2, q2);
+        for (; t1 < end1; t1++) {
+            while (b2 < end2 && b2->max < t1->min)
                 b2++;
-            for (int n2 = b2;
-                 n2 < p2->tused && t1[n1].max >= t2[n2].min;
-                 n2++) {
-                if (t2[n2].max >= t1[n1].min) {
-                    struct state *r = state_triple_thd(newstates,
-                                                       t1[n1].to, t2[n2].to);
-                    if (r == NULL) {
+            for (struct csr_trans *t2 = b2;
+                 t2 < end2 && t1->max >= t2->min;
+                 t2++) {
+                if (t2->max >= t1->min) {
+                    struct state *r;
+                    hnode_t *node =
+                        hash_lookup(newstates, PAIR_KEY(csr2, t1->to, t2->to));
+                    if (node == NULL) {
                         r = add_state(fa, 0);
                         E(r == NULL);
-                        F(state_set_push(worklist, t1[n1].to));
-                        F(state_set_push(worklist, t2[n2].to));
-                        F(state_set_push(worklist, r));
-                        F(state_triple_push(newstates,
-                                             t1[n1].to, t2[n2].to, r));
+                        F(pair_push(newstates, &worklist, csr2,
+                                    t1->to, t2->to, r));
+                    } else {
+                        r = hnode_get(node);
                     }
-                    char min = t1[n1].min > t2[n2].min
-                        ? t1[n1].min : t2[n2].min;
-                    char max = t1[n1].max < t2[n2].max
-                        ? t1[n1].max : t2[n2].max;
-                    ret = add_new_trans(s, r, min, max);
-                    if (ret < 0)
-                        goto error;
+                    uchar min = t1->min > t2->min ? t1->min : t2->min;
+                    uchar max = t1->max < t2->max ? t1->max : t2->max;
+                    F(add_new_trans(s, r, min, max));
                 }
             }
         }
@@ -2270,8 +2901,10 @@ struct fa *fa_intersect(struct fa *fa1, struct fa *fa2) {
     fa->deterministic = fa1->deterministic && fa2->deterministic;
     fa->nocase = fa1->nocase && fa2->nocase;
  done:
-    state_set_free(worklist);
-    state_triple_free(newstates);
+    free(worklist.pairs);
+    pair_map_free(newstates);
+    csr_free(csr1);
+    csr_free(csr2);
     if (fa != NULL) {
         if (collect(fa) < 0) {
             fa_free(fa);
@@ -2288,8 +2921,11 @@ struct fa *fa_intersect(struct fa *fa1, struct fa *fa2) {
 
 int fa_contains(struct fa *fa1, struct fa *fa2) {
     int result = 0;
-    struct state_set *worklist = NULL;  /* List of pairs of states */
-    struct state_set *visited = NULL;   /* List of pairs of states */
+    struct csr *csr1 = NULL, *csr2 = NULL;
+    hash_t *visited = NULL;
+    struct pair_stack worklist;
+
+    MEMZERO(&worklist, 1);
 
     if (fa1 == NULL || fa2 == NULL)
         return -1;
@@ -2298,51 +2934,52 @@ int fa_contains(struct fa *fa1, struct fa *fa2) {
         return 1;
 
     F(determinize(fa2, NULL));
-    sort_transition_intervals(fa1);
-    sort_transition_intervals(fa2);
+    csr1 = csr_make(fa1);
+    csr2 = csr_make(fa2);
+    visited = pair_map_init();
+    E(csr1 == NULL || csr2 == NULL || visited == NULL);
 
-    F(state_pair_push(&worklist, fa1->initial, fa2->initial));
-    F(state_pair_push(&visited, fa1->initial, fa2->initial));
-    while (worklist->used) {
-        struct state *p1, *p2;
-        void *v2;
-        p1 = state_set_pop_data(worklist, &v2);
-        p2 = v2;
+    F(pair_push(visited, &worklist, csr2, 0, 0, NULL));
+    while (worklist.used > 0) {
+        struct state_pair *pair = worklist.pairs + --worklist.used;
+        unsigned int q1 = pair->q1, q2 = pair->q2;
 
-        if (p1->accept && !p2->accept)
+        if (csr1->states[q1]->accept && !csr2->states[q2]->accept)
             goto done;
 
-        struct trans *t1 = p1->trans;
-        struct trans *t2 = p2->trans;
-        for(int n1 = 0, b2 = 0; n1 < p1->tused; n1++) {
-            while (b2 < p2->tused && t2[b2].max < t1[n1].min)
+        /* Every character that leads somewhere from Q1 must also lead
+         * somewhere from Q2; MIN1 is the first character of T1 that we
+         * have not seen a transition from Q2 for yet */
+        struct csr_trans *t1 = csr_first_trans(csr1, q1);
+        struct csr_trans *end1 = csr_end_trans(csr1, q1);
+        struct csr_trans *b2 = csr_first_trans(csr2, q2);
+        struct csr_trans *end2 = csr_end_trans(csr2, q2);
+        for (; t1 < end1; t1++) {
+            while (b2 < end2 && b2->max < t1->min)
                 b2++;
-            int min1 = t1[n1].min, max1 = t1[n1].max;
-            for (int n2 = b2;
-                 n2 < p2->tused && t1[n1].max >= t2[n2].min;
-                 n2++) {
-                if (t2[n2].min > min1)
+            int min1 = t1->min;
+            for (struct csr_trans *t2 = b2;
+                 t2 < end2 && t1->max >= t2->min;
+                 t2++) {
+                if (t2->min > min1)
                     goto done;
-                if (t2[n2].max < CHAR_MAX)
-                    min1 = t2[n2].max + 1;
-                else {
-                    min1 = UCHAR_MAX;
-                    max1 = UCHAR_MIN;
-                }
-                if (state_pair_find(visited, t1[n1].to, t2[n2].to) == -1) {
-                    F(state_pair_push(&worklist, t1[n1].to, t2[n2].to));
-                    F(state_pair_push(&visited, t1[n1].to, t2[n2].to));
-                }
+                min1 = t2->max + 1;
+                if (hash_lookup(visited,
+                                PAIR_KEY(csr2, t1->to, t2->to)) == NULL)
+                    F(pair_push(visited, &worklist, csr2,
+                                t1->to, t2->to, NULL));
             }
-            if (min1 <= max1)
+            if (min1 <= t1->max)
                 goto done;
         }
     }
 
     result = 1;
  done:
-    state_set_free(worklist);
-    state_set_free(visited);
+    free(worklist.pairs);
+    pair_map_free(visited);
+    csr_free(csr1);
+    csr_free(csr2);
     return result;
  error:
     result = -1;
@@ -2577,14 +3214,14 @@ static struct re_str *string_extend(struct re_str *dst,
     return dst;
 }
 
-static char pick_char(struct trans *t) {
-    for (int c = t->min; c <= t->max; c++)
+static char pick_char(uchar min, uchar max) {
+    for (int c = min; c <= max; c++)
         if (isalpha(c)) return c;
-    for (int c = t->min; c <= t->max; c++)
+    for (int c = min; c <= max; c++)
         if (isalnum(c)) return c;
-    for (int c = t->min; c <= t->max; c++)
+    for (int c = min; c <= max; c++)
         if (isprint(c)) return c;
-    return t->max;
+    return max;
 }
 
 /* Generate an example string for FA. Traverse all transitions and record
@@ -2619,7 +3256,7 @@ int fa_example(struct fa *fa, char **example, size_t *example_len) {
         struct state *s = state_set_pop(worklist);
         struct re_str *ps = state_set_find_data(path, s);
         for_each_trans(t, s) {
-            char c = pick_char(t);
+            char c = pick_char(t->min, t->max);
             int toind = state_set_index(path, t->to);
             if (toind == -1) {
                 struct re_str *w = string_extend(NULL, ps, c);
@@ -2660,6 +3297,117 @@ int fa_example(struct fa *fa, char **example, size_t *example_len) {
     return -1;
 }
 
+/* A pair of states reached while exploring the product of two automata in
+ * fa_intersects. We got to it from the pair with index PARENT on
+ * character C */
+struct product_node {
+    unsigned int q1;
+    unsigned int q2;
+    size_t       parent;
+    char         c;
+};
+
+/* Spell out the word that leads to NODES[N] */
+static int product_example(struct product_node *nodes, size_t n,
+                           char **example, size_t *example_len) {
+    size_t len = 0;
+
+    for (size_t i = n; i > 0; i = nodes[i].parent)
+        len += 1;
+    if (ALLOC_N(*example, len + 1) < 0)
+        return -1;
+    *example_len = len;
+    for (size_t i = n; i > 0; i = nodes[i].parent)
+        (*example)[--len] = nodes[i].c;
+    return 0;
+}
+
+int fa_intersects(struct fa *fa1, struct fa *fa2,
+                  char **example, size_t *example_len) {
+    struct csr *csr1 = NULL, *csr2 = NULL;
+    hash_t *visited = NULL;
+    struct product_node *nodes = NULL;
+    size_t nnodes = 0, nodes_size = 0;
+    int result = -1;
+
+    if (example != NULL) {
+        *example = NULL;
+        *example_len = 0;
+    }
+
+    if (fa1 == NULL || fa2 == NULL)
+        return -1;
+
+    if (fa1->nocase != fa2->nocase) {
+        F(case_expand(fa1));
+        F(case_expand(fa2));
+    }
+
+    csr1 = csr_make(fa1);
+    csr2 = csr_make(fa2);
+    visited = pair_map_init();
+    E(csr1 == NULL || csr2 == NULL || visited == NULL);
+
+    /* Breadth-first search, so that the first accepting pair we find is
+     * reached by a shortest word. NODES doubles as the queue */
+    F(ALLOC_N(nodes, array_initial_size));
+    nodes_size = array_initial_size;
+    F(hash_alloc_insert(visited, PAIR_KEY(csr2, 0, 0), NULL));
+    nodes[0].q1 = 0;
+    nodes[0].q2 = 0;
+    nnodes = 1;
+
+    for (size_t n = 0; n < nnodes; n++) {
+        unsigned int q1 = nodes[n].q1, q2 = nodes[n].q2;
+
+        if (csr1->states[q1]->accept && csr2->states[q2]->accept) {
+            if (example != NULL)
+                F(product_example(nodes, n, example, example_len));
+            result = 1;
+            goto done;
+        }
+
+        struct csr_trans *t1 = csr_first_trans(csr1, q1);
+        struct csr_trans *end1 = csr_end_trans(csr1, q1);
+        struct csr_trans *b2 = csr_first_trans(csr2, q2);
+        struct csr_trans *end2 = csr_end_trans(csr2, q2);
+        for (; t1 < end1; t1++) {
+            while (b2 < end2 && b2->max < t1->min)
+                b2++;
+            for (struct csr_trans *t2 = b2;
+                 t2 < end2 && t1->max >= t2->min;
+                 t2++) {
+                void *key = PAIR_KEY(csr2, t1->to, t2->to);
+                if (t2->max < t1->min || hash_lookup(visited, key) != NULL)
+                    continue;
+                if (nnodes == nodes_size) {
+                    nodes_size *= 2;
+                    F(REALLOC_N(nodes, nodes_size));
+                }
+                F(hash_alloc_insert(visited, key, NULL));
+                nodes[nnodes].q1 = t1->to;
+                nodes[nnodes].q2 = t2->to;
+                nodes[nnodes].parent = n;
+                nodes[nnodes].c =
+                    pick_char(t1->min > t2->min ? t1->min : t2->min,
+                              t1->max < t2->max ? t1->max : t2->max);
+                nnodes += 1;
+            }
+        }
+    }
+    result = 0;
+
+ done:
+    free(nodes);
+    pair_map_free(visited);
+    csr_free(csr1);
+    csr_free(csr2);
+    return result;
+ error:
+    result = -1;
+    goto done;
+}
+
 struct enum_intl {
     int       limit;
     int       nwords;
@@ -2741,6 +3489,32 @@ int fa_enumerate(struct fa *fa, int limit, char ***words) {
     goto done;
 }
 
+int fa_match(struct fa *fa, const char *word, size_t word_len) {
+    struct state *s = fa->initial;
+
+    if (! fa->deterministic) {
+        if (determinize(fa, NULL) < 0)
+            return -1;
+        s = fa->initial;
+    }
+
+    for (size_t i=0; i < word_len && s != NULL; i++) {
+        uchar c = word[i];
+        struct state *next = NULL;
+
+        if (fa->nocase)
+            c = tolower(c);
+        for_each_trans(t, s) {
+            if (t->min <= c && c <= t->max) {
+                next = t->to;
+                break;
+            }
+        }
+        s = next;
+    }
+    return s != NULL && s->accept;
+}
+
 /* Expand the automaton FA by replacing every transition s(c) -> p from
  * state s to p on character c by two transitions s(X) -> r, r(c) -> p via
  * a new state r.
@@ -2791,72 +3565,44 @@ static struct fa *expand_alphabet(struct fa *fa, int add_marker,
     return NULL;
 }
 
-static bitset *alphabet(struct fa *fa) {
-    bitset *bs = bitset_init(UCHAR_NUM);
-
+static void alphabet(struct fa *fa, struct charset *cs) {
+    MEMZERO(cs, 1);
     list_for_each(s, fa->initial) {
-        for (int i=0; i < s->tused; i++) {
-            for (uint c = s->trans[i].min; c <= s->trans[i].max; c++)
-                bitset_set(bs, c);
-        }
+        for_each_trans(t, s)
+            charset_add_range(cs, t->min, t->max);
     }
-    return bs;
 }
 
-static bitset *last_chars(struct fa *fa) {
-    bitset *bs = bitset_init(UCHAR_NUM);
-
+static void last_chars(struct fa *fa, struct charset *cs) {
+    MEMZERO(cs, 1);
     list_for_each(s, fa->initial) {
-        for (int i=0; i < s->tused; i++) {
-            if (s->trans[i].to->accept) {
-                for (uint c = s->trans[i].min; c <= s->trans[i].max; c++)
-                    bitset_set(bs, c);
-            }
+        for_each_trans(t, s) {
+            if (t->to->accept)
+                charset_add_range(cs, t->min, t->max);
         }
     }
-    return bs;
 }
 
-static bitset *first_chars(struct fa *fa) {
-    bitset *bs = bitset_init(UCHAR_NUM);
-    struct state *s = fa->initial;
-
-    for (int i=0; i < s->tused; i++) {
-        for (uint c = s->trans[i].min; c <= s->trans[i].max; c++)
-            bitset_set(bs, c);
-    }
-    return bs;
+static void first_chars(struct fa *fa, struct charset *cs) {
+    MEMZERO(cs, 1);
+    for_each_trans(t, fa->initial)
+        charset_add_range(cs, t->min, t->max);
 }
 
 /* Return true if F1 and F2 are known to be unambiguously concatenable
  * according to simple heuristics. Return false if they need to be checked
  * further to decide ambiguity */
 static bool is_splittable(struct fa *fa1, struct fa *fa2) {
-    bitset *alpha1 = NULL;
-    bitset *alpha2 = NULL;
-    bitset *last1 = NULL;
-    bitset *first2 = NULL;
-    bool result = false;
-
-    alpha2 = alphabet(fa2);
-    last1 = last_chars(fa1);
-    if (bitset_disjoint(last1, alpha2, UCHAR_NUM)) {
-        result = true;
-        goto done;
-    }
+    struct charset alpha1, alpha2, last1, first2;
 
-    alpha1 = alphabet(fa1);
-    first2 = first_chars(fa2);
-    if (bitset_disjoint(first2, alpha1, UCHAR_NUM)) {
-        result = true;
-        goto done;
-    }
- done:
-    bitset_free(alpha1);
-    bitset_free(alpha2);
-    bitset_free(last1);
-    bitset_free(first2);
-    return result;
+    alphabet(fa2, &alpha2);
+    last_chars(fa1, &last1);
+    if (charset_disjoint(&last1, &alpha2))
+        return true;
+
+    alphabet(fa1, &alpha1);
+    first_chars(fa2, &first2);
+    return charset_disjoint(&first2, &alpha1);
 }
 
 /* This algorithm is due to Anders Moeller, and can be found in class
@@ -2936,7 +3682,15 @@ int fa_ambig_example(struct fa *fa1, struct fa *fa2,
     b2 = ss;
     ss = NULL;
 
-    /* The automaton we are really interested in */
+    /* The automaton we are really interested in; most of the time it is
+     * empty, which is much cheaper to find out than building it */
+    r = fa_intersects(b1, b2, NULL, NULL);
+    if (r < 0)
+        goto error;
+    if (r == 0) {
+        ret = 0;
+        goto done;
+    }
     amb = fa_intersect(b1, b2);
     if (amb == NULL)
         goto error;
@@ -3063,7 +3817,7 @@ static void free_re(struct re *re) {
     } else if (re->type == ITER) {
         re_unref(re->exp);
     } else if (re->type == CSET) {
-        bitset_free(re->cset);
+        free(re->cset);
     }
     free(re);
 }
@@ -3214,9 +3968,10 @@ static struct re *make_re_char_set(bool negate, bool no_ranges) {
     if (re) {
         re->negate = negate;
         re->no_ranges = no_ranges;
-        re->cset = bitset_init(UCHAR_NUM);
-        if (re->cset == NULL)
+        if (ALLOC(re->cset) < 0) {
             re_unref(re);
+            re = NULL;
+        }
     }
     return re;
 }
@@ -3260,8 +4015,7 @@ static bool parse_char(struct re_parse *parse, int quoted, char *c) {
 
 static void add_re_char(struct re *re, uchar from, uchar to) {
     assert(re->type == CSET);
-    for (unsigned int c = from; c <= to; c++)
-        bitset_set(re->cset, c);
+    charset_add_range(re->cset, from, to);
 }
 
 static void parse_char_class(struct re_parse *parse, struct re *re) {
@@ -3651,7 +4405,7 @@ static int re_concat_as_string(const struct re *re, struct re_str *str) {
 }
 
 static bool cset_contains(const struct re *cset, int c) {
-    return bitset_get(cset->cset, c) != cset->negate;
+    return charset_has(cset->cset, c) != cset->negate;
 }
 
 static int re_cset_as_string(const struct re *re, struct re_str *str) {
@@ -3941,15 +4695,8 @@ static int convert_trans_to_re(struct state *s) {
 
     /* Simplify CSETs with a single char to a CHAR */
     for (int t=0; t < nto; t++) {
-        int cnt = 0;
-        uchar chr = UCHAR_MIN;
-        for (int c = 0; c < UCHAR_NUM; c++) {
-            if (bitset_get(trans[t].re->cset, c)) {
-                cnt += 1;
-                chr = c;
-            }
-        }
-        if (cnt == 1) {
+        if (charset_count(trans[t].re->cset) == 1) {
+            uchar chr = charset_next(trans[t].re->cset, 0, true);
             re_unref(trans[t].re);
             trans[t].re = make_re_char(chr);
             if (trans[t].re == NULL)
@@ -4249,10 +4996,9 @@ static int re_restrict_alphabet(struct re *re, uchar from, uchar to) {
     case CSET:
         if (re->negate) {
             re->negate = 0;
-            bitset_negate(re->cset, UCHAR_NUM);
+            charset_negate(re->cset);
         }
-        for (int i=from; i <= to; i++)
-            bitset_clr(re->cset, i);
+        charset_del_range(re->cset, from, to);
         break;
     case CHAR:
         if (from <= re->c && re->c <= to)
@@ -4344,16 +5090,8 @@ static int re_case_expand(struct re *re) {
         result = (r1 != 0) ? r1 : r2;
         break;
     case CSET:
-        for (int c = 'A'; c <= 'Z'; c++)
-            if (bitset_get(re->cset, c)) {
-                result = 1;
-                bitset_set(re->cset, tolower(c));
-            }
-        for (int c = 'a'; c <= 'z'; c++)
-            if (bitset_get(re->cset, c)) {
-                result = 1;
-                bitset_set(re->cset, toupper(c));
-            }
+        if (charset_case_expand(re->cset))
+            result = 1;
         break;
     case CHAR:
         if (isalpha(re->c)) {
@@ -4361,11 +5099,10 @@ static int re_case_expand(struct re *re) {
             re->type = CSET;
             re->negate = false;
             re->no_ranges = 0;
-            re->cset = bitset_init(UCHAR_NUM);
-            if (re->cset == NULL)
+            if (ALLOC(re->cset) < 0)
                 return -1;
-            bitset_set(re->cset, tolower(c));
-            bitset_set(re->cset, toupper(c));
+            charset_add(re->cset, c);
+            charset_case_expand(re->cset);
             result = 1;
         }
         break;
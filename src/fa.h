@@ -37,19 +37,22 @@ enum fa_basic {
 };
 
 /* Choice of minimization algorithm to use; either Hopcroft's O(n log(n))
- * algorithm or Brzozowski's reverse-determinize-reverse-determinize
- * algorithm. While the latter has exponential complexity in theory, it
- * works quite well for some cases.
+ * algorithm, Brzozowski's reverse-determinize-reverse-determinize
+ * algorithm, or Valmari and Lehtinen's O(n + m log(m)) partition
+ * refinement, which works on the transitions the automaton has instead of
+ * making it total first. While Brzozowski's algorithm has exponential
+ * complexity in theory, it works quite well for some cases.
  */
 enum fa_minimization_algorithms {
     FA_MIN_HOPCROFT,
-    FA_MIN_BRZOZOWSKI
+    FA_MIN_BRZOZOWSKI,
+    FA_MIN_VALMARI
 };
 
 /* Which minimization algorithm to use in FA_MINIMIZE. The library
  * minimizes internally at certain points, too.
  *
- * Defaults to FA_MIN_HOPCROFT
+ * Defaults to FA_MIN_VALMARI
  */
 extern int fa_minimization_algorithm;
 
@@ -139,9 +142,52 @@ int fa_contains(struct fa *fa1, struct fa *fa2);
 /* Return 1 if the language of FA1 equals the language of FA2 */
 int fa_equals(struct fa *fa1, struct fa *fa2);
 
+/* Return 1 if the languages of FA1 and FA2 have a word in common, 0 if
+ * they are disjoint, and -1 if we run out of memory. This is the same as
+ * checking whether FA_INTERSECT(FA1, FA2) is empty, but explores the
+ * product of FA1 and FA2 without building it, and stops as soon as it
+ * finds a common word.
+ *
+ * If EXAMPLE is not NULL and the languages are not disjoint, *EXAMPLE is
+ * set to one of the shortest common words, and *EXAMPLE_LEN to its
+ * length. The caller must free *EXAMPLE.
+ */
+int fa_intersects(struct fa *fa1, struct fa *fa2,
+                  char **example, size_t *example_len);
+
 /* Free all memory used by FA */
 void fa_free(struct fa *fa);
 
+/* Return a copy of FA, or NULL if we run out of memory. The copy is as
+ * deterministic and as minimal as FA; copying an automaton is much cheaper
+ * than compiling its regexp again.
+ */
+struct fa *fa_clone(struct fa *fa);
+
+/* Write FA into a newly allocated buffer *BUF of *BUF_LEN bytes, in a
+ * compact binary format that FA_DESERIALIZE reads back. The format is
+ * versioned and made of 32 bit little endian numbers, so that the buffer
+ * can be stored in a file and used from a memory mapping of it. The same
+ * automaton always produces the same bytes; minimize FA first to make the
+ * buffer as small as possible. As a side effect, the transitions of FA
+ * are sorted.
+ *
+ * Return 0 on success, and -1 if we run out of memory. The caller must
+ * free *BUF.
+ */
+int fa_serialize(struct fa *fa, char **buf, size_t *buf_len);
+
+/* Make an automaton from the BUF_LEN bytes in BUF that FA_SERIALIZE
+ * produced, and store it in *FA. BUF is not needed anymore afterwards.
+ * The automaton is not assumed to be minimal, even if it was when it was
+ * serialized.
+ *
+ * Return 0 on success, -1 if we run out of memory, and -2 if BUF does
+ * not hold a serialized automaton in a version of the format we know. On
+ * error, *FA is NULL.
+ */
+int fa_deserialize(const char *buf, size_t buf_len, struct fa **fa);
+
 /* Print FA to OUT as a graphviz dot file */
 void fa_dot(FILE *out, struct fa *fa);
 
@@ -267,6 +313,15 @@ int fa_expand_nocase(const char *regexp, size_t regexp_len,
  */
 int fa_enumerate(struct fa *fa, int limit, char ***words);
 
+/* Return 1 if FA accepts the word WORD of length WORD_LEN, and 0 if it
+ * does not. FA is made deterministic first if it is not already, and -1
+ * is returned if that runs out of memory.
+ *
+ * Matching takes time linear in WORD_LEN and does not allocate memory
+ * once FA is deterministic.
+ */
+int fa_match(struct fa *fa, const char *word, size_t word_len);
+
 #endif
 
 
@@ -513,8 +513,10 @@ static struct skel *parse_del(struct lens *lens, struct state *state) {
     skel = make_skel(lens);
     if (! REG_MATCHED(state))
         no_match_error(state, lens);
-    else
+    else {
         skel->text = token(state);
+        update_span(state->span, REG_START(state), REG_END(state));
+    }
     return skel;
 }
 
@@ -539,9 +541,10 @@ static struct tree *get_store(struct lens *lens, struct state *state) {
     return tree;
 }
 
-static struct skel *parse_store(struct lens *lens,
-                                ATTRIBUTE_UNUSED struct state *state) {
+static struct skel *parse_store(struct lens *lens, struct state *state) {
     ensure0(lens->tag == L_STORE, state->info);
+    if (REG_MATCHED(state))
+        update_span(state->span, REG_START(state), REG_END(state));
     return make_skel(lens);
 }
 
@@ -737,6 +740,10 @@ static struct skel *parse_quant_star(struct lens *lens, struct state *state,
         struct dict *di = NULL;
 
         sk = parse_lens(lens->child, state, &di);
+        if (sk != NULL) {
+            sk->start = start;
+            sk->end = start + REG_SIZE(state);
+        }
         list_tail_cons(skel->skels, tail, sk);
         dict_append(dict, di);
 
@@ -819,14 +826,32 @@ static struct tree *get_subtree(struct lens *lens, struct state *state) {
 static struct skel *parse_subtree(struct lens *lens, struct state *state,
                                   struct dict **dict) {
     char *key = state->key;
-    struct skel *skel;
+    struct span *span = state->span;
+    struct span range;
+    struct skel *skel, *child;
     struct dict *di = NULL;
 
+    /* Track the text the subtree covers the same way get_subtree does
+     * for its span */
+    MEMZERO(&range, 1);
+    range.span_start = UINT_MAX;
+    state->span = &range;
+
     state->key = NULL;
-    skel = parse_lens(lens->child, state, &di);
-    *dict = make_dict(state->key, skel, di);
+    child = parse_lens(lens->child, state, &di);
+    *dict = make_dict(state->key, child, di);
     state->key = key;
-    return make_skel(lens);
+    state->span = span;
+    skel = make_skel(lens);
+    if (skel != NULL) {
+        skel->child = child;
+        if (range.span_start != UINT_MAX) {
+            skel->start = range.span_start;
+            skel->end = range.span_end;
+            update_span(span, range.span_start, range.span_end);
+        }
+    }
+    return skel;
 }
 
 /* Check if left and right strings matches according to the square lens
@@ -1189,6 +1214,7 @@ static void visit_exit(struct lens *lens,
             struct dict *dict;
             skel = make_skel(lens);
             ERR_NOMEM(skel == NULL, lens->info);
+            skel->child = top->skel;
             dict = make_dict(top->key, top->skel, top->dict);
             ERR_NOMEM(dict == NULL, lens->info);
             top = pop_frame(rec_state);
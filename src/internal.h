@@ -32,6 +32,7 @@
 #include <strings.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
 #include <assert.h>
@@ -85,6 +86,17 @@
 #define AUGEAS_COPY_IF_RENAME_FAILS \
     AUGEAS_META_SAVE_MODE "/copy_if_rename_fails"
 
+/* Define: AUGEAS_SAVE_SYNC
+ * How save makes files durable. With 'file', the default, every temporary
+ * file is synced with fsync before it is renamed into place. With 'batch',
+ * the temporary files of up to 64 files are flushed together with one
+ * syncfs per file system before they are renamed, and the directories they
+ * were renamed into are synced afterwards; if syncing a directory fails,
+ * the files are still saved, and /augeas/files/PATH/warning is set to
+ * 'sync_dir' for them. With 'none', nothing is synced, which is only safe
+ * for scratch roots, e.g. on a tmpfs */
+#define AUGEAS_SAVE_SYNC AUGEAS_META_SAVE_MODE "/sync"
+
 /* Define: AUGEAS_CONTEXT
  * Context prepended to all non-absolute paths */
 #define AUGEAS_CONTEXT AUGEAS_META_TREE "/context"
@@ -107,6 +119,11 @@
    spec files */
 #define AUGEAS_LENS_ENV "AUGEAS_LENS_LIB"
 
+/* Define: AUGEAS_TYPECHECK_CACHE_ENV
+ * Name of env var that contains the file in which the results of lens
+ * typechecks are cached */
+#define AUGEAS_TYPECHECK_CACHE_ENV "AUGEAS_TYPECHECK_CACHE"
+
 /* Define: MAX_ENV_SIZE
  * Fairly arbitrary bound on the length of the path we
  *  accept from AUGEAS_SPEC_ENV */
@@ -123,6 +140,12 @@
 #define AUG_SAVE_NOOP_TEXT "noop"
 #define AUG_SAVE_OVERWRITE_TEXT "overwrite"
 
+/* Constants for the durability of saved files via the augeas path at
+ * AUGEAS_SAVE_SYNC */
+#define AUG_SAVE_SYNC_FILE_TEXT "file"
+#define AUG_SAVE_SYNC_BATCH_TEXT "batch"
+#define AUG_SAVE_SYNC_NONE_TEXT "none"
+
 /* constants for options in the tree */
 #define AUG_ENABLE "enable"
 #define AUG_DISABLE "disable"
@@ -332,6 +355,23 @@ struct augeas {
     struct error        *error;
     uint                api_entries;  /* Number of entries through a public
                                        * API, 0 when called from outside */
+    unsigned int        generation;   /* Incremented by every public API
+                                       * call that may free tree nodes;
+                                       * used to detect stale aug_node
+                                       * handles */
+    unsigned int        api_calls;    /* Incremented by every call of
+                                       * api_entry, including internal
+                                       * ones; the tree can only change
+                                       * between two such calls */
+    struct hash_t       *xfm_filters; /* Compiled filters of the transforms
+                                       * under /augeas/load, see
+                                       * transform.c */
+    char                *tc_cache;    /* File caching typecheck results,
+                                       * NULL if not used */
+    uint64_t            *tc_keys;     /* Sorted keys of the modules that
+                                       * passed their typechecks, see
+                                       * syntax.c */
+    size_t               ntc_keys;
 #if HAVE_USELOCALE
     /* On systems that have a uselocale call, we switch to the C locale
      * on entry into API functions, and back to the old user locale
@@ -557,6 +597,10 @@ int pathx_parse(const struct tree *origin,
 struct error *err_of_pathx(struct pathx *px);
 struct tree *pathx_first(struct pathx *path);
 struct tree *pathx_next(struct pathx *path);
+/* Discard the results of evaluating PATH so that the next call to
+ * pathx_first or pathx_expand_tree evaluates it against the current state
+ * of the tree. This is much cheaper than parsing the same path again */
+void pathx_reset(struct pathx *path);
 /* Return -1 if evalutating PATH runs into trouble, otherwise return the
  * number of nodes matching PATH and set MATCH to the first matching
  * node */
@@ -22,11 +22,17 @@
 
 #include <config.h>
 #include <stddef.h>
+#include <sys/time.h>
 
 #include "lens.h"
 #include "memory.h"
 #include "errcode.h"
 #include "internal.h"
+#include "hash.h"
+
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 /* This enum must be kept in sync with type_offs and ntypes */
 enum lens_type {
@@ -95,6 +101,173 @@ static void bug_lens_tag(struct lens *lens, const char *file, int lineno) {
     return;
 }
 
+/*
+ * A cache of the automata for the regexps we typecheck with
+ *
+ * The same building blocks, e.g. the regexps in util.aug and rx.aug,
+ * recur in the types of many lenses. The cache maps a pattern and its
+ * case sensitivity to the automaton for it, and hands out copies of that,
+ * since the typechecking operations are free to modify the automata they
+ * are given. Automata for patterns of at least FA_CACHE_MINIMIZE_LEN
+ * characters are minimized: regexps that were pasted together from the
+ * types of other lenses, like the approximations computed for recursive
+ * lenses, compile to automata with thousands of states for a language
+ * that needs a few dozen, and the products that the ambiguity checks
+ * build on them are correspondingly huge. Shorter patterns are left
+ * alone, since determinizing them can cost more than it saves. The cache
+ * is shared by all augeas handles in the process, and emptied whenever
+ * it holds FA_CACHE_MAX automata.
+ */
+#define FA_CACHE_MAX 4096
+#define FA_CACHE_MINIMIZE_LEN 1024
+
+struct fa_cache_key {
+    const char *pattern;
+    int         nocase;
+};
+
+struct fa_cache_entry {
+    struct fa_cache_key key;
+    struct fa          *fa;
+};
+
+static hash_t *fa_cache = NULL;
+#if HAVE_PTHREAD
+static pthread_mutex_t fa_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static hash_val_t fa_cache_hash(const void *key) {
+    const struct fa_cache_key *k = key;
+    hash_val_t h = k->nocase ? 1 : 0;
+
+    for (const char *p = k->pattern; *p != '\0'; p++)
+        h = h * 31 + (unsigned char) *p;
+    return h;
+}
+
+static int fa_cache_cmp(const void *key1, const void *key2) {
+    const struct fa_cache_key *k1 = key1, *k2 = key2;
+
+    if (k1->nocase != k2->nocase)
+        return k1->nocase - k2->nocase;
+    return strcmp(k1->pattern, k2->pattern);
+}
+
+static void fa_cache_node_free(hnode_t *node, ATTRIBUTE_UNUSED void *ctx) {
+    struct fa_cache_entry *entry = hnode_get(node);
+
+    free((char *) entry->key.pattern);
+    fa_free(entry->fa);
+    free(entry);
+    free(node);
+}
+
+static void fa_cache_clear(void) {
+    hash_free_nodes(fa_cache);
+}
+
+static hnode_t *fa_cache_node(const char *pattern, int nocase) {
+    struct fa_cache_key key = { .pattern = pattern, .nocase = nocase };
+
+    if (fa_cache == NULL)
+        return NULL;
+    return hash_lookup(fa_cache, &key);
+}
+
+/* Return a copy of the automaton for PATTERN from the cache, or NULL if
+ * it is not in the cache. Must be called with FA_CACHE_LOCK held */
+static struct fa *fa_cache_lookup(const char *pattern, int nocase) {
+    hnode_t *node = fa_cache_node(pattern, nocase);
+
+    if (node == NULL)
+        return NULL;
+    return fa_clone(((struct fa_cache_entry *) hnode_get(node))->fa);
+}
+
+/* Add FA as the automaton for PATTERN to the cache; the cache takes
+ * ownership of FA. Failing to add FA is not an error, it merely means
+ * that we will compile PATTERN again the next time we need it. Must be
+ * called with FA_CACHE_LOCK held */
+static void fa_cache_add(const char *pattern, int nocase, struct fa *fa) {
+    struct fa_cache_entry *entry = NULL;
+
+    if (fa_cache == NULL) {
+        fa_cache = hash_create(HASHCOUNT_T_MAX, fa_cache_cmp, fa_cache_hash);
+        if (fa_cache == NULL)
+            goto error;
+        hash_set_allocator(fa_cache, NULL, fa_cache_node_free, NULL);
+    }
+    if (fa_cache_node(pattern, nocase) != NULL) {
+        /* Another thread beat us to it */
+        fa_free(fa);
+        return;
+    }
+    if (hash_count(fa_cache) >= FA_CACHE_MAX)
+        fa_cache_clear();
+
+    if (ALLOC(entry) < 0)
+        goto error;
+    entry->key.pattern = strdup(pattern);
+    if (entry->key.pattern == NULL)
+        goto error;
+    entry->key.nocase = nocase;
+    entry->fa = fa;
+    if (hash_alloc_insert(fa_cache, &entry->key, entry) < 0)
+        goto error;
+    return;
+ error:
+    if (entry != NULL)
+        free((char *) entry->key.pattern);
+    free(entry);
+    fa_free(fa);
+}
+
+static void fa_cache_enter(void) {
+#if HAVE_PTHREAD
+    pthread_mutex_lock(&fa_cache_lock);
+#endif
+}
+
+static void fa_cache_leave(void) {
+#if HAVE_PTHREAD
+    pthread_mutex_unlock(&fa_cache_lock);
+#endif
+}
+
+/* Compile PATTERN into an automaton in *FA, going through the cache.
+ * Return the REG_ERRCODE_T from compiling PATTERN, and -1 if we run out
+ * of memory */
+static int fa_cache_compile(const char *pattern, int nocase, struct fa **fa) {
+    struct fa *cached = NULL;
+    int error;
+
+    fa_cache_enter();
+    *fa = fa_cache_lookup(pattern, nocase);
+    fa_cache_leave();
+    if (*fa != NULL)
+        return REG_NOERROR;
+
+    error = fa_compile(pattern, strlen(pattern), fa);
+    if (error != REG_NOERROR)
+        return error;
+    if (nocase && fa_nocase(*fa) < 0)
+        goto error;
+    if (strlen(pattern) >= FA_CACHE_MINIMIZE_LEN && fa_minimize(*fa) < 0)
+        goto error;
+
+    cached = fa_clone(*fa);
+    if (cached != NULL) {
+        fa_cache_enter();
+        fa_cache_add(pattern, nocase, cached);
+        fa_cache_leave();
+    }
+    return REG_NOERROR;
+ error:
+    fa_free(*fa);
+    *fa = NULL;
+    return -1;
+}
+
 /* Construct a finite automaton from REGEXP and return it in *FA.
  *
  * Return NULL if REGEXP is valid, if the regexp REGEXP has syntax errors,
@@ -108,14 +281,10 @@ static struct value *str_to_fa(struct info *info, const char *pattern,
     char *re_str = NULL, *re_err = NULL;
 
     *fa = NULL;
-    error = fa_compile(pattern, strlen(pattern), fa);
-    if (error == REG_NOERROR) {
-        if (nocase) {
-            error = fa_nocase(*fa);
-            ERR_NOMEM(error < 0, info);
-        }
+    error = fa_cache_compile(pattern, nocase, fa);
+    if (error == REG_NOERROR)
         return NULL;
-    }
+    ERR_NOMEM(error < 0, info);
 
     re_str = escape(pattern, -1, RX_ESCAPES);
     ERR_NOMEM(re_str == NULL, info);
@@ -565,10 +734,11 @@ struct value *lns_make_prim(enum lens_tag tag, struct info *info,
     struct value *exn = NULL;
     struct fa *fa_slash = NULL;
     struct fa *fa_key = NULL;
-    struct fa *fa_isect = NULL;
 
     /* Typecheck */
     if (tag == L_KEY) {
+        int r;
+
         exn = str_to_fa(info, "(.|\n)*/(.|\n)*", &fa_slash, regexp->nocase);
         if (exn != NULL)
             goto error;
@@ -577,17 +747,20 @@ struct value *lns_make_prim(enum lens_tag tag, struct info *info,
         if (exn != NULL)
             goto error;
 
-        fa_isect = fa_intersect(fa_slash, fa_key);
-        if (! fa_is_basic(fa_isect, FA_EMPTY)) {
+        r = fa_intersects(fa_slash, fa_key, NULL, NULL);
+        if (r < 0) {
+            exn = make_exn_value(info, "not enough memory");
+            goto error;
+        }
+        if (r > 0) {
             exn = make_exn_value(info,
                                  "The key regexp /%s/ matches a '/'",
                                  regexp->pattern->str);
             goto error;
         }
-        fa_free(fa_isect);
         fa_free(fa_key);
         fa_free(fa_slash);
-        fa_isect = fa_key = fa_slash = NULL;
+        fa_key = fa_slash = NULL;
     } else if (tag == L_LABEL) {
         if (strchr(string->str, SEP) != NULL) {
             exn = make_exn_value(info,
@@ -656,7 +829,6 @@ struct value *lns_make_prim(enum lens_tag tag, struct info *info,
 
     return make_lens_value(lens);
  error:
-    fa_free(fa_isect);
     fa_free(fa_key);
     fa_free(fa_slash);
     return exn;
@@ -672,6 +844,7 @@ static struct value *disjoint_check(struct info *info, bool is_get,
     struct fa *fa = NULL;
     struct value *exn = NULL;
     const char *const msg = is_get ? "union.get" : "tree union.put";
+    int r;
 
     if (r1 == NULL || r2 == NULL)
         return NULL;
@@ -684,8 +857,20 @@ static struct value *disjoint_check(struct info *info, bool is_get,
     if (exn != NULL)
         goto done;
 
-    fa = fa_intersect(fa1, fa2);
-    if (! fa_is_basic(fa, FA_EMPTY)) {
+    /* Looking for a common word is much cheaper than building the
+     * intersection. We only build it when there is one, so that the
+     * example in the error message is still the one fa_example picks */
+    r = fa_intersects(fa1, fa2, NULL, NULL);
+    if (r > 0) {
+        fa = fa_intersect(fa1, fa2);
+        if (fa == NULL)
+            r = -1;
+    }
+    if (r < 0) {
+        exn = make_exn_value(ref(info), "not enough memory");
+        goto done;
+    }
+    if (r > 0) {
         size_t xmpl_len;
         char *xmpl;
         fa_example(fa, &xmpl, &xmpl_len);
@@ -978,6 +1163,220 @@ static struct value *typecheck_maybe(struct info *info, struct lens *l) {
     return exn;
 }
 
+/*
+ * Deferred typechecks
+ *
+ * The ambiguity and disjointness checks for a union, concatenation or
+ * iteration only read the types of the lenses involved, so that a batch
+ * of them can be run in parallel. The worker threads only find out
+ * whether a check passes; the exception for the first check in the batch
+ * that fails is produced afterwards, by running that check again with the
+ * same code that lns_make_union etc. use, so that the result is exactly
+ * what running the checks one after the other would have produced.
+ */
+
+/* The maximum number of threads used to run typechecks in parallel */
+#define CHECK_MAX_THREADS 32
+
+/* Return 1 if R1 and R2 might overlap, 0 if they are disjoint */
+static int check_overlap(struct regexp *r1, struct regexp *r2) {
+    struct fa *fa1 = NULL, *fa2 = NULL;
+    int result = 1;
+
+    if (r1 == NULL || r2 == NULL)
+        return 0;
+
+    if (fa_cache_compile(r1->pattern->str, r1->nocase, &fa1) != REG_NOERROR)
+        goto done;
+    if (fa_cache_compile(r2->pattern->str, r2->nocase, &fa2) != REG_NOERROR)
+        goto done;
+    if (fa_intersects(fa1, fa2, NULL, NULL) == 0)
+        result = 0;
+ done:
+    fa_free(fa1);
+    fa_free(fa2);
+    return result;
+}
+
+/* Return 1 if the concatenation of R1 and R2 might be ambiguous, 0 if it
+ * is not. If R2 is NULL, check the iteration of R1 instead */
+static int check_ambig(struct regexp *r1, struct regexp *r2, bool iterated) {
+    struct fa *fa1 = NULL, *fa2 = NULL;
+    char *upv = NULL;
+    size_t upv_len;
+    int result = 1, r;
+
+    if (r1 == NULL || (! iterated && r2 == NULL))
+        return 0;
+
+    if (fa_cache_compile(r1->pattern->str, r1->nocase, &fa1) != REG_NOERROR)
+        goto done;
+    if (iterated) {
+        fa2 = fa_iter(fa1, 0, -1);
+        if (fa2 == NULL)
+            goto done;
+    } else {
+        r = fa_cache_compile(r2->pattern->str, r2->nocase, &fa2);
+        if (r != REG_NOERROR)
+            goto done;
+    }
+    r = fa_ambig_example(fa1, fa2, &upv, &upv_len, NULL, NULL);
+    if (r == 0 && upv == NULL)
+        result = 0;
+ done:
+    free(upv);
+    fa_free(fa1);
+    fa_free(fa2);
+    return result;
+}
+
+/* Return 1 if CHECK might fail, 0 if it passes. Only reads the lenses in
+ * CHECK, and can therefore run concurrently with other checks */
+static int check_fails(const struct lns_check *check) {
+    struct lens *l1 = check->l1, *l2 = check->l2;
+
+    switch (check->tag) {
+    case L_UNION:
+        return check_overlap(l1->ctype, l2->ctype)
+            || check_overlap(l1->atype, l2->atype);
+    case L_CONCAT:
+        return check_ambig(l1->ctype, l2->ctype, false)
+            || check_ambig(l1->atype, l2->atype, false);
+    case L_STAR:
+        return check_ambig(l1->ctype, NULL, true)
+            || check_ambig(l1->atype, NULL, true);
+    default:
+        return 1;
+    }
+}
+
+static struct value *run_check(struct lns_check *check) {
+    switch (check->tag) {
+    case L_UNION:
+        return typecheck_union(check->info, check->l1, check->l2);
+    case L_CONCAT:
+        return typecheck_concat(check->info, check->l1, check->l2);
+    case L_STAR:
+        return typecheck_iter(check->info, check->l1);
+    default:
+        BUG_ON(true, check->info, "illegal typecheck tag %d", check->tag);
+    }
+ error:
+    return check->info->error->exn;
+}
+
+#if HAVE_PTHREAD
+/* Hand out the checks in POOL to the threads running CHECK_WORKER */
+struct check_pool {
+    const struct lns_check *checks;
+    char                   *fails;
+    size_t                  nchecks;
+    size_t                  next;
+    size_t                  first_failure;
+    pthread_mutex_t         lock;
+};
+
+static void *check_worker(void *arg) {
+    struct check_pool *pool = arg;
+
+    for (;;) {
+        size_t i;
+
+        pthread_mutex_lock(&pool->lock);
+        i = pool->next++;
+        /* Checks after one that fails would never have run */
+        if (i > pool->first_failure)
+            i = pool->nchecks;
+        pthread_mutex_unlock(&pool->lock);
+        if (i >= pool->nchecks)
+            break;
+        pool->fails[i] = check_fails(pool->checks + i);
+        if (pool->fails[i]) {
+            pthread_mutex_lock(&pool->lock);
+            if (i < pool->first_failure)
+                pool->first_failure = i;
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+    return NULL;
+}
+
+/* Set FAILS[i] to 0 for the checks in CHECKS that pass, using as many
+ * threads as there are processors. Checks after the first one that fails
+ * may be skipped. Return -1 if we run out of memory */
+static int check_all(const struct lns_check *checks, size_t nchecks,
+                     char *fails) {
+    struct check_pool pool = {
+        .checks = checks, .fails = fails, .nchecks = nchecks,
+        .next = 0, .first_failure = nchecks
+    };
+    pthread_t *threads = NULL;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads = 0, maxthreads;
+
+    maxthreads = ncpus > 0 ? ncpus : 1;
+    if (maxthreads > CHECK_MAX_THREADS)
+        maxthreads = CHECK_MAX_THREADS;
+    if (maxthreads > nchecks)
+        maxthreads = nchecks;
+    if (maxthreads > 1 && ALLOC_N(threads, maxthreads - 1) < 0)
+        return -1;
+
+    pthread_mutex_init(&pool.lock, NULL);
+    while (nthreads + 1 < maxthreads) {
+        if (pthread_create(threads + nthreads, NULL, check_worker, &pool) != 0)
+            break;
+        nthreads += 1;
+    }
+    check_worker(&pool);
+    for (size_t i=0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&pool.lock);
+    free(threads);
+    return 0;
+}
+#else
+static int check_all(ATTRIBUTE_UNUSED const struct lns_check *checks,
+                     ATTRIBUTE_UNUSED size_t nchecks,
+                     ATTRIBUTE_UNUSED char *fails) {
+    return 0;
+}
+#endif
+
+size_t lns_run_checks(struct lns_check *checks, size_t nchecks,
+                      struct value **exn) {
+    char *fails = NULL;
+    size_t i;
+
+    *exn = NULL;
+    if (nchecks == 0)
+        return 0;
+
+    if (ALLOC_N(fails, nchecks) == 0) {
+        memset(fails, 1, nchecks);
+        if (check_all(checks, nchecks, fails) < 0)
+            FREE(fails);
+    }
+
+    for (i=0; i < nchecks; i++) {
+        if (fails != NULL && ! fails[i])
+            continue;
+        *exn = run_check(checks + i);
+        if (*exn != NULL)
+            break;
+    }
+    free(fails);
+    return i;
+}
+
+void lns_release_checks(struct lns_check *checks, size_t nchecks) {
+    for (size_t i=0; i < nchecks; i++) {
+        unref(checks[i].info, info);
+        unref(checks[i].l1, lens);
+        unref(checks[i].l2, lens);
+    }
+}
+
 void free_lens(struct lens *lens) {
     if (lens == NULL)
         return;
@@ -1027,6 +1426,7 @@ void free_lens(struct lens *lens) {
 
     unref(lens->info, info);
     jmt_free(lens->jmt);
+    free_tokfa(lens->tokfa);
     free(lens);
  error:
     return;
@@ -1055,6 +1455,8 @@ void lens_release(struct lens *lens) {
 
     jmt_free(lens->jmt);
     lens->jmt = NULL;
+    free_tokfa(lens->tokfa);
+    lens->tokfa = NULL;
 }
 
 /*
@@ -1389,6 +1791,10 @@ struct state {
     struct state  *next;   /* Linked list for memory management */
     size_t         ntrans;
     struct trans  *trans;
+    /* Bookkeeping for rtn_reduce */
+    unsigned int   eliminated : 1;
+    size_t         nin;    /* Number of transitions into this state */
+    size_t         win;    /* Total length of their regexps */
 };
 
 /* Productions for lens LENS. Start state START and end state END. If we
@@ -1826,6 +2232,51 @@ static void collapse_trans(struct rtn *rtn,
     return;
 }
 
+static size_t elim_len(struct regexp *re) {
+    return re == NULL ? 0 : strlen(re->pattern->str);
+}
+
+/* Count the transitions into each state that has not been eliminated yet,
+ * and the total length of their regexps, ignoring loops */
+static void elim_count_in(struct rtn *rtn) {
+    list_for_each(s, rtn->states) {
+        s->nin = 0;
+        s->win = 0;
+    }
+    list_for_each(s, rtn->states) {
+        if (s->eliminated)
+            continue;
+        for (int i=0; i < s->ntrans; i++) {
+            struct state *to = s->trans[i].to;
+            if (to != s) {
+                to->nin += 1;
+                to->win += elim_len(s->trans[i].re);
+            }
+        }
+    }
+}
+
+/* The weight of eliminating S, following Delgado and Morais,
+ * "Approximation to the Smallest Regular Expression for a Given Regular
+ * Language": roughly by how much the total length of all regexps grows
+ * when we eliminate S. Needs the counts from elim_count_in */
+static long elim_weight(struct state *s) {
+    long nout = 0, wout = 0, wloop = 0;
+    long nin = s->nin;
+
+    for (int i=0; i < s->ntrans; i++) {
+        struct state *to = s->trans[i].to;
+        if (to == s) {
+            wloop = elim_len(s->trans[i].re);
+        } else if (! to->eliminated) {
+            nout += 1;
+            wout += elim_len(s->trans[i].re);
+        }
+    }
+    return (long) s->win * (nout - 1) + wout * (nin - 1)
+        + wloop * (nin * nout - 1);
+}
+
 /* Reduce the automaton with start state rprod->start and only accepting
  * state rprod->end so that we have a single transition rprod->start =>
  * rprod->end labelled with the overall approximating regexp for the
@@ -1909,11 +2360,29 @@ static struct regexp *rtn_reduce(struct rtn *rtn, struct lens *rec) {
      *           R3 the regexp of S1 -> S2 (or the regexp matching nothing
      *                                      if no such transition)
      *        set the regexp on the transition S1 -> S2 to
-     *          R1 . (LOOP)* . R2 | R3 */
-    // FIXME: This does not go over all states
-    list_for_each(s, rtn->states) {
-        if (s == prod->end || s == prod->start)
-            continue;
+     *          R1 . (LOOP)* . R2 | R3
+     *
+     * The order in which states are eliminated does not change the
+     * language of the result, but it can make a big difference in its
+     * size. We always eliminate the state of least weight next, see
+     * elim_weight */
+    while (true) {
+        struct state *s = NULL;
+        long weight = 0;
+
+        elim_count_in(rtn);
+        list_for_each(t, rtn->states) {
+            if (t == prod->end || t == prod->start || t->eliminated)
+                continue;
+            long w = elim_weight(t);
+            if (s == NULL || w < weight) {
+                s = t;
+                weight = w;
+            }
+        }
+        if (s == NULL)
+            break;
+
         struct regexp *loop = NULL;
         for (int i=0; i < s->ntrans; i++) {
             if (s == s->trans[i].to) {
@@ -1922,13 +2391,13 @@ static struct regexp *rtn_reduce(struct rtn *rtn, struct lens *rec) {
             }
         }
         list_for_each(s1, rtn->states) {
-            if (s == s1)
+            if (s == s1 || s1->eliminated)
                 continue;
             for (int t1=0; t1 < s1->ntrans; t1++) {
                 if (s == s1->trans[t1].to) {
                     for (int t2=0; t2 < s->ntrans; t2++) {
                         struct state *s2 = s->trans[t2].to;
-                        if (s2 == s)
+                        if (s2 == s || s2->eliminated)
                             continue;
                         collapse_trans(rtn, s1, s2,
                                        s1->trans[t1].re, loop,
@@ -1938,6 +2407,7 @@ static struct regexp *rtn_reduce(struct rtn *rtn, struct lens *rec) {
                 }
             }
         }
+        s->eliminated = 1;
     }
 
     /* Find the overall regexp */
@@ -2218,11 +2688,34 @@ static int ctype_nullable(struct lens *lens, struct value **exn) {
     return ret;
 }
 
+static double now_ms(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+/* Print how long approximating each type of REC and typechecking it took,
+ * for AUGEAS_DEBUG=cf.rec. TIMES has one more entry than TYPES */
+static void print_rec_times(struct lens *rec, const enum lens_type *types,
+                            int ntimes, const double *times) {
+    char *fi = format_info(rec->info);
+
+    printf("rec %s", fi != NULL ? fi : "?");
+    for (int i=0; i < ntimes - 1; i++)
+        printf(" %s %.2fms", lens_type_names[types[i]], times[i]);
+    printf(" check %.2fms\n", times[ntimes - 1]);
+    free(fi);
+}
+
 struct value *lns_check_rec(struct info *info,
                             struct lens *body, struct lens *rec,
                             int check) {
     /* The types in the order of approximation */
     static const enum lens_type types[] = { KTYPE, VTYPE, ATYPE };
+    double times[ARRAY_CARDINALITY(types) + 1];
+    bool timing = debugging("cf.rec");
+    double start = timing ? now_ms() : 0;
     struct value *result = NULL;
 
     ensure(rec->tag == L_REC, info);
@@ -2248,6 +2741,11 @@ struct value *lns_check_rec(struct info *info,
     for (int i=0; i < ARRAY_CARDINALITY(types); i++) {
         result = rtn_approx(rec, types[i]);
         ERR_BAIL(info);
+        if (timing) {
+            double t = now_ms();
+            times[i] = t - start;
+            start = t;
+        }
     }
 
     if (rec->atype == NULL) {
@@ -2269,6 +2767,10 @@ struct value *lns_check_rec(struct info *info,
     result = typecheck(rec->body, check);
     if (result != NULL)
         goto error;
+    if (timing) {
+        times[ARRAY_CARDINALITY(types)] = now_ms() - start;
+        print_rec_times(rec, types, ARRAY_CARDINALITY(times), times);
+    }
 
     result = lns_make_rec(ref(rec->info));
     struct lens *top = result->lens;
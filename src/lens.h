@@ -80,6 +80,7 @@ struct lens {
     struct regexp            *ktype;
     struct regexp            *vtype;
     struct jmt               *jmt;    /* When recursive == 1, might have jmt */
+    struct tokfa             *tokfa;  /* Built by put.c when needed */
     unsigned int              value : 1;
     unsigned int              key : 1;
     unsigned int              recursive : 1;
@@ -143,6 +144,29 @@ struct value *lns_make_maybe(struct info *, struct lens *,
 struct value *lns_make_square(struct info *, struct lens *, struct lens *,
                               struct lens *lens, int check);
 
+/* A typecheck that was put off when a union, concatenation or iteration
+ * was constructed without checking. TAG is L_UNION, L_CONCAT or L_STAR,
+ * and L2 is NULL for L_STAR. The check owns a reference to INFO, L1 and
+ * L2.
+ */
+struct lns_check {
+    enum lens_tag  tag;
+    struct info   *info;
+    struct lens   *l1;
+    struct lens   *l2;
+};
+
+/* Run the typechecks in CHECKS, in parallel if possible. Return the index
+ * of the first check that fails and set *EXN to its exception, which is
+ * the same one that lns_make_union etc. would have returned. If all
+ * checks pass, return NCHECKS and set *EXN to NULL.
+ */
+size_t lns_run_checks(struct lns_check *checks, size_t nchecks,
+                      struct value **exn);
+
+/* Drop the references held by CHECKS; does not free CHECKS itself */
+void lns_release_checks(struct lns_check *checks, size_t nchecks);
+
 
 /* Pretty-print a lens */
 char *format_lens(struct lens *l);
@@ -164,8 +188,15 @@ struct skel {
     union {
         char        *text;    /* L_DEL */
         struct skel *skels;   /* L_CONCAT, L_STAR */
+        struct skel *child;   /* L_SUBTREE, the skel of the subtree's
+                               * contents; owned by the dict */
     };
-    /* Also tag == L_SUBTREE, with no data in the union */
+    /* For the skels of the iterations of an L_STAR, the part of the text
+     * they were parsed from. For L_SUBTREE, the part of the text covered
+     * by its keys, stores and dels, like the span of the tree that
+     * get_subtree makes for it. END is 0 if that is not known */
+    uint         start;
+    uint         end;
 };
 
 struct lns_error {
@@ -178,6 +209,7 @@ struct lns_error {
 struct dict *make_dict(char *key, struct skel *skel, struct dict *subdict);
 void dict_lookup(const char *key, struct dict *dict,
                  struct skel **skel, struct dict **subdict);
+struct skel *dict_peek(const char *key, struct dict *dict, uint n);
 int dict_append(struct dict **dict, struct dict *d2);
 void free_skel(struct skel *skel);
 void free_dict(struct dict *dict);
@@ -196,8 +228,19 @@ struct tree *lns_get(struct info *info, struct lens *lens, const char *text,
                      struct lns_error **err);
 struct skel *lns_parse(struct lens *lens, const char *text,
                        struct dict **dict, struct lns_error **err);
-void lns_put(FILE *out, struct lens *lens, struct tree *tree,
-             const char *text, struct lns_error **err);
+/* Transform TREE back into text with LENS, keeping as much of the
+ * formatting of the original text TEXT as possible. The result is stored
+ * in *OUT, which the caller must free, and its length in *OUT_SIZE.
+ *
+ * If ERR is non-NULL, *ERR is set to NULL on success, and to an error
+ * message if the tree can not be transformed; *OUT holds whatever output
+ * was produced before the error. Return -1 if we run out of memory, and 0
+ * otherwise.
+ */
+int lns_put(struct lens *lens, struct tree *tree, const char *text,
+            char **out, size_t *out_size, struct lns_error **err);
+/* Free the automaton lns_put uses to match trees against LENS->ATYPE */
+void free_tokfa(struct tokfa *fa);
 
 /* Free up temporary data structures, most importantly compiled
    regular expressions */
@@ -19,7 +19,8 @@
 
 #define YYDEBUG 1
 
-int augl_parse_file(struct augeas *aug, const char *name, struct term **term);
+int augl_parse_file(struct augeas *aug, const char *name, const char *text,
+                    struct term **term);
 
 typedef void *yyscan_t;
 typedef struct info YYLTYPE;
@@ -114,7 +115,7 @@ struct state {
 %{
 /* Lexer */
 extern int augl_lex (YYSTYPE * yylval_param,struct info * yylloc_param ,yyscan_t yyscanner);
-int augl_init_lexer(struct state *state, yyscan_t * scanner);
+int augl_init_lexer(struct state *state, const char *text, yyscan_t * scanner);
 void augl_close_lexer(yyscan_t *scanner);
 int augl_lex_destroy (yyscan_t yyscanner );
 int augl_get_lineno (yyscan_t yyscanner );
@@ -342,7 +343,9 @@ tree_label: DQUOTED
             { $$ = NULL; }
 %%
 
-int augl_parse_file(struct augeas *aug, const char *name,
+/* Parse the module in file NAME. If TEXT is not NULL, it is the contents
+ * of that file, and NAME is only used in error messages */
+int augl_parse_file(struct augeas *aug, const char *name, const char *text,
                     struct term **term) {
   yyscan_t          scanner;
   struct state      state;
@@ -368,7 +371,7 @@ int augl_parse_file(struct augeas *aug, const char *name,
   state.info = &info;
   state.comment_depth = 0;
 
-  if (augl_init_lexer(&state, &scanner) < 0) {
+  if (augl_init_lexer(&state, text, &scanner) < 0) {
     augl_error(&info, term, NULL, "file not found");
     goto error;
   }
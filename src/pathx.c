@@ -30,6 +30,7 @@
 #include "ref.h"
 #include "regexp.h"
 #include "errcode.h"
+#include "hash.h"
 
 static const char *const errcodes[] = {
     "no error",
@@ -152,12 +153,27 @@ static struct tree *step_first(struct step *step, struct tree *ctx);
 static struct tree *step_next(struct step *step, struct tree *ctx,
                               struct tree *node);
 
-struct pathx_symtab {
-    struct pathx_symtab *next;
+/* A variable in a symbol table */
+struct symtab_var {
     char                *name;
     struct value        *value;
 };
 
+/* One entry in the list of variables whose nodeset contains a node */
+struct symtab_ref {
+    struct symtab_ref   *next;
+    struct symtab_var   *var;
+};
+
+/* The symbol table maps variable names to their values. Since every
+ * removal of a subtree has to remove its nodes from the nodesets of all
+ * variables, it also keeps a reverse index from every tree node that is
+ * in the nodeset of some variable to the list of those variables. */
+struct pathx_symtab {
+    hash_t              *vars;  /* name -> struct symtab_var */
+    hash_t              *refs;  /* struct tree * -> struct symtab_ref */
+};
+
 struct pathx {
     struct state   *state;
     struct nodeset *nodeset;
@@ -194,6 +210,15 @@ struct value {
 struct expr {
     enum expr_tag tag;
     enum type     type;
+    /* The value of the expression does not depend on the context node,
+       and is therefore the same for all predicate evaluations during
+       one evaluation of the path expression */
+    bool          ctx_free;
+    /* Context-free regular expressions are only built and compiled once
+       per evaluation of the path expression: CACHE_IND is the value
+       computed during evaluation number CACHE_SERIAL */
+    value_ind_t   cache_ind;
+    unsigned int  cache_serial;
     union {
         struct {                       /* E_FILTER */
             struct expr     *primary;
@@ -204,6 +229,11 @@ struct expr {
             enum binary_op op;
             struct expr *left;
             struct expr *right;
+            /* For '=' and '!=' where one side is a context-free nodeset:
+               the string values of that nodeset, computed during
+               evaluation number EQ_SERIAL of the path expression */
+            hash_t      *eq_values;
+            unsigned int eq_serial;
         };
         value_ind_t      value_ind;    /* E_VALUE */
         char            *ident;        /* E_VAR */
@@ -246,6 +276,9 @@ struct state {
     struct value  *value_pool;
     value_ind_t    value_pool_used;
     value_ind_t    value_pool_size;
+    /* Number of values in the pool that were created while parsing, and
+     * are therefore kept by pathx_reset */
+    value_ind_t    value_pool_parsed;
     /* Stack of values (as indices into value_pool), with bottom of
        stack in values[0] */
     value_ind_t   *values;
@@ -261,6 +294,9 @@ struct state {
     struct locpath_trace *locpath_trace;
     /* Symbol table for variable lookups */
     struct pathx_symtab *symtab;
+    /* Incremented every time the path expression is evaluated, used to
+       invalidate values cached in the expression during an evaluation */
+    unsigned int         eval_serial;
     /* Error structure, used to communicate errors to struct augeas;
      * we never own this structure, and therefore never free it */
     struct error        *error;
@@ -284,6 +320,7 @@ struct func {
     const char      *name;
     unsigned int     arity;
     enum type        type;
+    bool             pure;     /* Result only depends on the arguments */
     const enum type *arg_types;
     func_impl_t      impl;
 };
@@ -304,38 +341,38 @@ static const enum type const arg_types_string_string[] = { T_STRING, T_STRING };
 static const enum type const arg_types_nodeset_string[] = { T_NODESET, T_STRING };
 
 static const struct func builtin_funcs[] = {
-    { .name = "last", .arity = 0, .type = T_NUMBER, .arg_types = NULL,
-      .impl = func_last },
-    { .name = "position", .arity = 0, .type = T_NUMBER, .arg_types = NULL,
-      .impl = func_position },
-    { .name = "label", .arity = 0, .type = T_STRING, .arg_types = NULL,
-      .impl = func_label },
-    { .name = "count", .arity = 1, .type = T_NUMBER,
+    { .name = "last", .arity = 0, .type = T_NUMBER, .pure = false,
+      .arg_types = NULL, .impl = func_last },
+    { .name = "position", .arity = 0, .type = T_NUMBER, .pure = false,
+      .arg_types = NULL, .impl = func_position },
+    { .name = "label", .arity = 0, .type = T_STRING, .pure = false,
+      .arg_types = NULL, .impl = func_label },
+    { .name = "count", .arity = 1, .type = T_NUMBER, .pure = true,
       .arg_types = arg_types_nodeset,
       .impl = func_count },
-    { .name = "regexp", .arity = 1, .type = T_REGEXP,
+    { .name = "regexp", .arity = 1, .type = T_REGEXP, .pure = true,
       .arg_types = arg_types_string,
       .impl = func_regexp },
-    { .name = "regexp", .arity = 1, .type = T_REGEXP,
+    { .name = "regexp", .arity = 1, .type = T_REGEXP, .pure = true,
       .arg_types = arg_types_nodeset,
       .impl = func_regexp },
-    { .name = "regexp", .arity = 2, .type = T_REGEXP,
+    { .name = "regexp", .arity = 2, .type = T_REGEXP, .pure = true,
       .arg_types = arg_types_string_string,
       .impl = func_regexp_flag },
-    { .name = "regexp", .arity = 2, .type = T_REGEXP,
+    { .name = "regexp", .arity = 2, .type = T_REGEXP, .pure = true,
       .arg_types = arg_types_nodeset_string,
       .impl = func_regexp_flag },
-    { .name = "glob", .arity = 1, .type = T_REGEXP,
+    { .name = "glob", .arity = 1, .type = T_REGEXP, .pure = true,
       .arg_types = arg_types_string,
       .impl = func_glob },
-    { .name = "glob", .arity = 1, .type = T_REGEXP,
+    { .name = "glob", .arity = 1, .type = T_REGEXP, .pure = true,
       .arg_types = arg_types_nodeset,
       .impl = func_glob },
-    { .name = "int", .arity = 1, .type = T_NUMBER,
+    { .name = "int", .arity = 1, .type = T_NUMBER, .pure = true,
       .arg_types = arg_types_string, .impl = func_int },
-    { .name = "int", .arity = 1, .type = T_NUMBER,
+    { .name = "int", .arity = 1, .type = T_NUMBER, .pure = true,
       .arg_types = arg_types_nodeset, .impl = func_int },
-    { .name = "int", .arity = 1, .type = T_NUMBER,
+    { .name = "int", .arity = 1, .type = T_NUMBER, .pure = true,
       .arg_types = arg_types_bool, .impl = func_int }
 };
 
@@ -370,6 +407,13 @@ static const struct func builtin_funcs[] = {
 
 static void free_expr(struct expr *expr);
 
+static void free_value_set(hash_t *set) {
+    if (set == NULL)
+        return;
+    hash_free_nodes(set);
+    hash_destroy(set);
+}
+
 static void free_pred(struct pred *pred) {
     if (pred == NULL)
         return;
@@ -416,6 +460,7 @@ static void free_expr(struct expr *expr) {
     case E_BINARY:
         free_expr(expr->left);
         free_expr(expr->right);
+        free_value_set(expr->eq_values);
         break;
     case E_VALUE:
         break;
@@ -842,8 +887,70 @@ static bool coerce_to_bool(struct value *v) {
     }
 }
 
+/* Return a hash set of the values of the nodes in NS. Nodes without a
+ * value contribute the empty string, consistent with streqx. The keys
+ * point into the tree, and the set must not be used once the tree has
+ * been modified.
+ */
+static hash_t *make_value_set(struct nodeset *ns, struct state *state) {
+    hash_t *set = hash_create(HASHCOUNT_T_MAX, NULL, NULL);
+    if (set == NULL) {
+        STATE_ENOMEM;
+        return NULL;
+    }
+    for (int i=0; i < ns->used; i++) {
+        const char *v = ns->nodes[i]->value;
+        if (v == NULL)
+            v = "";
+        if (hash_lookup(set, v) != NULL)
+            continue;
+        if (hash_alloc_insert(set, v, NULL) < 0) {
+            free_value_set(set);
+            STATE_ENOMEM;
+            return NULL;
+        }
+    }
+    return set;
+}
+
+static int calc_eq_set_string(hash_t *set, const char *s, int neq) {
+    if (s == NULL)
+        s = "";
+    if (neq)
+        return hash_count(set) > 1
+            || (hash_count(set) == 1 && hash_lookup(set, s) == NULL);
+    else
+        return hash_lookup(set, s) != NULL;
+}
+
+static int calc_eq_set_nodeset(hash_t *set, struct nodeset *ns, int neq) {
+    for (int i=0; i < ns->used; i++) {
+        if (calc_eq_set_string(set, ns->nodes[i]->value, neq))
+            return 1;
+    }
+    return 0;
+}
+
 static int calc_eq_nodeset_nodeset(struct nodeset *ns1, struct nodeset *ns2,
-                                   int neq) {
+                                   int neq, struct state *state) {
+    /* Comparing every node in NS1 with every node in NS2 is quadratic;
+     * unless one of them is trivially small, go through a hash set of
+     * the values of the smaller one */
+    if (ns1->used > 1 && ns2->used > 1) {
+        struct nodeset *small = ns1, *large = ns2;
+        int res;
+
+        if (ns1->used > ns2->used) {
+            small = ns2;
+            large = ns1;
+        }
+        hash_t *set = make_value_set(small, state);
+        RET0_ON_ERROR;
+        res = calc_eq_set_nodeset(set, large, neq);
+        free_value_set(set);
+        return res;
+    }
+
     for (int i1=0; i1 < ns1->used; i1++) {
         struct tree *t1 = ns1->nodes[i1];
         for (int i2=0; i2 < ns2->used; i2++) {
@@ -881,7 +988,7 @@ static void eval_eq(struct state *state, int neq) {
     int res;
 
     if (l->tag == T_NODESET && r->tag == T_NODESET) {
-        res = calc_eq_nodeset_nodeset(l->nodeset, r->nodeset, neq);
+        res = calc_eq_nodeset_nodeset(l->nodeset, r->nodeset, neq, state);
     } else if (l->tag == T_NODESET) {
         res = calc_eq_nodeset_string(l->nodeset, r->string, neq);
     } else if (r->tag == T_NODESET) {
@@ -903,6 +1010,48 @@ static void eval_eq(struct state *state, int neq) {
     push_boolean_value(res, state);
 }
 
+/* Evaluate '=' or '!=' when one side is a nodeset that does not depend on
+ * the context node, like an absolute path or a variable. That side is only
+ * evaluated, and its values hashed, the first time the comparison is
+ * evaluated during an evaluation of the path expression; after that, each
+ * evaluation of the comparison only needs to look up the values of the
+ * other side in the hash set.
+ */
+static void eval_eq_cached(struct expr *expr, struct state *state, int neq) {
+    struct expr *fixed = expr->right;
+    struct expr *other = expr->left;
+    struct value *v;
+    int res;
+
+    if (! (fixed->ctx_free && fixed->type == T_NODESET)) {
+        fixed = expr->left;
+        other = expr->right;
+    }
+
+    if (expr->eq_values == NULL || expr->eq_serial != state->eval_serial) {
+        free_value_set(expr->eq_values);
+        expr->eq_values = NULL;
+
+        eval_expr(fixed, state);
+        RET_ON_ERROR;
+        v = pop_value(state);
+        expr->eq_values = make_value_set(v->nodeset, state);
+        RET_ON_ERROR;
+        expr->eq_serial = state->eval_serial;
+    }
+
+    eval_expr(other, state);
+    RET_ON_ERROR;
+    v = pop_value(state);
+    if (v->tag == T_NODESET) {
+        res = calc_eq_set_nodeset(expr->eq_values, v->nodeset, neq);
+    } else {
+        assert(v->tag == T_STRING);
+        res = calc_eq_set_string(expr->eq_values, v->string, neq);
+    }
+    push_boolean_value(res, state);
+}
+
 static void eval_arith(struct state *state, enum binary_op op) {
     value_ind_t vind = make_value(T_NUMBER, state);
     struct value *r = pop_value(state);
@@ -1066,7 +1215,22 @@ static void eval_re_match(struct state *state, enum binary_op op) {
     push_boolean_value(result, state);
 }
 
+/* Whether the comparison EXPR should be evaluated with eval_eq_cached */
+static bool eq_is_cached(struct expr *expr) {
+    if (expr->op != OP_EQ && expr->op != OP_NEQ)
+        return false;
+    if (expr->left->type == T_NUMBER)
+        return false;
+    return (expr->left->ctx_free && expr->left->type == T_NODESET)
+        || (expr->right->ctx_free && expr->right->type == T_NODESET);
+}
+
 static void eval_binary(struct expr *expr, struct state *state) {
+    if (eq_is_cached(expr)) {
+        eval_eq_cached(expr, state, expr->op == OP_NEQ);
+        return;
+    }
+
     eval_expr(expr->left, state);
     eval_expr(expr->right, state);
     RET_ON_ERROR;
@@ -1295,11 +1459,14 @@ static void eval_filter(struct expr *expr, struct state *state) {
 }
 
 static struct value *lookup_var(const char *ident, struct state *state) {
-    list_for_each(tab, state->symtab) {
-        if (STREQ(ident, tab->name))
-            return tab->value;
-    }
-    return NULL;
+    hnode_t *node;
+
+    if (state->symtab == NULL)
+        return NULL;
+    node = hash_lookup(state->symtab->vars, ident);
+    if (node == NULL)
+        return NULL;
+    return ((struct symtab_var *) hnode_get(node))->value;
 }
 
 static void eval_var(struct expr *expr, struct state *state) {
@@ -1309,8 +1476,22 @@ static void eval_var(struct expr *expr, struct state *state) {
     push_value(vind, state);
 }
 
+/* Whether the value of EXPR is cached in EXPR->CACHE_IND. We only do that
+ * for regexps, which are expensive to construct and compile, and whose
+ * values are never modified during evaluation, so that the same value can
+ * be pushed onto the stack more than once.
+ */
+static bool expr_is_cached(struct expr *expr) {
+    return expr->ctx_free && expr->type == T_REGEXP
+        && (expr->tag == E_APP || expr->tag == E_BINARY);
+}
+
 static void eval_expr(struct expr *expr, struct state *state) {
     RET_ON_ERROR;
+    if (expr_is_cached(expr) && expr->cache_serial == state->eval_serial) {
+        push_value(expr->cache_ind, state);
+        return;
+    }
     switch (expr->tag) {
     case E_FILTER:
         eval_filter(expr, state);
@@ -1330,6 +1511,10 @@ static void eval_expr(struct expr *expr, struct state *state) {
     default:
         assert(0);
     }
+    if (expr_is_cached(expr) && !HAS_ERROR(state)) {
+        expr->cache_ind = state->values[state->values_used - 1];
+        expr->cache_serial = state->eval_serial;
+    }
 }
 
 /*************************************************************************
@@ -1378,6 +1563,13 @@ static void check_filter(struct expr *expr, struct state *state) {
         RET_ON_ERROR;
     }
     expr->type = T_NODESET;
+    /* Predicates are evaluated in their own context; only the start of
+       the location path matters */
+    if (expr->primary != NULL)
+        expr->ctx_free = expr->primary->ctx_free;
+    else
+        expr->ctx_free =
+            (locpath->steps != NULL && locpath->steps->axis == ROOT);
 }
 
 static void check_app(struct expr *expr, struct state *state) {
@@ -1410,6 +1602,9 @@ static void check_app(struct expr *expr, struct state *state) {
     if (f < ARRAY_CARDINALITY(builtin_funcs)) {
         expr->func = builtin_funcs + f;
         expr->type = expr->func->type;
+        expr->ctx_free = expr->func->pure;
+        for (int i=0; i < expr->func->arity; i++)
+            expr->ctx_free = expr->ctx_free && expr->args[i]->ctx_free;
     } else {
         STATE_ERROR(state, PATHX_ETYPE);
     }
@@ -1494,6 +1689,7 @@ static void check_binary(struct expr *expr, struct state *state) {
         STATE_ERROR(state, PATHX_ETYPE);
     } else {
         expr->type = res;
+        expr->ctx_free = expr->left->ctx_free && expr->right->ctx_free;
     }
 }
 
@@ -1504,6 +1700,7 @@ static void check_var(struct expr *expr, struct state *state) {
         return;
     }
     expr->type = v->tag;
+    expr->ctx_free = true;
 }
 
 /* Typecheck an expression */
@@ -1518,6 +1715,7 @@ static void check_expr(struct expr *expr, struct state *state) {
         break;
     case E_VALUE:
         expr->type = expr_value(expr, state)->tag;
+        expr->ctx_free = true;
         break;
     case E_VAR:
         check_var(expr, state);
@@ -2451,6 +2649,7 @@ int pathx_parse(const struct tree *tree,
         STATE_ERROR(state, PATHX_ETYPE);
         goto done;
     }
+    state->value_pool_parsed = state->value_pool_used;
 
  done:
     store_error(*pathx);
@@ -2601,6 +2800,7 @@ static struct value *pathx_eval(struct pathx *pathx) {
     state->ctx = pathx->origin;
     state->ctx_pos = 1;
     state->ctx_len = 1;
+    state->eval_serial += 1;
     eval_expr(state->exprs[0], state);
     if (HAS_ERROR(state))
         return NULL;
@@ -2612,6 +2812,19 @@ static struct value *pathx_eval(struct pathx *pathx) {
     return pop_value(state);
 }
 
+void pathx_reset(struct pathx *pathx) {
+    struct state *state = pathx->state;
+
+    for (value_ind_t i = state->value_pool_parsed;
+         i < state->value_pool_used; i++)
+        release_value(state->value_pool + i);
+    state->value_pool_used = state->value_pool_parsed;
+    state->values_used = 0;
+    state->errcode = PATHX_NOERROR;
+    pathx->nodeset = NULL;
+    pathx->node = 0;
+}
+
 struct tree *pathx_next(struct pathx *pathx) {
     if (pathx->node + 1 < pathx->nodeset->used)
         return pathx->nodeset->nodes[++pathx->node];
@@ -2780,42 +2993,126 @@ const char *pathx_error(struct pathx *path, const char **txt, int *pos) {
 /*
  * Symbol tables
  */
-static struct pathx_symtab
-*make_symtab(struct pathx_symtab *symtab, const char *name,
-             struct value *value)
-{
-    struct pathx_symtab *new;
-    char *n = NULL;
+static hash_val_t ptr_hash(const void *p) {
+    uintptr_t h = (uintptr_t) p;
+    /* Tree nodes are at least 8-byte aligned; mix the bits above that */
+    h ^= h >> 17;
+    h *= 0x9e3779b1U;
+    return (hash_val_t) (h ^ (h >> 13));
+}
 
-    n = strdup(name);
-    if (n == NULL)
-        return NULL;
+static int ptr_cmp(const void *p1, const void *p2) {
+    return p1 != p2;
+}
+
+static struct pathx_symtab *make_symtab(void) {
+    struct pathx_symtab *symtab;
 
-    if (ALLOC(new) < 0) {
-        free(n);
+    if (ALLOC(symtab) < 0)
+        return NULL;
+    symtab->vars = hash_create(HASHCOUNT_T_MAX, NULL, NULL);
+    symtab->refs = hash_create(HASHCOUNT_T_MAX, ptr_cmp, ptr_hash);
+    if (symtab->vars == NULL || symtab->refs == NULL) {
+        free_symtab(symtab);
         return NULL;
-    }
-    new->name = n;
-    new->value = value;
-    if (symtab == NULL) {
-        return new;
-    } else {
-        new->next = symtab->next;
-        symtab->next = new;
     }
     return symtab;
 }
 
-void free_symtab(struct pathx_symtab *symtab) {
+static void free_symtab_var(struct symtab_var *var) {
+    if (var == NULL)
+        return;
+    free(var->name);
+    release_value(var->value);
+    free(var->value);
+    free(var);
+}
 
-    while (symtab != NULL) {
-        struct pathx_symtab *del = symtab;
-        symtab = del->next;
-        free(del->name);
-        release_value(del->value);
-        free(del->value);
+/* Record that the nodes in the nodeset of VAR are referenced by VAR */
+static int symtab_index_var(struct pathx_symtab *symtab,
+                            struct symtab_var *var) {
+    struct nodeset *ns;
+
+    if (var->value->tag != T_NODESET)
+        return 0;
+
+    ns = var->value->nodeset;
+    for (int i=0; i < ns->used; i++) {
+        struct symtab_ref *ref;
+        hnode_t *node = hash_lookup(symtab->refs, ns->nodes[i]);
+
+        if (ALLOC(ref) < 0)
+            return -1;
+        ref->var = var;
+        if (node == NULL) {
+            if (hash_alloc_insert(symtab->refs, ns->nodes[i], ref) < 0) {
+                free(ref);
+                return -1;
+            }
+        } else {
+            ref->next = hnode_get(node);
+            hnode_put(node, ref);
+        }
+    }
+    return 0;
+}
+
+/* Undo SYMTAB_INDEX_VAR */
+static void symtab_unindex_var(struct pathx_symtab *symtab,
+                               struct symtab_var *var) {
+    struct nodeset *ns;
+
+    if (var->value->tag != T_NODESET)
+        return;
+
+    ns = var->value->nodeset;
+    for (int i=0; i < ns->used; i++) {
+        hnode_t *node = hash_lookup(symtab->refs, ns->nodes[i]);
+        if (node == NULL)
+            continue;
+        struct symtab_ref *refs = hnode_get(node);
+        struct symtab_ref *del = NULL;
+        list_for_each(r, refs) {
+            if (r->var == var) {
+                del = r;
+                break;
+            }
+        }
+        if (del == NULL)
+            continue;
+        list_remove(del, refs);
         free(del);
+        if (refs == NULL)
+            hash_delete_free(symtab->refs, node);
+        else
+            hnode_put(node, refs);
+    }
+}
+
+void free_symtab(struct pathx_symtab *symtab) {
+    hscan_t scan;
+    hnode_t *node;
+
+    if (symtab == NULL)
+        return;
+
+    if (symtab->vars != NULL) {
+        hash_scan_begin(&scan, symtab->vars);
+        while ((node = hash_scan_next(&scan)) != NULL)
+            free_symtab_var(hnode_get(node));
+        hash_free_nodes(symtab->vars);
+        hash_destroy(symtab->vars);
+    }
+    if (symtab->refs != NULL) {
+        hash_scan_begin(&scan, symtab->refs);
+        while ((node = hash_scan_next(&scan)) != NULL) {
+            struct symtab_ref *refs = hnode_get(node);
+            list_free(refs);
+        }
+        hash_free_nodes(symtab->refs);
+        hash_destroy(symtab->refs);
     }
+    free(symtab);
 }
 
 struct pathx_symtab *pathx_get_symtab(struct pathx *pathx) {
@@ -2824,28 +3121,45 @@ struct pathx_symtab *pathx_get_symtab(struct pathx *pathx) {
 
 static int pathx_symtab_set(struct pathx_symtab **symtab,
                             const char *name, struct value *v) {
-    int found = 0;
+    struct symtab_var *var = NULL;
+    hnode_t *node;
 
-    list_for_each(tab, *symtab) {
-        if (STREQ(tab->name, name)) {
-            release_value(tab->value);
-            free(tab->value);
-            tab->value = v;
-            found = 1;
-            break;
-        }
+    if (*symtab == NULL) {
+        *symtab = make_symtab();
+        if (*symtab == NULL)
+            goto error;
     }
 
-    if (!found) {
-        struct pathx_symtab *new = NULL;
-
-        new = make_symtab(*symtab, name, v);
-        if (new == NULL)
+    node = hash_lookup((*symtab)->vars, name);
+    if (node != NULL) {
+        var = hnode_get(node);
+        symtab_unindex_var(*symtab, var);
+        release_value(var->value);
+        free(var->value);
+        var->value = v;
+    } else {
+        if (ALLOC(var) < 0)
             goto error;
-        *symtab = new;
+        var->name = strdup(name);
+        if (var->name == NULL)
+            goto error;
+        if (hash_alloc_insert((*symtab)->vars, var->name, var) < 0)
+            goto error;
+        var->value = v;
+    }
+    if (symtab_index_var(*symtab, var) < 0) {
+        /* Don't leave a partial index behind, and drop the variable
+         * since the caller frees V when we fail */
+        symtab_unindex_var(*symtab, var);
+        hash_delete_free((*symtab)->vars,
+                         hash_lookup((*symtab)->vars, var->name));
+        goto error;
     }
     return 0;
  error:
+    if (var != NULL)
+        free(var->name);
+    free(var);
     return -1;
 }
 
@@ -2887,15 +3201,18 @@ int pathx_symtab_define(struct pathx_symtab **symtab,
 }
 
 int pathx_symtab_undefine(struct pathx_symtab **symtab, const char *name) {
-    struct pathx_symtab *del = NULL;
+    struct symtab_var *var;
+    hnode_t *node;
 
-    for(del = *symtab;
-        del != NULL && !STREQ(del->name, name);
-        del = del->next);
-    if (del == NULL)
+    if (*symtab == NULL)
         return 0;
-    list_remove(del, *symtab);
-    free_symtab(del);
+    node = hash_lookup((*symtab)->vars, name);
+    if (node == NULL)
+        return 0;
+    var = hnode_get(node);
+    hash_delete_free((*symtab)->vars, node);
+    symtab_unindex_var(*symtab, var);
+    free_symtab_var(var);
     return 0;
 }
 
@@ -2926,20 +3243,44 @@ int pathx_symtab_assign_tree(struct pathx_symtab **symtab,
     return -1;
 }
 
+/* Remove TREE from the nodesets of all variables referencing it */
+static void symtab_remove_node(struct pathx_symtab *symtab,
+                               const struct tree *tree) {
+    hnode_t *node = hash_lookup(symtab->refs, tree);
+
+    if (node == NULL)
+        return;
+
+    struct symtab_ref *refs = hnode_get(node);
+    list_for_each(r, refs) {
+        struct nodeset *ns = r->var->value->nodeset;
+        for (int i=0; i < ns->used; i++) {
+            if (ns->nodes[i] == tree) {
+                ns_remove(ns, i);
+                break;
+            }
+        }
+    }
+    list_free(refs);
+    hash_delete_free(symtab->refs, node);
+}
+
 void pathx_symtab_remove_descendants(struct pathx_symtab *symtab,
                                      const struct tree *tree) {
-    list_for_each(tab, symtab) {
-        if (tab->value->tag != T_NODESET)
-            continue;
-        struct nodeset *ns = tab->value->nodeset;
-        for (int i=0; i < ns->used;) {
-            struct tree *t = ns->nodes[i];
-            while (t != t->parent && t != tree)
+    const struct tree *t = tree;
+
+    /* Walk the subtree rooted at TREE, and look each node up in the
+     * reverse index; stop early once no variable references any node */
+    while (symtab != NULL && !hash_isempty(symtab->refs)) {
+        symtab_remove_node(symtab, t);
+        if (t->children != NULL) {
+            t = t->children;
+        } else {
+            while (t != tree && t->next == NULL)
                 t = t->parent;
             if (t == tree)
-                ns_remove(ns, i);
-            else
-                i += 1;
+                break;
+            t = t->next;
         }
     }
 }
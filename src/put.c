@@ -22,6 +22,7 @@
 
 #include <config.h>
 
+#include <errno.h>
 #include <stdarg.h>
 #include "regexp.h"
 #include "memory.h"
@@ -38,24 +39,79 @@
  * part of the split anymore (NULL if we are talking about all the siblings
  * of TREE)
  *
- * ENC is a string containing the encoding of the current position in the
- * tree.  The encoding is
- *   <label>=<value>/<label>=<value>/.../<label>=<value>/
- * where the label/value pairs come from TREE and its
- * siblings. The encoding uses ENC_EQ instead of the '=' above to avoid
- * clashes with legitimate values, and encodes NULL values as ENC_NULL.
+ * LEVEL is the list of all siblings, and START and END are the indices of
+ * TREE and FOLLOW in it.
  */
 struct split {
     struct split *next;
     struct tree  *tree;
     struct tree  *follow;
-    char         *enc;
+    struct level *level;
     size_t        start;
     size_t        end;
 };
 
+/* The siblings a split is taken from. ENC is their encoding
+ *   <label>=<value>/<label>=<value>/.../<label>=<value>/
+ * where the label/value pairs come from TREES. The encoding uses ENC_EQ
+ * instead of the '=' above to avoid clashes with legitimate values, and
+ * encodes NULL values as ENC_NULL. Each label/value pair is a token; the
+ * one for TREES[i] starts at OFFS[i] in ENC, and TOKENS[i] remembers how
+ * it fared against the atypes of L_SUBTREE lenses.
+ */
+struct level {
+    size_t         ntrees;
+    struct tree  **trees;     /* NULL terminated */
+    char          *enc;
+    size_t        *offs;
+    struct token  *tokens;
+};
+
+struct token {
+    unsigned int       ntests;
+    unsigned int       size;
+    struct token_test *tests;
+};
+
+struct token_test {
+    struct lens *lens;
+    bool         match;
+};
+
+/* A position automaton for the atype of a lens. Its alphabet are the
+ * L_SUBTREE lenses reachable from the lens without passing through another
+ * L_SUBTREE; everything else consumes no tokens. Position 0 is the start
+ * state, and any other position P stands for the L_SUBTREE lens ATOMS[P]
+ * and matches a token if the atype of ATOMS[P] matches the token's
+ * encoding. Sets of positions are bitsets of NWORDS words. For an
+ * L_CONCAT, OWNER[P] is the index of the child P belongs to.
+ *
+ * A recursive lens that can reach itself without passing through an
+ * L_SUBTREE does not describe a regular language of tokens; for it, and
+ * everything that contains it on the same level, FALLBACK is set and we
+ * match the atype regexp against the encoding of the level instead.
+ */
+struct tokfa {
+    bool          fallback;
+    unsigned int  npos;
+    unsigned int  nwords;
+    struct lens **atoms;
+    unsigned int *owner;
+    uint64_t     *last;
+    uint64_t     *follow;    /* NPOS sets, the first one is FIRST */
+};
+
+/* The text produced by lns_put. It is collected in one buffer that grows
+ * as needed, rather than going through stdio for every token */
+struct put_out {
+    char             *buf;
+    size_t            used;
+    size_t            size;
+    bool              nomem;  /* Growing BUF failed */
+};
+
 struct state {
-    FILE             *out;
+    struct put_out   *out;
     struct split     *split;
     const char       *key;
     const char       *value;
@@ -65,6 +121,10 @@ struct state {
     char             *path;   /* Position in the tree, for errors */
     size_t            pos;
     struct lns_error *error;
+    /* The text the skel was parsed from, if parts of it can be copied to
+     * the output verbatim, see PUT_UNCHANGED */
+    const char       *text;
+    size_t            text_len;
 };
 
 static void create_lens(struct lens *lens, struct state *state);
@@ -109,15 +169,33 @@ static char *encpcpy(char *e, const char *key, const char *value) {
     return e;
 }
 
+/* Return the index of the token that starts at offset OFF in the encoding
+ * of LEVEL */
+static size_t level_index(struct level *level, size_t off) {
+    size_t lo = 0, hi = level->ntrees;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (level->offs[mid] < off)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    assert(level->offs[lo] == off);
+    return lo;
+}
+
 static void regexp_match_error(struct state *state, struct lens *lens,
                                int count, struct split *split) {
     // FIXME: Split the regexp and encoding back
     // into something resembling a tree level
     char *text = NULL;
     char *pat = NULL;
+    struct level *level = split->level;
 
     lns_format_atype(lens, &pat);
-    text = enc_format(split->enc + split->start, split->end - split->start);
+    text = enc_format(level->enc + level->offs[split->start],
+                      level->offs[split->end] - level->offs[split->start]);
 
     if (count == -1) {
         put_error(state, lens,
@@ -135,11 +213,330 @@ static void regexp_match_error(struct state *state, struct lens *lens,
     free(text);
 }
 
+/*
+ * Tokens
+ */
+/* Return true if the atype of the L_SUBTREE lens ATOM matches the token
+ * for LEVEL->TREES[I] */
+static bool token_matches(struct state *state, struct lens *atom,
+                          struct level *level, size_t i) {
+    struct token *tok = level->tokens + i;
+    size_t start = level->offs[i], end = level->offs[i + 1];
+    int count;
+    bool match;
+
+    for (int j=0; j < tok->ntests; j++)
+        if (tok->tests[j].lens == atom)
+            return tok->tests[j].match;
+
+    count = regexp_match(atom->atype, level->enc, end, start, NULL);
+    if (count < -1) {
+        regexp_match_error(state, atom, count, state->split);
+        return false;
+    }
+    match = (count == end - start);
+
+    if (tok->ntests == tok->size) {
+        unsigned int size = tok->size == 0 ? 4 : 2 * tok->size;
+        if (REALLOC_N(tok->tests, size) < 0)
+            return match;
+        tok->size = size;
+    }
+    tok->tests[tok->ntests].lens = atom;
+    tok->tests[tok->ntests].match = match;
+    tok->ntests += 1;
+    return match;
+}
+
+/*
+ * Token automata
+ */
+static bool bit_test(const uint64_t *set, unsigned int p) {
+    return (set[p / 64] >> (p % 64)) & 1;
+}
+
+static void bit_set(uint64_t *set, unsigned int p) {
+    set[p / 64] |= (uint64_t) 1 << (p % 64);
+}
+
+static void bit_clear(uint64_t *set, unsigned int p) {
+    set[p / 64] &= ~((uint64_t) 1 << (p % 64));
+}
+
+/* Return the first position >= P in SET, or -1 if there is none */
+static int bits_next(const uint64_t *set, unsigned int nwords,
+                     unsigned int p) {
+    unsigned int w = p / 64;
+    uint64_t bits;
+
+    if (w >= nwords)
+        return -1;
+    bits = set[w] & (~(uint64_t) 0 << (p % 64));
+    while (bits == 0) {
+        if (++w == nwords)
+            return -1;
+        bits = set[w];
+    }
+    return w * 64 + __builtin_ctzll(bits);
+}
+
+#define for_each_bit(p, set, nwords)                                    \
+    for (int p = bits_next(set, nwords, 0); p >= 0;                     \
+         p = bits_next(set, nwords, p + 1))
+
+static void bits_or(uint64_t *dst, const uint64_t *src,
+                    unsigned int nwords) {
+    for (int i=0; i < nwords; i++)
+        dst[i] |= src[i];
+}
+
+static bool bits_meet(const uint64_t *s1, const uint64_t *s2,
+                      unsigned int nwords) {
+    for (int i=0; i < nwords; i++)
+        if (s1[i] & s2[i])
+            return true;
+    return false;
+}
+
+/* Recursive lenses we are in the body of while building a token automaton */
+struct rec_frame {
+    struct lens      *body;
+    struct rec_frame *up;
+};
+
+/* Return the number of positions in the token automaton for LENS, or -1
+ * if LENS reaches a recursive lens from its own body without passing
+ * through an L_SUBTREE */
+static int tokfa_count(struct lens *lens, struct rec_frame *frame) {
+    int n = 0, r;
+
+    switch (lens->tag) {
+    case L_SUBTREE:
+        return 1;
+    case L_CONCAT:
+    case L_UNION:
+        for (int i=0; i < lens->nchildren; i++) {
+            r = tokfa_count(lens->children[i], frame);
+            if (r < 0)
+                return -1;
+            n += r;
+        }
+        return n;
+    case L_STAR:
+    case L_MAYBE:
+    case L_SQUARE:
+        return tokfa_count(lens->child, frame);
+    case L_REC:
+        for (struct rec_frame *f = frame; f != NULL; f = f->up)
+            if (f->body == lens->body)
+                return -1;
+        struct rec_frame rec = { .body = lens->body, .up = frame };
+        return tokfa_count(lens->body, &rec);
+    default:
+        return 0;
+    }
+}
+
+/* Add the positions for LENS to FA, and store the positions with which
+ * LENS can start and end in FIRST and LAST, which must be empty. Return
+ * whether LENS matches the empty sequence of tokens. TOP is the lens FA is
+ * built for. */
+static bool tokfa_build(struct tokfa *fa, struct lens *lens,
+                        struct lens *top, uint64_t *first, uint64_t *last) {
+    unsigned int nw = fa->nwords;
+    uint64_t *f = NULL, *l = NULL;
+    bool nullable = false;
+
+    switch (lens->tag) {
+    case L_SUBTREE:
+        fa->atoms[fa->npos] = lens;
+        bit_set(first, fa->npos);
+        bit_set(last, fa->npos);
+        fa->npos += 1;
+        return false;
+    case L_CONCAT:
+        if (ALLOC_N(f, 2 * nw) < 0) {
+            fa->fallback = true;
+            return false;
+        }
+        l = f + nw;
+        nullable = true;
+        for (int i=0; i < lens->nchildren; i++) {
+            unsigned int start = fa->npos;
+            bool n;
+
+            MEMZERO(f, 2 * nw);
+            n = tokfa_build(fa, lens->children[i], top, f, l);
+            for_each_bit(p, last, nw)
+                bits_or(fa->follow + p * nw, f, nw);
+            if (nullable)
+                bits_or(first, f, nw);
+            if (! n)
+                MEMZERO(last, nw);
+            bits_or(last, l, nw);
+            nullable = nullable && n;
+            if (lens == top)
+                for (unsigned int p = start; p < fa->npos; p++)
+                    fa->owner[p] = i;
+        }
+        free(f);
+        return nullable;
+    case L_UNION:
+        if (ALLOC_N(f, 2 * nw) < 0) {
+            fa->fallback = true;
+            return false;
+        }
+        l = f + nw;
+        for (int i=0; i < lens->nchildren; i++) {
+            MEMZERO(f, 2 * nw);
+            if (tokfa_build(fa, lens->children[i], top, f, l))
+                nullable = true;
+            bits_or(first, f, nw);
+            bits_or(last, l, nw);
+        }
+        free(f);
+        return nullable;
+    case L_STAR:
+        tokfa_build(fa, lens->child, top, first, last);
+        for_each_bit(p, last, nw)
+            bits_or(fa->follow + p * nw, first, nw);
+        return true;
+    case L_MAYBE:
+        tokfa_build(fa, lens->child, top, first, last);
+        return true;
+    case L_SQUARE:
+        return tokfa_build(fa, lens->child, top, first, last);
+    case L_REC:
+        return tokfa_build(fa, lens->body, top, first, last);
+    default:
+        return true;
+    }
+}
+
+void free_tokfa(struct tokfa *fa) {
+    if (fa == NULL)
+        return;
+    free(fa->atoms);
+    free(fa->owner);
+    free(fa->last);
+    free(fa->follow);
+    free(fa);
+}
+
+static struct tokfa *make_tokfa(struct lens *lens) {
+    struct tokfa *fa = NULL;
+    int npos;
+
+    if (ALLOC(fa) < 0)
+        return NULL;
+
+    npos = tokfa_count(lens, NULL);
+    if (npos < 0) {
+        fa->fallback = true;
+        return fa;
+    }
+    npos += 1;
+    fa->nwords = (npos + 63) / 64;
+    if (ALLOC_N(fa->atoms, npos) < 0
+        || ALLOC_N(fa->owner, npos) < 0
+        || ALLOC_N(fa->last, fa->nwords) < 0
+        || ALLOC_N(fa->follow, npos * fa->nwords) < 0)
+        goto error;
+
+    fa->npos = 1;
+    if (tokfa_build(fa, lens, lens, fa->follow, fa->last))
+        bit_set(fa->last, 0);
+    if (fa->fallback)
+        goto error;
+    assert(fa->npos == npos);
+    return fa;
+ error:
+    free_tokfa(fa);
+    return NULL;
+}
+
+/* Return the token automaton for LENS, or NULL if we have to match its
+ * atype regexp */
+static struct tokfa *lens_tokfa(struct lens *lens) {
+    if (lens->tokfa == NULL)
+        lens->tokfa = make_tokfa(lens);
+    if (lens->tokfa == NULL || lens->tokfa->fallback)
+        return NULL;
+    return lens->tokfa;
+}
+
+/* Move from the positions CUR over the token for LEVEL->TREES[I] to the
+ * positions NEXT. Return false if NEXT is empty */
+static bool tokfa_step(struct state *state, struct tokfa *fa,
+                       const uint64_t *cur, struct level *level, size_t i,
+                       uint64_t *next) {
+    unsigned int nw = fa->nwords;
+    bool found = false;
+
+    MEMZERO(next, nw);
+    for_each_bit(p, cur, nw)
+        bits_or(next, fa->follow + p * nw, nw);
+    for_each_bit(q, next, nw) {
+        if (token_matches(state, fa->atoms[q], level, i))
+            found = true;
+        else
+            bit_clear(next, q);
+    }
+    return found;
+}
+
+/* Return the length of the longest sequence of tokens in LEVEL starting
+ * at START and ending at or before END that FA matches, or -1 if it
+ * matches none */
+static int tokfa_match(struct state *state, struct tokfa *fa,
+                       struct level *level, size_t start, size_t end) {
+    unsigned int nw = fa->nwords;
+    uint64_t buf[8], *mem = NULL;
+    uint64_t *cur = buf, *next;
+    int result = -1;
+
+    if (2 * nw > ARRAY_CARDINALITY(buf)) {
+        if (ALLOC_N(mem, 2 * nw) < 0)
+            return -2;
+        cur = mem;
+    }
+    next = cur + nw;
+
+    MEMZERO(cur, nw);
+    bit_set(cur, 0);
+    if (bits_meet(cur, fa->last, nw))
+        result = 0;
+    for (size_t k = start; k < end; k++) {
+        uint64_t *t;
+        if (! tokfa_step(state, fa, cur, level, k, next))
+            break;
+        t = cur; cur = next; next = t;
+        if (bits_meet(cur, fa->last, nw))
+            result = k + 1 - start;
+    }
+    free(mem);
+    return result;
+}
+
+/*
+ * Splits
+ */
 static void free_split(struct split *split) {
     if (split == NULL)
         return;
 
-    free(split->enc);
+    struct level *level = split->level;
+    if (level != NULL) {
+        if (level->tokens != NULL) {
+            for (int i=0; i < level->ntrees; i++)
+                free(level->tokens[i].tests);
+        }
+        free(level->trees);
+        free(level->tokens);
+        free(level->enc);
+        free(level->offs);
+        free(level);
+    }
     free(split);
 }
 
@@ -147,19 +544,39 @@ static void free_split(struct split *split) {
  */
 static struct split *make_split(struct tree *tree) {
     struct split *split;
+    struct level *level;
 
     if (ALLOC(split) < 0)
         return NULL;
+    if (ALLOC(split->level) < 0)
+        goto error;
+    level = split->level;
 
     split->tree = tree;
     list_for_each(t, tree) {
-        split->end += enclen(t->label, t->value);
+        level->ntrees += 1;
     }
+    split->end = level->ntrees;
 
-    if (ALLOC_N(split->enc, split->end + 1) < 0)
+    if (ALLOC_N(level->trees, level->ntrees + 1) < 0
+        || ALLOC_N(level->offs, level->ntrees + 1) < 0
+        || ALLOC_N(level->tokens, level->ntrees) < 0)
         goto error;
 
-    char *enc = split->enc;
+    size_t len = 0;
+    int i = 0;
+    list_for_each(t, tree) {
+        level->trees[i] = t;
+        level->offs[i] = len;
+        len += enclen(t->label, t->value);
+        i += 1;
+    }
+    level->offs[i] = len;
+
+    if (ALLOC_N(level->enc, len + 1) < 0)
+        goto error;
+
+    char *enc = level->enc;
     list_for_each(t, tree) {
         enc = encpcpy(enc, t->label, t->value);
     }
@@ -170,13 +587,13 @@ static struct split *make_split(struct tree *tree) {
 }
 
 static struct split *split_append(struct split **split, struct split *tail,
-                                  struct tree *tree, struct tree *follow,
-                                  char *enc, size_t start, size_t end) {
+                                  struct level *level,
+                                  size_t start, size_t end) {
     struct split *sp;
     CALLOC(sp, 1);
-    sp->tree = tree;
-    sp->follow = follow;
-    sp->enc = enc;
+    sp->tree = level->trees[start];
+    sp->follow = level->trees[end];
+    sp->level = level;
     sp->start = start;
     sp->end = end;
     list_tail_cons(*split, tail, sp);
@@ -199,50 +616,35 @@ static struct split *set_split(struct state *state, struct split *split) {
     return split;
 }
 
-/* Refine a tree split OUTER according to the L_CONCAT lens LENS */
-static struct split *split_concat(struct state *state, struct lens *lens) {
-    assert(lens->tag == L_CONCAT);
-
+/* Refine a tree split OUTER according to the L_CONCAT lens LENS by
+ * matching its atype regexp against the encoding of OUTER */
+static struct split *split_concat_regexp(struct state *state,
+                                         struct lens *lens) {
     int count = 0;
     struct split *outer = state->split;
+    struct level *level = outer->level;
     struct re_registers regs;
     struct split *split = NULL, *tail = NULL;
-    struct regexp *atype = lens->atype;
 
-    /* Fast path for leaf nodes, which will always lead to an empty split */
-    // FIXME: This doesn't match the empty encoding
-    if (outer->tree == NULL && strlen(outer->enc) == 0
-        && regexp_is_empty_pattern(atype)) {
-        for (int i=0; i < lens->nchildren; i++) {
-            tail = split_append(&split, tail, NULL, NULL,
-                                outer->enc, 0, 0);
-        }
-        return split;
-    }
+    size_t start = level->offs[outer->start];
+    size_t end = level->offs[outer->end];
 
     MEMZERO(&regs, 1);
-    count = regexp_match(atype, outer->enc, outer->end,
-                         outer->start, &regs);
-    if (count >= 0 && count != outer->end - outer->start)
+    count = regexp_match(lens->atype, level->enc, end, start, &regs);
+    if (count >= 0 && count != end - start)
         count = -1;
     if (count < 0) {
         regexp_match_error(state, lens, count, outer);
         goto error;
     }
 
-    struct tree *cur = outer->tree;
     int reg = 1;
     for (int i=0; i < lens->nchildren; i++) {
         assert(reg < regs.num_regs);
         assert(regs.start[reg] != -1);
-        struct tree *follow = cur;
-        for (int j = regs.start[reg]; j < regs.end[reg]; j++) {
-            if (outer->enc[j] == ENC_SLASH_CH)
-                follow = follow->next;
-        }
-        tail = split_append(&split, tail, cur, follow,
-                            outer->enc, regs.start[reg], regs.end[reg]);
-        cur = follow;
+        tail = split_append(&split, tail, level,
+                            level_index(level, regs.start[reg]),
+                            level_index(level, regs.end[reg]));
         reg += 1 + regexp_nsub(lens->children[i]->atype);
     }
     assert(reg < regs.num_regs);
@@ -251,7 +653,87 @@ static struct split *split_concat(struct state *state, struct lens *lens) {
     free(regs.end);
     return split;
  error:
-    free_split(split);
+    list_free(split);
+    split = NULL;
+    goto done;
+}
+
+/* Refine a tree split OUTER according to the L_CONCAT lens LENS */
+static struct split *split_concat(struct state *state, struct lens *lens) {
+    assert(lens->tag == L_CONCAT);
+
+    struct split *outer = state->split;
+    struct level *level = outer->level;
+    struct split *split = NULL, *tail = NULL;
+    struct tokfa *fa = lens_tokfa(lens);
+    size_t ntok = outer->end - outer->start;
+    uint64_t *sets = NULL;
+    unsigned int *owner = NULL;
+    unsigned int nw;
+
+    if (fa == NULL)
+        return split_concat_regexp(state, lens);
+    nw = fa->nwords;
+
+    /* Fast path for leaf nodes, which will always lead to an empty split */
+    if (ntok == 0 && bit_test(fa->last, 0)) {
+        for (int i=0; i < lens->nchildren; i++) {
+            tail = split_append(&split, tail, level,
+                                outer->start, outer->start);
+        }
+        return split;
+    }
+
+    /* Find the sets of positions the automaton can be in after each token,
+     * then go back through them to assign the tokens to positions. Where
+     * there is a choice, we prefer positions belonging to earlier
+     * children, which is also what the regexp matcher does. */
+    if (ALLOC_N(sets, (ntok + 1) * nw) < 0 || ALLOC_N(owner, ntok + 1) < 0)
+        goto error;
+    bit_set(sets, 0);
+    for (size_t k = 0; k < ntok; k++) {
+        if (! tokfa_step(state, fa, sets + k * nw, level, outer->start + k,
+                         sets + (k + 1) * nw))
+            goto nomatch;
+    }
+    int p = -1;
+    for_each_bit(q, sets + ntok * nw, nw) {
+        if (bit_test(fa->last, q)) {
+            p = q;
+            break;
+        }
+    }
+    if (p < 0)
+        goto nomatch;
+    for (size_t k = ntok; k > 0; k--) {
+        int q;
+        owner[k - 1] = fa->owner[p];
+        for (q = bits_next(sets + (k - 1) * nw, nw, 0); q >= 0;
+             q = bits_next(sets + (k - 1) * nw, nw, q + 1)) {
+            if (bit_test(fa->follow + q * nw, p))
+                break;
+        }
+        assert(q >= 0);
+        p = q;
+    }
+
+    size_t k = 0;
+    for (int i=0; i < lens->nchildren; i++) {
+        size_t start = k;
+        while (k < ntok && owner[k] == i)
+            k += 1;
+        tail = split_append(&split, tail, level,
+                            outer->start + start, outer->start + k);
+    }
+    assert(k == ntok);
+ done:
+    free(sets);
+    free(owner);
+    return split;
+ nomatch:
+    regexp_match_error(state, lens, -1, outer);
+ error:
+    list_free(split);
     split = NULL;
     goto done;
 }
@@ -261,34 +743,35 @@ static struct split *split_iter(struct state *state, struct lens *lens) {
 
     int count = 0;
     struct split *outer = state->split;
+    struct level *level = outer->level;
     struct split *split = NULL;
-    struct regexp *atype = lens->child->atype;
-
-    struct tree *cur = outer->tree;
-    int pos = outer->start;
+    struct tokfa *fa = lens_tokfa(lens->child);
     struct split *tail = NULL;
+
+    size_t pos = outer->start;
     while (pos < outer->end) {
-        count = regexp_match(atype, outer->enc, outer->end, pos, NULL);
-        if (count == -1) {
+        if (fa != NULL) {
+            count = tokfa_match(state, fa, level, pos, outer->end);
+        } else {
+            size_t off = level->offs[pos];
+            count = regexp_match(lens->child->atype, level->enc,
+                                 level->offs[outer->end], off, NULL);
+            if (count >= 0)
+                count = level_index(level, off + count) - pos;
+        }
+        if (count == -1 || count == 0) {
             break;
         } else if (count < -1) {
             regexp_match_error(state, lens->child, count, outer);
             goto error;
         }
 
-        struct tree *follow = cur;
-        for (int j = pos; j < pos + count; j++) {
-            if (outer->enc[j] == ENC_SLASH_CH)
-                follow = follow->next;
-        }
-        tail = split_append(&split, tail, cur, follow,
-                            outer->enc, pos, pos + count);
-        cur = follow;
+        tail = split_append(&split, tail, level, pos, pos + count);
         pos += count;
     }
     return split;
  error:
-    free_split(split);
+    list_free(split);
     return NULL;
 }
 
@@ -296,9 +779,18 @@ static struct split *split_iter(struct state *state, struct lens *lens) {
 static int applies(struct lens *lens, struct state *state) {
     int count;
     struct split *split = state->split;
+    struct level *level = split->level;
+    struct tokfa *fa = lens_tokfa(lens);
 
-    count = regexp_match(lens->atype, split->enc, split->end,
-                         split->start, NULL);
+    if (fa != NULL) {
+        count = tokfa_match(state, fa, level, split->start, split->end);
+    } else {
+        size_t start = level->offs[split->start];
+        count = regexp_match(lens->atype, level->enc,
+                             level->offs[split->end], start, NULL);
+        if (count >= 0)
+            count = level_index(level, start + count) - split->start;
+    }
     if (count < -1) {
         regexp_match_error(state, lens, count, split);
         return 0;
@@ -311,14 +803,35 @@ static int applies(struct lens *lens, struct state *state) {
     return 1;
 }
 
+/* Append the LEN bytes at TEXT to OUT */
+static void out_write(struct put_out *out, const char *text, size_t len) {
+    if (out->used + len >= out->size) {
+        size_t size = 2 * out->size;
+        if (size < out->used + len + 1)
+            size = out->used + len + 1;
+        if (out->nomem || REALLOC_N(out->buf, size) < 0) {
+            out->nomem = true;
+            return;
+        }
+        out->size = size;
+    }
+    memcpy(out->buf + out->used, text, len);
+    out->used += len;
+}
+
+static void out_puts(struct put_out *out, const char *text) {
+    if (text != NULL)
+        out_write(out, text, strlen(text));
+}
+
 /* Print TEXT to OUT, translating common escapes like \n */
-static void print_escaped_chars(FILE *out, const char *text) {
+static void print_escaped_chars(struct put_out *out, const char *text) {
     for (const char *c = text; *c != '\0'; c++) {
         if (*c == '\\') {
             char x;
             c += 1;
             if (*c == '\0') {
-                fputc(*c, out);
+                out_write(out, c, 1);
                 break;
             }
             switch(*c) {
@@ -347,9 +860,11 @@ static void print_escaped_chars(FILE *out, const char *text) {
                 x = *c;
                 break;
             }
-            fputc(x, out);
+            out_write(out, &x, 1);
         } else {
-            fputc(*c, out);
+            size_t len = strcspn(c, "\\");
+            out_write(out, c, len);
+            c += len - 1;
         }
     }
 }
@@ -431,6 +946,150 @@ static int skel_instance_of(struct lens *lens, struct skel *skel) {
     return 0;
 }
 
+/*
+ * Copying unchanged iterations of a star
+ */
+
+/* Return true if the output of LENS depends on the key or value of the
+ * enclosing subtree, and not only on the trees it is put with */
+static bool lens_uses_key_value(struct lens *lens) {
+    switch (lens->tag) {
+    case L_KEY:
+    case L_STORE:
+    case L_SQUARE:
+        return true;
+    case L_CONCAT:
+    case L_UNION:
+        for (int i=0; i < lens->nchildren; i++)
+            if (lens_uses_key_value(lens->children[i]))
+                return true;
+        return false;
+    case L_STAR:
+    case L_MAYBE:
+        return lens_uses_key_value(lens->child);
+    case L_REC:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Return true if TREE and all its descendants still have the labels and
+ * values that their spans say they were read from in TEXT */
+static bool tree_matches_text(struct tree *tree, const char *text,
+                              size_t len) {
+    struct span *span = tree->span;
+
+    if (tree->dirty || span == NULL)
+        return false;
+
+    if (span->label_end > span->label_start) {
+        size_t n = span->label_end - span->label_start;
+        if (tree->label == NULL || span->label_end > len
+            || strlen(tree->label) != n
+            || memcmp(tree->label, text + span->label_start, n) != 0)
+            return false;
+    }
+    if (span->value_end > span->value_start) {
+        size_t n = span->value_end - span->value_start;
+        if (tree->value == NULL || span->value_end > len
+            || strlen(tree->value) != n
+            || memcmp(tree->value, text + span->value_start, n) != 0)
+            return false;
+    }
+    list_for_each(c, tree->children) {
+        if (! tree_matches_text(c, text, len))
+            return false;
+    }
+    return true;
+}
+
+/* Count the L_SUBTREE skels in SKEL that belong to trees on the level
+ * of SKEL, and store them in SUBS if it is not NULL */
+static uint skel_subtrees(struct skel *skel, struct skel **subs) {
+    uint n = 0;
+
+    if (skel->tag == L_SUBTREE) {
+        if (subs != NULL)
+            subs[0] = skel;
+        return 1;
+    }
+    if (skel->tag == L_CONCAT || skel->tag == L_STAR
+        || skel->tag == L_MAYBE || skel->tag == L_SQUARE) {
+        list_for_each(s, skel->skels) {
+            n += skel_subtrees(s, subs == NULL ? NULL : subs + n);
+        }
+    }
+    return n;
+}
+
+/* If the trees in STATE->SPLIT are exactly the trees that were read from
+ * the text of STATE->SKEL, an iteration of a star, and none of them has
+ * changed since, copy that text to the output and return true. That is
+ * what putting the trees would produce, only without the work.
+ *
+ * Return false and leave STATE untouched if that can not be established,
+ * for example because the trees were loaded without span information. */
+static bool put_unchanged(struct state *state) {
+    struct skel *skel = state->skel;
+    struct split *split = state->split;
+    struct skel **subs = NULL;
+    uint ntrees = 0, pos;
+    bool result = false;
+
+    if (state->text == NULL || skel->end == 0 || skel->end > state->text_len)
+        return false;
+
+    /* The trees must be clean and lie in order in the text of SKEL */
+    pos = skel->start;
+    for (struct tree *t = split->tree; t != split->follow; t = t->next) {
+        struct span *span = t->span;
+        if (t->dirty || span == NULL || span->span_start == UINT_MAX)
+            return false;
+        if (span->span_start < pos || span->span_end > skel->end)
+            return false;
+        pos = span->span_end;
+        ntrees += 1;
+    }
+
+    /* Each of them must be put with its own skel */
+    if (skel_subtrees(skel, NULL) != ntrees)
+        return false;
+    if (ntrees > 0) {
+        if (ALLOC_N(subs, ntrees) < 0)
+            return false;
+        skel_subtrees(skel, subs);
+    }
+    uint i = 0;
+    for (struct tree *t = split->tree; t != split->follow; t = t->next, i++) {
+        uint n = 0;
+        for (struct tree *u = split->tree; u != t; u = u->next)
+            if (streqv(u->label, t->label))
+                n += 1;
+        if (dict_peek(t->label, state->dict, n) != subs[i]->child)
+            goto done;
+        /* Make sure the tree was read from this text and not just from
+         * one that agrees with it at the tree's spans */
+        if (subs[i]->end == 0
+            || t->span->span_start != subs[i]->start
+            || t->span->span_end != subs[i]->end)
+            goto done;
+        if (! tree_matches_text(t, state->text, state->text_len))
+            goto done;
+    }
+
+    for (struct tree *t = split->tree; t != split->follow; t = t->next) {
+        struct skel *sk;
+        struct dict *di;
+        dict_lookup(t->label, state->dict, &sk, &di);
+    }
+    out_write(state->out, state->text + skel->start, skel->end - skel->start);
+    result = true;
+ done:
+    free(subs);
+    return result;
+}
+
 /*
  * put
  */
@@ -471,9 +1130,9 @@ static void put_del(ATTRIBUTE_UNUSED struct lens *lens, struct state *state) {
     assert(state->skel != NULL);
     assert(state->skel->tag == L_DEL);
     if (state->override != NULL) {
-        fprintf(state->out, "%s", state->override);
+        out_puts(state->out, state->override);
     } else {
-        fprintf(state->out, "%s", state->skel->text);
+        out_puts(state->out, state->skel->text);
     }
 }
 
@@ -544,12 +1203,14 @@ static void put_quant_star(struct lens *lens, struct state *state) {
     struct split *last_split = NULL;
 
     struct split *split = split_iter(state, lens);
+    bool copy = state->text != NULL && ! lens_uses_key_value(lens->child);
 
     state->skel = state->skel->skels;
     set_split(state, split);
     last_split = state->split;
     while (state->split != NULL && state->skel != NULL) {
-        put_lens(lens->child, state);
+        if (! copy || ! put_unchanged(state))
+            put_lens(lens->child, state);
         state->skel = state->skel->next;
         last_split = state->split;
         next_split(state);
@@ -590,7 +1251,7 @@ static void put_store(struct lens *lens, struct state *state) {
                   state->value, pat);
         free(pat);
     } else {
-        fprintf(state->out, "%s", state->value);
+        out_puts(state->out, state->value);
     }
 }
 
@@ -640,7 +1301,7 @@ static void put_lens(struct lens *lens, struct state *state) {
         put_store(lens, state);
         break;
     case L_KEY:
-        fprintf(state->out, "%s", state->key);
+        out_puts(state->out, state->key);
         break;
     case L_LABEL:
     case L_VALUE:
@@ -794,7 +1455,7 @@ static void create_lens(struct lens *lens, struct state *state) {
         put_store(lens, state);
         break;
     case L_KEY:
-        fprintf(state->out, "%s", state->key);
+        out_puts(state->out, state->key);
         break;
     case L_LABEL:
     case L_VALUE:
@@ -833,32 +1494,53 @@ static void create_lens(struct lens *lens, struct state *state) {
     }
 }
 
-void lns_put(FILE *out, struct lens *lens, struct tree *tree,
-             const char *text, struct lns_error **err) {
+int lns_put(struct lens *lens, struct tree *tree, const char *text,
+            char **out, size_t *out_size, struct lns_error **err) {
     struct state state;
+    struct put_out po;
     struct lns_error *err1;
 
+    *out = NULL;
+    *out_size = 0;
     if (err != NULL)
         *err = NULL;
+
+    /* The output is usually about as long as TEXT */
+    MEMZERO(&po, 1);
+    po.size = strlen(text) + 1;
+    if (ALLOC_N(po.buf, po.size) < 0)
+        return -1;
     if (tree == NULL)
-        return;
+        goto finish;
 
     MEMZERO(&state, 1);
+    state.out = &po;
     state.path = strdup("");
+    if (state.path == NULL) {
+        po.nomem = true;
+        goto done;
+    }
     state.skel = lns_parse(lens, text, &state.dict, &err1);
 
     if (err1 != NULL) {
-        if (err != NULL)
-            *err = err1;
-        else
-            free_lns_error(err1);
-        return;
+        state.error = err1;
+        goto done;
     }
-    state.out = out;
     state.split = make_split(tree);
+    if (state.split == NULL) {
+        po.nomem = true;
+        goto done;
+    }
     state.key = tree->label;
+    /* Only trees read with span information can be matched up with the
+     * parts of TEXT that they came from */
+    if (tree->span != NULL) {
+        state.text = text;
+        state.text_len = strlen(text);
+    }
     put_lens(lens, &state);
 
+ done:
     free(state.path);
     free_split(state.split);
     free_skel(state.skel);
@@ -868,6 +1550,16 @@ void lns_put(FILE *out, struct lens *lens, struct tree *tree,
     } else {
         free_lns_error(state.error);
     }
+ finish:
+    if (po.nomem) {
+        free(po.buf);
+        errno = ENOMEM;
+        return -1;
+    }
+    po.buf[po.used] = '\0';
+    *out = po.buf;
+    *out_size = po.used;
+    return 0;
 }
 
 /*
@@ -31,6 +31,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <inttypes.h>
 
 #include "memory.h"
 #include "syntax.h"
@@ -72,13 +73,34 @@ static const char const anon_ident[] = "_";
 
 static void print_value(FILE *out, struct value *v);
 
+/* Lens typechecks that are put off while compiling a module, so that
+ * they can all be run in parallel by RUN_CHECKS
+ */
+struct deferred {
+    struct lns_check *checks;
+    struct term     **decls;  /* The declaration each check comes from */
+    size_t            nchecks;
+    size_t            size;
+    struct term      *decl;   /* The declaration being compiled */
+};
+
+/* The modules a module refers to, collected by TYPECHECK */
+struct deps {
+    size_t          used;
+    size_t          size;
+    struct module **modules;
+    bool            failed;    /* Ran out of memory while collecting */
+};
+
 /* The evaluation context with all loaded modules and the bindings for the
  * module we are working on in LOCAL
  */
 struct ctx {
-    const char     *name;     /* The module we are working on */
-    struct augeas  *aug;
-    struct binding *local;
+    const char      *name;     /* The module we are working on */
+    struct augeas   *aug;
+    struct binding  *local;
+    struct deferred *deferred; /* NULL if typechecks are run right away */
+    struct deps     *deps;     /* NULL if dependencies are not collected */
 };
 
 static int init_fatal_exn(struct error *error) {
@@ -530,6 +552,38 @@ struct lens *lens_lookup(struct augeas *aug, const char *qname) {
     return bnd->value->lens;
 }
 
+/* Remember in DEPS the module that the qualified name QNAME refers to,
+ * unless that is CTX_MODNAME itself */
+static void deps_add(struct deps *deps, struct augeas *aug,
+                     const char *ctx_modname, const char *qname) {
+    const char *dot = strchr(qname, '.');
+    struct module *module = NULL;
+
+    if (dot == NULL)
+        return;
+    list_for_each(m, aug->modules) {
+        if (STRCASEEQLEN(m->name, qname, dot - qname)
+            && m->name[dot - qname] == '\0') {
+            module = m;
+            break;
+        }
+    }
+    if (module == NULL || STRCASEEQ(module->name, ctx_modname))
+        return;
+    for (size_t i=0; i < deps->used; i++)
+        if (deps->modules[i] == module)
+            return;
+    if (deps->used >= deps->size) {
+        size_t size = deps->size == 0 ? 8 : 2 * deps->size;
+        if (REALLOC_N(deps->modules, size) < 0) {
+            deps->failed = true;
+            return;
+        }
+        deps->size = size;
+    }
+    deps->modules[deps->used++] = module;
+}
+
 static struct binding *ctx_lookup_bnd(struct info *info,
                                       struct ctx *ctx, const char *name) {
     struct binding *b = NULL;
@@ -545,8 +599,11 @@ static struct binding *ctx_lookup_bnd(struct info *info,
     if (ctx->aug != NULL) {
         int r;
         r = lookup_internal(ctx->aug, ctx->name, name, &b);
-        if (r == 0)
+        if (r == 0) {
+            if (ctx->deps != NULL)
+                deps_add(ctx->deps, ctx->aug, ctx->name, name);
             return b;
+        }
         char *modname = modname_of_qname(name);
         syntax_error(info, "Could not load module %s for %s",
                      modname, name);
@@ -1336,7 +1393,8 @@ static int check_decl(struct term *term, struct ctx *ctx) {
     return 1;
 }
 
-static int typecheck(struct term *term, struct augeas *aug) {
+static int typecheck(struct term *term, struct augeas *aug,
+                     struct deps *deps) {
     int ok = 1;
     struct ctx ctx;
     char *fname;
@@ -1364,6 +1422,8 @@ static int typecheck(struct term *term, struct augeas *aug) {
     ctx.aug = aug;
     ctx.local = NULL;
     ctx.name = term->mname;
+    ctx.deferred = NULL;
+    ctx.deps = deps;
     list_for_each(dcl, term->decls) {
         ok &= check_decl(dcl, &ctx);
     }
@@ -1373,6 +1433,78 @@ static int typecheck(struct term *term, struct augeas *aug) {
 
 static struct value *compile_exp(struct info *, struct term *, struct ctx *);
 
+/* Put off the typecheck TAG of L1 and L2 until RUN_CHECKS. Return 0 if
+ * the check was put off, and -1 if it needs to be run right away */
+static int defer_check(struct ctx *ctx, enum lens_tag tag, struct info *info,
+                       struct lens *l1, struct lens *l2) {
+    struct deferred *deferred = ctx->deferred;
+    struct lns_check *check;
+
+    if (deferred == NULL)
+        return -1;
+    /* lns_check_rec assigns types to recursive lenses later on; the
+     * check must only see the types they have right now */
+    if (l1->recursive || (l2 != NULL && l2->recursive))
+        return -1;
+    if (deferred->nchecks >= deferred->size) {
+        size_t size = 2 * deferred->size + 64;
+        if (REALLOC_N(deferred->checks, size) < 0)
+            return -1;
+        if (REALLOC_N(deferred->decls, size) < 0)
+            return -1;
+        deferred->size = size;
+    }
+    check = deferred->checks + deferred->nchecks;
+    check->tag = tag;
+    check->info = ref(info);
+    check->l1 = ref(l1);
+    check->l2 = ref(l2);
+    deferred->decls[deferred->nchecks] = deferred->decl;
+    deferred->nchecks += 1;
+    return 0;
+}
+
+static struct value *make_union(struct info *info, struct lens *l1,
+                                struct lens *l2, struct ctx *ctx) {
+    int check = LNS_TYPE_CHECK(ctx);
+
+    if (check && defer_check(ctx, L_UNION, info, l1, l2) == 0)
+        check = 0;
+    return lns_make_union(info, l1, l2, check);
+}
+
+static struct value *make_concat(struct info *info, struct lens *l1,
+                                 struct lens *l2, struct ctx *ctx) {
+    int check = LNS_TYPE_CHECK(ctx);
+
+    if (check && defer_check(ctx, L_CONCAT, info, l1, l2) == 0)
+        check = 0;
+    return lns_make_concat(info, l1, l2, check);
+}
+
+static struct value *make_star(struct info *info, struct lens *l,
+                               struct ctx *ctx) {
+    int check = LNS_TYPE_CHECK(ctx);
+
+    if (check && defer_check(ctx, L_STAR, info, l, NULL) == 0)
+        check = 0;
+    return lns_make_star(info, l, check);
+}
+
+/* Same as lns_make_plus, but with typechecks that can be put off */
+static struct value *make_plus(struct info *info, struct lens *l,
+                               struct ctx *ctx) {
+    struct value *star, *conc;
+
+    star = make_star(info, l, ctx);
+    if (EXN(star))
+        return star;
+
+    conc = make_concat(ref(info), ref(l), ref(star->lens), ctx);
+    unref(star, value);
+    return conc;
+}
+
 static struct value *compile_union(struct term *exp, struct ctx *ctx) {
     struct value *v1 = compile_exp(exp->info, exp->left, ctx);
     if (EXN(v1))
@@ -1402,7 +1534,7 @@ static struct value *compile_union(struct term *exp, struct ctx *ctx) {
     } else if (t->tag == T_LENS) {
         struct lens *l1 = v1->lens;
         struct lens *l2 = v2->lens;
-        v = lns_make_union(ref(info), ref(l1), ref(l2), LNS_TYPE_CHECK(ctx));
+        v = make_union(ref(info), ref(l1), ref(l2), ctx);
     } else {
         fatal_error(info, "Tried to union a %s and a %s to yield a %s",
                     type_name(exp->left->type), type_name(exp->right->type),
@@ -1549,7 +1681,7 @@ static struct value *compile_concat(struct term *exp, struct ctx *ctx) {
     } else if (t->tag == T_LENS) {
         struct lens *l1 = v1->lens;
         struct lens *l2 = v2->lens;
-        v = lns_make_concat(ref(info), ref(l1), ref(l2), LNS_TYPE_CHECK(ctx));
+        v = make_concat(ref(info), ref(l1), ref(l2), ctx);
     } else {
         v = NULL;
         fatal_error(info, "Tried to concat a %s and a %s to yield a %s",
@@ -1580,6 +1712,8 @@ static struct value *apply(struct term *app, struct ctx *ctx) {
     lctx.aug = ctx->aug;
     lctx.local = ref(f->bindings);
     lctx.name = ctx->name;
+    lctx.deferred = ctx->deferred;
+    lctx.deps = ctx->deps;
 
     arg = coerce(arg, f->func->param->type);
     if (arg == NULL)
@@ -1635,9 +1769,9 @@ static struct value *compile_rep(struct term *rep, struct ctx *ctx) {
     } else if (rep->type->tag == T_LENS) {
         int c = LNS_TYPE_CHECK(ctx);
         if (rep->quant == Q_STAR) {
-            v = lns_make_star(ref(rep->info), ref(arg->lens), c);
+            v = make_star(ref(rep->info), ref(arg->lens), ctx);
         } else if (rep->quant == Q_PLUS) {
-            v = lns_make_plus(ref(rep->info), ref(arg->lens), c);
+            v = make_plus(ref(rep->info), ref(arg->lens), ctx);
         } else if (rep->quant == Q_MAYBE) {
             v = lns_make_maybe(ref(rep->info), ref(arg->lens), c);
         } else {
@@ -1753,34 +1887,80 @@ static int compile_test(struct term *term, struct ctx *ctx) {
     return ret;
 }
 
+/* Report that compiling the declaration TERM failed with exception V */
+static void decl_error(struct term *term, struct value *v) {
+    if (EXN(v) && !v->exn->seen) {
+        struct error *error = term->info->error;
+        struct memstream ms;
+
+        init_memstream(&ms);
+
+        syntax_error(term->info, "Failed to compile %s",
+                     term->bname);
+        fprintf(ms.stream, "%s\n", error->details);
+        print_value(ms.stream, v);
+        close_memstream(&ms);
+
+        v->exn->seen = 1;
+        free(error->details);
+        error->details = ms.buf;
+    }
+}
+
+/* Run the typechecks that have been put off so far. If one of them fails,
+ * report that as the error for the declaration it came from, just like
+ * it would have been reported had the check been run right away, and
+ * return 0 */
+static int run_checks(struct ctx *ctx) {
+    struct deferred *deferred = ctx->deferred;
+    struct value *exn = NULL;
+    int result = 1;
+    size_t i;
+
+    if (deferred == NULL || deferred->nchecks == 0)
+        return 1;
+
+    i = lns_run_checks(deferred->checks, deferred->nchecks, &exn);
+    if (exn != NULL) {
+        decl_error(deferred->decls[i], exn);
+        unref(exn, value);
+        result = 0;
+    }
+    lns_release_checks(deferred->checks, deferred->nchecks);
+    deferred->nchecks = 0;
+    return result;
+}
+
 static int compile_decl(struct term *term, struct ctx *ctx) {
     if (term->tag == A_BIND) {
         int result;
 
+        if (ctx->deferred != NULL)
+            ctx->deferred->decl = term;
         struct value *v = compile_exp(term->info, term->exp, ctx);
         bind(&ctx->local, term->bname, term->type, v);
 
-        if (EXN(v) && !v->exn->seen) {
-            struct error *error = term->info->error;
-            struct memstream ms;
-
-            init_memstream(&ms);
-
-            syntax_error(term->info, "Failed to compile %s",
-                         term->bname);
-            fprintf(ms.stream, "%s\n", error->details);
-            print_value(ms.stream, v);
-            close_memstream(&ms);
-
-            v->exn->seen = 1;
-            free(error->details);
-            error->details = ms.buf;
+        /* A check that was put off might have failed before we got to V */
+        if (EXN(v) && ! run_checks(ctx)) {
+            unref(v, value);
+            return 0;
         }
+        decl_error(term, v);
         result = !(EXN(v) || HAS_ERR(ctx->aug));
         unref(v, value);
         return result;
     } else if (term->tag == A_TEST) {
-        return compile_test(term, ctx);
+        struct deferred *deferred = ctx->deferred;
+        int result;
+
+        /* Tests run the lenses defined so far, which must have passed
+         * their typechecks first */
+        if (! run_checks(ctx))
+            return 0;
+        ctx->deferred = NULL;
+        result = compile_test(term, ctx);
+        ctx->deferred = deferred;
+        return result;
     }
     assert(0);
     abort();
@@ -1788,16 +1968,22 @@ static int compile_decl(struct term *term, struct ctx *ctx) {
 
 static struct module *compile(struct term *term, struct augeas *aug) {
     struct ctx ctx;
+    struct deferred deferred;
     struct transform *autoload = NULL;
     assert(term->tag == A_MODULE);
 
+    MEMZERO(&deferred, 1);
     ctx.aug = aug;
     ctx.local = NULL;
     ctx.name = term->mname;
+    ctx.deferred = LNS_TYPE_CHECK(&ctx) ? &deferred : NULL;
+    ctx.deps = NULL;
     list_for_each(dcl, term->decls) {
         if (!compile_decl(dcl, &ctx))
             goto error;
     }
+    if (! run_checks(&ctx))
+        goto error;
 
     if (term->autoload != NULL) {
         struct binding *bnd = bnd_lookup(ctx.local, term->autoload);
@@ -1813,8 +1999,13 @@ static struct module *compile(struct term *term, struct augeas *aug) {
     struct module *module = module_create(term->mname);
     module->bindings = ctx.local;
     module->autoload = ref(autoload);
+    free(deferred.checks);
+    free(deferred.decls);
     return module;
  error:
+    lns_release_checks(deferred.checks, deferred.nchecks);
+    free(deferred.checks);
+    free(deferred.decls);
     unref(ctx.local, binding);
     return NULL;
 }
@@ -1902,6 +2093,8 @@ int define_native_intl(const char *file, int line,
     ctx.aug = NULL;
     ctx.local = ref(module->bindings);
     ctx.name = module->name;
+    ctx.deferred = NULL;
+    ctx.deps = NULL;
     if (! check_exp(func, &ctx)) {
         fatal_error(info, "Typechecking native %s failed",
                     name);
@@ -1928,7 +2121,8 @@ int define_native_intl(const char *file, int line,
 
 
 /* Defined in parser.y */
-int augl_parse_file(struct augeas *aug, const char *name, struct term **term);
+int augl_parse_file(struct augeas *aug, const char *name, const char *text,
+                    struct term **term);
 
 static char *module_basename(const char *modname) {
     char *fname;
@@ -1962,27 +2156,185 @@ static char *module_filename(struct augeas *aug, const char *modname) {
     return filename;
 }
 
+/*
+ * Typecheck cache
+ *
+ * Lens typechecks are by far the most expensive part of loading
+ * modules. When AUGEAS_TYPECHECK_CACHE_ENV names a file, we record in it
+ * the key of every module whose lenses passed their typechecks, one
+ * line "KEY MODULE" per module, and compile modules whose key is listed
+ * there without rerunning the lens typechecks.
+ *
+ * The key of a module is a hash of the Augeas version, the source of the
+ * module and the names and keys of all the modules it refers to; a
+ * change to a module therefore also invalidates the entries of all
+ * modules that use it. Only ever appending to the file keeps concurrent
+ * users from clobbering each other's results; stale entries are harmless,
+ * and the file can be removed at any time.
+ */
+
+#define TC_HASH_INIT  UINT64_C(0xcbf29ce484222325)
+
+/* FNV-1a */
+static uint64_t tc_hash(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= UINT64_C(0x100000001b3);
+    }
+    return h;
+}
+
+static int module_name_cmp(const void *p1, const void *p2) {
+    const struct module *m1 = *(const struct module **) p1;
+    const struct module *m2 = *(const struct module **) p2;
+
+    return strcasecmp(m1->name, m2->name);
+}
+
+/* Compute the key of the module parsed from TEXT which refers to the
+ * modules in DEPS. Return 0 if the key can not be computed, including
+ * when that is the case for any of the modules in DEPS */
+static uint64_t module_key(const char *text, struct deps *deps) {
+    uint64_t h = TC_HASH_INIT;
+
+    if (text == NULL || deps->failed)
+        return 0;
+    for (size_t i=0; i < deps->used; i++) {
+        if (deps->modules[i]->tc_key == 0)
+            return 0;
+    }
+
+    h = tc_hash(h, PACKAGE_VERSION, strlen(PACKAGE_VERSION) + 1);
+    h = tc_hash(h, text, strlen(text) + 1);
+
+    if (deps->used > 0)
+        qsort(deps->modules, deps->used, sizeof(*deps->modules),
+              module_name_cmp);
+    for (size_t i=0; i < deps->used; i++) {
+        struct module *m = deps->modules[i];
+        h = tc_hash(h, m->name, strlen(m->name) + 1);
+        h = tc_hash(h, &m->tc_key, sizeof(m->tc_key));
+    }
+    return h == 0 ? 1 : h;
+}
+
+static int tc_key_cmp(const void *p1, const void *p2) {
+    uint64_t k1 = *(const uint64_t *) p1;
+    uint64_t k2 = *(const uint64_t *) p2;
+
+    return k1 < k2 ? -1 : (k1 > k2 ? 1 : 0);
+}
+
+static bool tc_cache_lookup(struct augeas *aug, uint64_t key) {
+    if (aug->ntc_keys == 0)
+        return false;
+    return bsearch(&key, aug->tc_keys, aug->ntc_keys,
+                   sizeof(*aug->tc_keys), tc_key_cmp) != NULL;
+}
+
+static void tc_cache_add(struct augeas *aug, uint64_t key) {
+    size_t i;
+
+    if (tc_cache_lookup(aug, key))
+        return;
+    if (REALLOC_N(aug->tc_keys, aug->ntc_keys + 1) < 0)
+        return;
+    for (i = aug->ntc_keys; i > 0 && aug->tc_keys[i-1] > key; i--)
+        aug->tc_keys[i] = aug->tc_keys[i-1];
+    aug->tc_keys[i] = key;
+    aug->ntc_keys += 1;
+}
+
+/* Read the typecheck cache if one is configured. Since the cache only
+ * ever saves work, a missing or unreadable file is the same as an empty
+ * cache */
+static void tc_cache_init(struct augeas *aug) {
+    const char *fname = getenv(AUGEAS_TYPECHECK_CACHE_ENV);
+    char line[256];
+    FILE *fp;
+
+    if (!(aug->flags & AUG_TYPE_CHECK) || fname == NULL || fname[0] == '\0')
+        return;
+    aug->tc_cache = strdup(fname);
+    if (aug->tc_cache == NULL)
+        return;
+
+    fp = fopen(fname, "r");
+    if (fp == NULL)
+        return;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        uint64_t key;
+        if (sscanf(line, "%" SCNx64, &key) == 1 && key != 0)
+            tc_cache_add(aug, key);
+    }
+    fclose(fp);
+}
+
+static void tc_cache_record(struct augeas *aug, struct module *module) {
+    FILE *fp;
+
+    if (module->tc_key == 0 || tc_cache_lookup(aug, module->tc_key))
+        return;
+    fp = fopen(aug->tc_cache, "a");
+    if (fp == NULL)
+        return;
+    fprintf(fp, "%016" PRIx64 " %s\n", module->tc_key, module->name);
+    if (fclose(fp) == 0)
+        tc_cache_add(aug, module->tc_key);
+}
+
 int load_module_file(struct augeas *aug, const char *filename) {
     struct term *term = NULL;
+    struct deps deps;
+    bool use_cache = aug->tc_cache != NULL;
+    bool cached = false;
+    uint64_t key = 0;
+    char *text = NULL;
     int result = -1;
 
+    MEMZERO(&deps, 1);
+
+    /* The key must be computed from exactly the text we parse and
+     * typecheck, not from whatever is in the file later */
+    if (use_cache)
+        text = xread_file(filename);
+
     if (aug->flags & AUG_TRACE_MODULE_LOADING)
         printf("Module %s", filename);
-    augl_parse_file(aug, filename, &term);
+    augl_parse_file(aug, filename, text, &term);
     if (aug->flags & AUG_TRACE_MODULE_LOADING)
         printf(HAS_ERR(aug) ? " failed\n" : " loaded\n");
     ERR_BAIL(aug);
 
-    if (! typecheck(term, aug))
+    if (! typecheck(term, aug, use_cache ? &deps : NULL))
         goto error;
 
+    /* All the modules this one refers to have been loaded by typecheck,
+     * and therefore have their keys already */
+    if (use_cache) {
+        key = module_key(text, &deps);
+        cached = key != 0 && tc_cache_lookup(aug, key);
+    }
+
+    unsigned int flags = aug->flags;
+    if (cached)
+        aug->flags &= ~AUG_TYPE_CHECK;
     struct module *module = compile(term, aug);
+    aug->flags = flags;
     ERR_THROW(module == NULL, aug, AUG_ESYNTAX,
               "Failed to load %s", filename);
 
+    module->tc_key = key;
+    if (use_cache && !cached)
+        tc_cache_record(aug, module);
+
     list_append(aug->modules, module);
     result = 0;
  error:
+    free(text);
+    free(deps.modules);
     // FIXME: This leads to a bad free of a string used in a del lens
     // To reproduce run lenses/tests/test_yum.aug
     unref(term, term);
@@ -2017,6 +2369,7 @@ int interpreter_init(struct augeas *aug) {
         return -1;
 
     aug->modules = builtin_init(aug->error);
+    tc_cache_init(aug);
     if (aug->flags & AUG_NO_MODL_AUTOLOAD)
         return 0;
 
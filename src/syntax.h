@@ -210,6 +210,8 @@ struct module {
     struct transform  *autoload;
     char              *name;
     struct binding    *bindings;
+    uint64_t           tc_key;   /* Hash of the module source and its
+                                  * dependencies; 0 if not computed */
 };
 
 struct type *make_arrow_type(struct type *dom, struct type *img);
@@ -31,6 +31,9 @@
 #include <unistd.h>
 #include <selinux/selinux.h>
 #include <stdbool.h>
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #include "internal.h"
 #include "memory.h"
@@ -38,6 +41,7 @@
 #include "syntax.h"
 #include "transform.h"
 #include "errcode.h"
+#include "hash.h"
 
 static const int fnm_flags = FNM_PATHNAME;
 static const int glob_flags = GLOB_NOSORT;
@@ -47,6 +51,18 @@ static const int glob_flags = GLOB_NOSORT;
 /* Extension for backup files */
 #define EXT_AUGSAVE ".augsave"
 
+/* How many files transform_save_files prepares before writing them out */
+#define SAVE_BATCH_SIZE 64
+/* The maximum number of threads used to write files in parallel */
+#define SAVE_MAX_THREADS 8
+
+/* How saved files are made durable, see AUGEAS_SAVE_SYNC */
+enum save_sync {
+    SAVE_SYNC_FILE,
+    SAVE_SYNC_BATCH,
+    SAVE_SYNC_NONE
+};
+
 /* Loaded files are tracked underneath METATREE. When a file with name
  * FNAME is loaded, certain entries are made under METATREE / FNAME:
  *   path      : path where tree for FNAME is put
@@ -58,14 +74,18 @@ static const int glob_flags = GLOB_NOSORT;
  *   error/pos : position in file where error occured (for get errors)
  *   error/path: path to tree node where error occurred (for put errors)
  *   error/message : human-readable error message
+ *   diff      : the changes AUG_SAVE_NOOP would have made to FNAME, as a
+ *               unified diff
  */
 static const char *const s_path = "path";
 static const char *const s_lens = "lens";
 static const char *const s_info = "info";
 static const char *const s_mtime = "mtime";
+static const char *const s_diff = "diff";
 
 static const char *const s_error = "error";
-/* These are all put underneath "error" */
+static const char *const s_warning = "warning";
+/* These are all put underneath "error" and "warning" */
 static const char *const s_pos     = "pos";
 static const char *const s_message = "message";
 static const char *const s_line    = "line";
@@ -142,33 +162,345 @@ static char *mtime_as_string(struct augeas *aug, const char *fname) {
     return NULL;
 }
 
-/* fnmatch(3) which will match // in a pattern to a path, like glob(3) does */
-static int fnmatch_normalize(const char *pattern, const char *string, int flags) {
-    int i, j, r;
+/* Return a copy of PATTERN with // collapsed into /, so that fnmatch(3)
+ * matches it to a path like glob(3) does */
+static char *glob_normalize(const char *pattern) {
     char *pattern_norm = NULL;
+    int j = 0;
 
-    r = ALLOC_N(pattern_norm, strlen(pattern) + 1);
-    if (r < 0)
-        goto error;
+    if (ALLOC_N(pattern_norm, strlen(pattern) + 1) < 0)
+        return NULL;
 
-    for (i = 0, j = 0; i < strlen(pattern); i++) {
+    for (int i = 0; pattern[i] != '\0'; i++) {
         if (pattern[i] != '/' || pattern[i+1] != '/') {
             pattern_norm[j] = pattern[i];
             j++;
         }
     }
-    pattern_norm[j] = 0;
+    pattern_norm[j] = '\0';
+    return pattern_norm;
+}
+
+/* The filter of a transform in compiled form. The incl globs of the
+ * transform are turned into the automaton INCL, and its excl globs into
+ * EXCL, so that matching a path takes time linear in the length of the
+ * path, regardless of how many globs there are. An excl glob that does
+ * not contain a '/' is matched against the basename of a path, and goes
+ * into EXCL_BASE rather than EXCL.
+ *
+ * Filters are cached in AUG->XFM_FILTERS, keyed by the label of their
+ * transform; GLOBS records what a filter was compiled from so that it
+ * can be recompiled when the transform under /augeas/load changes. That
+ * is checked once per API call for each transform XFM. If one of the
+ * globs can not be expressed as a regular expression exactly, e.g.,
+ * because it uses character classes, COMPILED is false and GLOBS are
+ * matched with fnmatch one by one.
+ */
+struct filter_glob {
+    char *glob;            /* The glob as it appears in the tree */
+    char *norm;            /* GLOB after glob_normalize */
+    bool  exclude;
+    bool  base;            /* Match against the basename of a path */
+};
+
+struct xfm_filter {
+    char               *name;
+    struct tree        *xfm;
+    unsigned int        api_calls;  /* AUG->API_CALLS when we last checked
+                                     * that XFM and GLOBS agree */
+    size_t              nglobs;
+    struct filter_glob *globs;
+    bool                compiled;
+    struct fa          *incl;      /* NULL if there are no such globs */
+    struct fa          *excl;
+    struct fa          *excl_base;
+};
+
+/* Turn the normalized glob GLOB into a regexp matching the same strings
+ * as fnmatch(GLOB, string, FNM_PATHNAME) does. Store the regexp in
+ * *REGEXP.
+ *
+ * Return 0 on success, 1 if GLOB can not be translated exactly, and -1
+ * if we run out of memory.
+ */
+static int glob_to_regexp(const char *glob, char **regexp) {
+    static const char *const special = ".|{}()+^$*?[\\";
+    char *pat = NULL, *t;
+
+    *regexp = NULL;
+    if (*glob == '\0')
+        return 1;
+
+    /* Every character of GLOB turns into at most five characters */
+    if (ALLOC_N(pat, 5 * strlen(glob) + 1) < 0)
+        return -1;
+
+    t = pat;
+    for (const char *s = glob; *s != '\0'; s++) {
+        if (*s == '*') {
+            t = stpcpy(t, "[^/]*");
+        } else if (*s == '?') {
+            t = stpcpy(t, "[^/]");
+        } else if (*s == '[') {
+            /* Only translate simple bracket expressions; with
+             * FNM_PATHNAME, they never match a '/' */
+            const char *start = s + 1, *end;
+            bool negate = (*start == '!');
+            if (negate)
+                start += 1;
+            if (*start == ']' || *start == '^')
+                goto untranslatable;
+            end = strchr(start, ']');
+            if (end == NULL || end[-1] == '-')
+                goto untranslatable;
+            if (strcspn(start, "/[\\") < end - start)
+                goto untranslatable;
+            /* Neither can a range that contains '/', e.g. [+-0] */
+            for (const char *r = start; r < end; r++) {
+                if (r + 2 < end && r[1] == '-') {
+                    if ((unsigned char) r[0] < '/'
+                        && (unsigned char) r[2] > '/')
+                        goto untranslatable;
+                    r += 2;
+                }
+            }
+            t = stpcpy(t, negate ? "[^" : "[");
+            t = stpncpy(t, start, end - start);
+            t = stpcpy(t, negate ? "/]" : "]");
+            s = end;
+        } else {
+            if (*s == '\\') {
+                s += 1;
+                if (*s == '\0')
+                    goto untranslatable;
+            }
+            if (strchr(special, *s) != NULL)
+                *t++ = '\\';
+            *t++ = *s;
+        }
+    }
+    *t = '\0';
+    *regexp = pat;
+    return 0;
+
+ untranslatable:
+    free(pat);
+    return 1;
+}
 
-    r = fnmatch(pattern_norm, string, flags);
-    FREE(pattern_norm);
+/* Compile the globs in FILTER with EXCLUDE and BASE into the automaton
+ * *FA, which is NULL if there are no such globs. Return 0 on success, 1
+ * if the globs can't be compiled exactly, and -1 if we run out of
+ * memory */
+static int filter_compile_globs(struct xfm_filter *filter,
+                                bool exclude, bool base, struct fa **fa) {
+    char *pat = NULL, *re = NULL;
+    size_t len = 0;
+    int r;
+
+    *fa = NULL;
+    for (int i=0; i < filter->nglobs; i++) {
+        struct filter_glob *g = filter->globs + i;
+        if (g->exclude != exclude || g->base != base)
+            continue;
+        r = glob_to_regexp(g->norm, &re);
+        if (r != 0)
+            goto done;
+        if (REALLOC_N(pat, len + strlen(re) + 2) < 0)
+            goto error;
+        if (len > 0)
+            pat[len++] = '|';
+        strcpy(pat + len, re);
+        len += strlen(re);
+        FREE(re);
+    }
+
+    r = 0;
+    if (pat == NULL)
+        goto done;
+
+    r = fa_compile(pat, len, fa);
+    if (r == REG_ESPACE)
+        goto error;
+    r = (r == REG_NOERROR) ? 0 : 1;
+ done:
+    free(re);
+    free(pat);
     return r;
+ error:
+    r = -1;
+    goto done;
+}
+
+static void filter_clear(struct xfm_filter *filter) {
+    for (int i=0; i < filter->nglobs; i++) {
+        free(filter->globs[i].glob);
+        free(filter->globs[i].norm);
+    }
+    FREE(filter->globs);
+    filter->nglobs = 0;
+    filter->compiled = false;
+    fa_free(filter->incl);
+    fa_free(filter->excl);
+    fa_free(filter->excl_base);
+    filter->incl = NULL;
+    filter->excl = NULL;
+    filter->excl_base = NULL;
+}
+
+/* Return true if FILTER was compiled from the globs of XFM */
+static bool filter_current(struct xfm_filter *filter, struct tree *xfm) {
+    size_t i = 0;
+
+    list_for_each(f, xfm->children) {
+        bool incl = is_incl(f), excl = is_excl(f);
+        if (! incl && ! excl)
+            continue;
+        if (i >= filter->nglobs
+            || filter->globs[i].exclude != excl
+            || STRNEQ(filter->globs[i].glob, f->value))
+            return false;
+        i += 1;
+    }
+    return i == filter->nglobs;
+}
+
+/* Recompile FILTER from the globs of XFM */
+static int filter_compile(struct xfm_filter *filter, struct tree *xfm) {
+    size_t nglobs = 0;
+    int r;
+
+    filter_clear(filter);
+
+    list_for_each(f, xfm->children) {
+        if (is_incl(f) || is_excl(f))
+            nglobs += 1;
+    }
+    if (ALLOC_N(filter->globs, nglobs) < 0)
+        goto error;
+
+    list_for_each(f, xfm->children) {
+        struct filter_glob *g = filter->globs + filter->nglobs;
+        if (! is_incl(f) && ! is_excl(f))
+            continue;
+        filter->nglobs += 1;
+        g->exclude = is_excl(f);
+        g->base = g->exclude && strchr(f->value, SEP) == NULL;
+        g->glob = strdup(f->value);
+        g->norm = glob_normalize(f->value);
+        if (g->glob == NULL || g->norm == NULL)
+            goto error;
+    }
 
+    r = filter_compile_globs(filter, false, false, &filter->incl);
+    if (r == 0)
+        r = filter_compile_globs(filter, true, false, &filter->excl);
+    if (r == 0)
+        r = filter_compile_globs(filter, true, true, &filter->excl_base);
+    if (r < 0)
+        goto error;
+    filter->compiled = (r == 0);
+    return 0;
  error:
-    if (pattern_norm != NULL)
-        FREE(pattern_norm);
+    filter_clear(filter);
     return -1;
 }
 
+static void free_xfm_filter(struct xfm_filter *filter) {
+    if (filter == NULL)
+        return;
+    filter_clear(filter);
+    free(filter->name);
+    free(filter);
+}
+
+void free_xfm_filters(struct augeas *aug) {
+    hscan_t scan;
+    hnode_t *node;
+
+    if (aug->xfm_filters == NULL)
+        return;
+    hash_scan_begin(&scan, aug->xfm_filters);
+    while ((node = hash_scan_next(&scan)) != NULL)
+        free_xfm_filter(hnode_get(node));
+    hash_free_nodes(aug->xfm_filters);
+    hash_destroy(aug->xfm_filters);
+    aug->xfm_filters = NULL;
+}
+
+/* Return the compiled filter for XFM, compiling it if we have never seen
+ * XFM or its globs have changed since we last did. Return NULL if we run
+ * out of memory */
+static struct xfm_filter *xfm_filter(struct augeas *aug, struct tree *xfm) {
+    const char *name = xfm->label == NULL ? "" : xfm->label;
+    struct xfm_filter *filter = NULL;
+    hnode_t *node;
+
+    if (aug->xfm_filters == NULL) {
+        aug->xfm_filters = hash_create(HASHCOUNT_T_MAX, NULL, NULL);
+        if (aug->xfm_filters == NULL)
+            return NULL;
+    }
+
+    node = hash_lookup(aug->xfm_filters, name);
+    if (node != NULL) {
+        filter = hnode_get(node);
+        if (filter->xfm == xfm && filter->api_calls == aug->api_calls)
+            return filter;
+        if (filter_current(filter, xfm))
+            goto done;
+    } else {
+        if (ALLOC(filter) < 0)
+            return NULL;
+        filter->name = strdup(name);
+        if (filter->name == NULL
+            || hash_alloc_insert(aug->xfm_filters, filter->name, filter) < 0) {
+            free_xfm_filter(filter);
+            return NULL;
+        }
+    }
+
+    if (filter_compile(filter, xfm) < 0)
+        return NULL;
+ done:
+    filter->xfm = xfm;
+    filter->api_calls = aug->api_calls;
+    return filter;
+}
+
+/* Return 1 if FA accepts S, 0 if it doesn't or FA is NULL, and -1 if
+ * we run out of memory */
+static int filter_fa_match(struct fa *fa, const char *s) {
+    if (fa == NULL)
+        return 0;
+    return fa_match(fa, s, strlen(s));
+}
+
+/* Return 1 if PATH matches one of the globs of FILTER with EXCLUDE, 0 if
+ * it doesn't, and -1 on error */
+static int filter_globs_match(struct xfm_filter *filter, bool exclude,
+                              const char *path) {
+    if (filter->compiled) {
+        int r;
+        if (! exclude)
+            return filter_fa_match(filter->incl, path);
+        r = filter_fa_match(filter->excl, path);
+        if (r == 0)
+            r = filter_fa_match(filter->excl_base, pathbase(path));
+        return r;
+    }
+
+    for (int i=0; i < filter->nglobs; i++) {
+        struct filter_glob *g = filter->globs + i;
+        if (g->exclude != exclude)
+            continue;
+        const char *s = g->base ? pathbase(path) : path;
+        if (fnmatch(g->norm, s, fnm_flags) == 0)
+            return 1;
+    }
+    return 0;
+}
+
 static bool file_current(struct augeas *aug, const char *fname,
                          struct tree *finfo) {
     struct tree *mtime = tree_child(finfo, s_mtime);
@@ -201,8 +533,10 @@ static bool file_current(struct augeas *aug, const char *fname,
     return (file != NULL && ! file->dirty);
 }
 
-static int filter_generate(struct tree *xfm, const char *root,
+static int filter_generate(struct augeas *aug, struct tree *xfm,
                            int *nmatches, char ***matches) {
+    const char *root = aug->root;
+    struct xfm_filter *filter = NULL;
     glob_t globbuf;
     int gl_flags = glob_flags;
     int r;
@@ -215,6 +549,10 @@ static int filter_generate(struct tree *xfm, const char *root,
     *matches = NULL;
     MEMZERO(&globbuf, 1);
 
+    filter = xfm_filter(aug, xfm);
+    if (filter == NULL)
+        goto error;
+
     list_for_each(f, xfm->children) {
         char *globpat = NULL;
         if (! is_incl(f))
@@ -236,21 +574,12 @@ static int filter_generate(struct tree *xfm, const char *root,
 
     for (int i=0; i < pathc; i++) {
         const char *path = globbuf.gl_pathv[i] + root_prefix;
-        bool include = true;
-
-        list_for_each(e, xfm->children) {
-            if (! is_excl(e))
-                continue;
+        bool include;
 
-            if (strchr(e->value, SEP) == NULL)
-                path = pathbase(path);
-
-            r = fnmatch_normalize(e->value, path, fnm_flags);
-            if (r < 0)
-                goto error;
-            else if (r == 0)
-                include = false;
-        }
+        r = filter_globs_match(filter, true, path);
+        if (r < 0)
+            goto error;
+        include = (r == 0);
 
         if (include)
             include = is_regular_file(globbuf.gl_pathv[i]);
@@ -281,21 +610,20 @@ static int filter_generate(struct tree *xfm, const char *root,
     goto done;
 }
 
-static int filter_matches(struct tree *xfm, const char *path) {
-    int found = 0;
-    list_for_each(f, xfm->children) {
-        if (is_incl(f) && fnmatch_normalize(f->value, path, fnm_flags) == 0) {
-            found = 1;
-            break;
-        }
-    }
-    if (! found)
-        return 0;
-    list_for_each(f, xfm->children) {
-        if (is_excl(f) && (fnmatch_normalize(f->value, path, fnm_flags) == 0))
-            return 0;
-    }
-    return 1;
+static int filter_matches(struct augeas *aug, struct tree *xfm,
+                          const char *path) {
+    struct xfm_filter *filter = xfm_filter(aug, xfm);
+    int r;
+
+    if (filter == NULL)
+        return -1;
+    r = filter_globs_match(filter, false, path);
+    if (r <= 0)
+        return r;
+    r = filter_globs_match(filter, true, path);
+    if (r < 0)
+        return r;
+    return r == 0;
 }
 
 /*
@@ -426,6 +754,42 @@ static int store_error(struct augeas *aug,
     return result;
 }
 
+/* Record under /augeas/files/FILENAME/warning that the file was saved,
+ * but that making the save durable failed with ERRNUM, or remove the
+ * warning if ERRNUM is 0 */
+static int store_sync_warning(struct augeas *aug, const char *filename,
+                              int errnum) {
+    struct tree *finfo = NULL, *warn = NULL;
+    char *fip = NULL;
+    int r;
+    int result = -1;
+
+    r = pathjoin(&fip, 2, AUGEAS_META_FILES, filename);
+    ERR_NOMEM(r < 0, aug);
+
+    finfo = tree_fpath_cr(aug, fip);
+    ERR_BAIL(aug);
+
+    if (errnum != 0) {
+        warn = tree_child_cr(finfo, s_warning);
+        ERR_NOMEM(warn == NULL, aug);
+
+        r = tree_set_value(warn, "sync_dir");
+        ERR_NOMEM(r < 0, aug);
+        err_set(aug, warn, s_message, "%s", strerror(errnum));
+    } else {
+        warn = tree_child(finfo, s_warning);
+        if (warn != NULL)
+            tree_unlink(aug, warn);
+    }
+
+    tree_clean(finfo);
+    result = 0;
+ error:
+    free(fip);
+    return result;
+}
+
 /* Set up the file information in the /augeas tree.
  *
  * NODE must be the path to the file contents, and start with /files.
@@ -484,6 +848,11 @@ static int add_file_info(struct augeas *aug, const char *node,
     r = tree_set_value(tree, lens_name);
     ERR_NOMEM(r < 0, aug);
 
+    /* Any diff from an earlier AUG_SAVE_NOOP is out of date now */
+    tree = tree_child(file, s_diff);
+    if (tree != NULL)
+        tree_unlink(aug, tree);
+
     tree_clean(file);
 
     result = 0;
@@ -806,7 +1175,7 @@ int transform_load(struct augeas *aug, struct tree *xfm) {
         // FIXME: Record an error and return 0
         return -1;
     }
-    r = filter_generate(xfm, aug->root, &nmatches, &matches);
+    r = filter_generate(aug, xfm, &nmatches, &matches);
     if (r == -1)
         return -1;
     for (int i=0; i < nmatches; i++) {
@@ -833,11 +1202,12 @@ int transform_load(struct augeas *aug, struct tree *xfm) {
     return 0;
 }
 
-int transform_applies(struct tree *xfm, const char *path) {
+int transform_applies(struct augeas *aug, struct tree *xfm,
+                      const char *path) {
     if (STRNEQLEN(path, AUGEAS_FILES_TREE, strlen(AUGEAS_FILES_TREE))
         || path[strlen(AUGEAS_FILES_TREE)] != SEP)
         return 0;
-    return filter_matches(xfm, path + strlen(AUGEAS_FILES_TREE));
+    return filter_matches(aug, xfm, path + strlen(AUGEAS_FILES_TREE));
 }
 
 static int transfer_file_attrs(FILE *from, FILE *to,
@@ -1013,129 +1383,460 @@ static int file_saved_event(struct augeas *aug, const char *path) {
 }
 
 /*
- * Save TREE->CHILDREN into the file PATH using the lens from XFORM. Errors
- * are noted in the /augeas/files hierarchy in AUG->ORIGIN under
- * PATH/error.
- *
- * Writing the file happens by first writing into a temp file, transferring all
- * file attributes of PATH to the temp file, and then renaming the temp file
- * back to PATH.
- *
- * Temp files are created alongside the destination file to enable the rename,
- * which may be the canonical path (PATH_canon) if PATH is a symlink.
- *
- * If the AUG_SAVE_NEWFILE flag is set, instead rename to PATH.augnew rather
- * than PATH.  If AUG_SAVE_BACKUP is set, move the original to PATH.augsave.
- * (Always PATH.aug{new,save} irrespective of whether PATH is a symlink.)
- *
- * If the rename fails, and the entry AUGEAS_COPY_IF_FAILURE exists in
- * AUG->ORIGIN, PATH is instead overwritten by copying file contents.
- *
- * The table below shows the locations for each permutation.
- *
- * PATH       save flag    temp file           dest file      backup?
- * regular    -            PATH.XXXX           PATH           -
- * regular    BACKUP       PATH.XXXX           PATH           PATH.augsave
- * regular    NEWFILE      PATH.augnew.XXXX    PATH.augnew    -
- * symlink    -            PATH_canon.XXXX     PATH_canon     -
- * symlink    BACKUP       PATH_canon.XXXX     PATH_canon     PATH.augsave
- * symlink    NEWFILE      PATH.augnew.XXXX    PATH.augnew    -
- *
- * Return 0 on success, -1 on failure.
+ * Diffs for AUG_SAVE_NOOP
  */
-int transform_save(struct augeas *aug, struct tree *xfm,
-                   const char *path, struct tree *tree) {
-    int   fd;
-    FILE *fp = NULL, *augorig_canon_fp = NULL;
-    char *augtemp = NULL, *augnew = NULL, *augorig = NULL, *augsave = NULL;
-    char *augorig_canon = NULL, *augdest = NULL;
-    int   augorig_exists;
-    int   copy_if_rename_fails = 0;
-    char *text = NULL;
-    const char *filename = path + strlen(AUGEAS_FILES_TREE) + 1;
-    const char *err_status = NULL;
-    char *dyn_err_status = NULL;
-    struct lns_error *err = NULL;
-    const char *lens_name;
-    struct lens *lens = xfm_lens(aug, xfm, &lens_name);
-    int result = -1, r;
-    bool force_reload;
+
+/* A line of a file we compute a diff for; TEXT is not NUL terminated,
+ * and LEN includes the newline, if the line has one */
+struct diff_line {
+    const char   *text;
+    size_t        len;
+    unsigned int  hash;
+};
+
+/* Stop looking for a shortest edit script after this many edits and
+ * report whatever is left of the changed region as replaced */
+#define DIFF_MAX_EDITS 1024
+/* The number of unchanged lines shown around each change */
+#define DIFF_CONTEXT 3
+
+static int diff_split(const char *text, size_t size,
+                      struct diff_line **lines, long *nlines) {
+    const char *end = text + size;
+    long n = 0;
+
+    for (const char *s = text; s < end; n++) {
+        const char *nl = memchr(s, '\n', end - s);
+        s = (nl == NULL) ? end : nl + 1;
+    }
+    *nlines = n;
+    if (ALLOC_N(*lines, n + 1) < 0)
+        return -1;
+
+    for (long i=0; i < n; i++) {
+        struct diff_line *line = *lines + i;
+        const char *nl = memchr(text, '\n', end - text);
+        unsigned int h = 5381;
+
+        line->text = text;
+        line->len = (nl == NULL) ? (size_t) (end - text) : nl + 1 - text;
+        for (size_t c=0; c < line->len; c++)
+            h = h * 33 + (unsigned char) text[c];
+        line->hash = h;
+        text += line->len;
+    }
+    return 0;
+}
+
+static bool diff_line_eq(const struct diff_line *a,
+                         const struct diff_line *b) {
+    return a->hash == b->hash && a->len == b->len
+        && memcmp(a->text, b->text, a->len) == 0;
+}
+
+/* The first point on diagonal K of step D of Myers' algorithm, before
+ * following the snake, given the furthest points PREV of step D-1.
+ * Return -1 if diagonal K can not be reached in step D. Set *DELETE to
+ * whether that point is reached by deleting a line from A, rather than
+ * inserting a line from B */
+static long diff_step(const long *prev, long d, long k, long n, long m,
+                      bool *delete) {
+    long del_x = -1, ins_x = -1;
+
+    *delete = false;
+    if (d == 0)
+        return 0;
+    if (k > -d && prev[k - 1 + d - 1] >= 0 && prev[k - 1 + d - 1] < n)
+        del_x = prev[k - 1 + d - 1] + 1;
+    if (k < d && prev[k + 1 + d - 1] >= 0
+        && prev[k + 1 + d - 1] - (k + 1) < m)
+        ins_x = prev[k + 1 + d - 1];
+    *delete = del_x >= ins_x;
+    return *delete ? del_x : ins_x;
+}
+
+/* Mark the lines of A that have to be deleted in DEL and the lines of B
+ * that have to be inserted in INS to turn A into B with as few edits as
+ * possible. If that takes more than DIFF_MAX_EDITS edits, replace all of
+ * A by all of B. The furthest point reached on diagonal K in step D is
+ * kept in TRACE[D*D + K + D] so that we can retrace the edits */
+static int diff_edits(const struct diff_line *a, long n,
+                      const struct diff_line *b, long m,
+                      bool *del, bool *ins) {
+    long *trace = NULL;
+    size_t size = 0;
+    long d, x, y, k;
+    bool delete;
+
+    for (d = 0; d <= DIFF_MAX_EDITS; d++) {
+        size_t need = (d + 1) * (d + 1);
+        long *cur, *prev;
+
+        if (need > size) {
+            size_t nsize = (size == 0) ? 64 : 2 * size;
+            while (nsize < need)
+                nsize *= 2;
+            if (REALLOC_N(trace, nsize) < 0)
+                goto error;
+            size = nsize;
+        }
+        cur = trace + d * d;
+        prev = (d == 0) ? NULL : trace + (d - 1) * (d - 1);
+
+        for (k = -d; k <= d; k += 2) {
+            x = diff_step(prev, d, k, n, m, &delete);
+            if (x >= 0) {
+                for (y = x - k; x < n && y < m && diff_line_eq(a + x, b + y);
+                     x++, y++);
+            }
+            cur[k + d] = x;
+            if (x == n && x - k == m)
+                goto found;
+        }
+    }
+
+    /* Too many changes; just replace everything */
+    for (long i=0; i < n; i++)
+        del[i] = true;
+    for (long j=0; j < m; j++)
+        ins[j] = true;
+    free(trace);
+    return 0;
+
+ found:
+    x = n;
+    y = m;
+    for (; d > 0; d--) {
+        long *prev = trace + (d - 1) * (d - 1);
+        k = x - y;
+        diff_step(prev, d, k, n, m, &delete);
+        if (delete) {
+            x = prev[k - 1 + d - 1];
+            y = x - (k - 1);
+            del[x] = true;
+        } else {
+            x = prev[k + 1 + d - 1];
+            y = x - (k + 1);
+            ins[y] = true;
+        }
+    }
+    free(trace);
+    return 0;
+ error:
+    free(trace);
+    return -1;
+}
+
+static void diff_print_line(FILE *out, char prefix,
+                            const struct diff_line *line) {
+    fputc(prefix, out);
+    fwrite(line->text, 1, line->len, out);
+    if (line->len == 0 || line->text[line->len - 1] != '\n')
+        fputs("\n\\ No newline at end of file\n", out);
+}
+
+static void diff_print_range(FILE *out, long start, long count) {
+    if (count == 1)
+        fprintf(out, "%ld", start + 1);
+    else if (count == 0)
+        fprintf(out, "%ld,0", start);
+    else
+        fprintf(out, "%ld,%ld", start + 1, count);
+}
+
+/* Print the hunks of the diff between A and B, given the lines marked in
+ * DEL and INS, in unified format */
+static void diff_print_hunks(FILE *out,
+                             const struct diff_line *a, long na,
+                             const struct diff_line *b, long nb,
+                             const bool *del, const bool *ins) {
+    long i = 0, j = 0;
+
+    for (;;) {
+        long a0, b0, ctx;
+
+        while (i < na && j < nb && !del[i] && !ins[j]) {
+            i++;
+            j++;
+        }
+        if (i == na && j == nb)
+            break;
+
+        /* Extend the hunk over all changes that are separated by no more
+         * than 2 * DIFF_CONTEXT unchanged lines */
+        ctx = (i < DIFF_CONTEXT) ? i : DIFF_CONTEXT;
+        a0 = i - ctx;
+        b0 = j - ctx;
+        for (;;) {
+            long eq = 0;
+            while (i < na && del[i])
+                i++;
+            while (j < nb && ins[j])
+                j++;
+            while (i + eq < na && j + eq < nb && !del[i + eq] && !ins[j + eq])
+                eq++;
+            if ((i + eq == na && j + eq == nb) || eq > 2 * DIFF_CONTEXT) {
+                ctx = (eq < DIFF_CONTEXT) ? eq : DIFF_CONTEXT;
+                i += ctx;
+                j += ctx;
+                break;
+            }
+            i += eq;
+            j += eq;
+        }
+
+        fputs("@@ -", out);
+        diff_print_range(out, a0, i - a0);
+        fputs(" +", out);
+        diff_print_range(out, b0, j - b0);
+        fputs(" @@\n", out);
+        for (long x = a0, y = b0; x < i || y < j; ) {
+            if (x < i && del[x])
+                diff_print_line(out, '-', a + x++);
+            else if (y < j && ins[y])
+                diff_print_line(out, '+', b + y++);
+            else {
+                diff_print_line(out, ' ', a + x++);
+                y++;
+            }
+        }
+    }
+}
+
+/* Return the differences between the text A of the file FROM and the
+ * text B of the file TO as a unified diff, or NULL if we run out of
+ * memory. Nothing is read from or written to disk */
+static char *text_diff(const char *from, const char *a, size_t asize,
+                       const char *to, const char *b, size_t bsize) {
+    struct diff_line *la = NULL, *lb = NULL;
+    bool *del = NULL, *ins = NULL;
+    long na, nb, pre = 0, suf = 0;
+    struct memstream ms;
+    char *result = NULL;
+    int r;
+
+    if (diff_split(a, asize, &la, &na) < 0
+        || diff_split(b, bsize, &lb, &nb) < 0)
+        goto done;
+    if (ALLOC_N(del, na + 1) < 0 || ALLOC_N(ins, nb + 1) < 0)
+        goto done;
+
+    /* Only run the diff algorithm on the part between the unchanged
+     * lines at the start and at the end */
+    while (pre < na && pre < nb && diff_line_eq(la + pre, lb + pre))
+        pre++;
+    while (suf < na - pre && suf < nb - pre
+           && diff_line_eq(la + na - suf - 1, lb + nb - suf - 1))
+        suf++;
+    r = diff_edits(la + pre, na - pre - suf, lb + pre, nb - pre - suf,
+                   del + pre, ins + pre);
+    if (r < 0)
+        goto done;
+
+    r = init_memstream(&ms);
+    if (r < 0)
+        goto done;
+    fprintf(ms.stream, "--- %s\n+++ %s\n", from, to);
+    diff_print_hunks(ms.stream, la, na, lb, nb, del, ins);
+    r = close_memstream(&ms);
+    if (r < 0)
+        goto done;
+    result = ms.buf;
+ done:
+    free(la);
+    free(lb);
+    free(del);
+    free(ins);
+    return result;
+}
+
+/* Record *DIFF underneath the metadata of the file whose tree is at PATH,
+ * or remove the diff recorded there if *DIFF is NULL. The tree takes
+ * ownership of *DIFF */
+static int store_diff(struct augeas *aug, const char *path, char **diff) {
+    struct tree *file, *tree;
+    char *fip = NULL;
+    int r, result = -1;
+
+    r = pathjoin(&fip, 2, AUGEAS_META_TREE, path);
+    ERR_NOMEM(r < 0, aug);
+
+    file = tree_fpath_cr(aug, fip);
+    ERR_BAIL(aug);
+
+    if (*diff == NULL) {
+        tree = tree_child(file, s_diff);
+        if (tree != NULL)
+            tree_unlink(aug, tree);
+    } else {
+        tree = tree_child_cr(file, s_diff);
+        ERR_NOMEM(tree == NULL, aug);
+        tree_store_value(tree, diff);
+    }
+
+    result = 0;
+ error:
+    free(fip);
+    return result;
+}
+
+/* The state of saving one file. Saving is split into three steps:
+ * SAVE_PREPARE reads the original file, renders the output of the lens in
+ * memory and, if it differs from the original, writes it into a temp file,
+ * SAVE_WRITE flushes the temp file to disk and moves it into place, and
+ * SAVE_FINISH records the outcome in the tree.
+ * Only SAVE_WRITE is safe to run outside the thread that owns AUG, since
+ * it does nothing but file I/O.
+ */
+struct save_job {
+    const struct save_file *file;
+    struct lens      *lens;
+    const char       *lens_name;
+    unsigned int      flags;          /* Copy of AUG->FLAGS */
+    int               copy_if_rename_fails;
+    int               augorig_exists;
+    bool              sync_temp;      /* Fsync the temp file in SAVE_WRITE */
+    char             *text;
+    size_t            text_size;      /* Length of TEXT as read from disk */
+    char             *new_text;       /* The output of the lens */
+    size_t            new_size;
+    char             *diff;           /* What AUG_SAVE_NOOP would change */
+    char             *augtemp;
+    char             *augnew;
+    char             *augorig;
+    char             *augorig_canon;
+    char             *augsave;
+    const char       *augdest;        /* One of AUGNEW or AUGORIG_CANON */
+    FILE             *fp;             /* The temp file */
+    struct lns_error *err;
+    const char       *err_status;
+    char             *dyn_err_status;
+    int               errnum;
+    int               sync_errnum;    /* Syncing the directory failed
+                                       * after the file was saved */
+    int               result;
+    bool              finished;       /* No need to run SAVE_WRITE */
+};
+
+static void save_prepare(struct augeas *aug, struct save_job *job) {
+    const char *filename = job->file->path + strlen(AUGEAS_FILES_TREE) + 1;
+    FILE *augorig_canon_fp = NULL;
+    int fd, r;
 
     errno = 0;
+    job->result = -1;
+    job->finished = true;
+    job->flags = aug->flags;
 
-    if (lens == NULL) {
-        err_status = "lens_name";
+    job->lens = xfm_lens(aug, job->file->xfm, &job->lens_name);
+    if (job->lens == NULL) {
+        job->err_status = "lens_name";
         goto done;
     }
 
-    copy_if_rename_fails =
+    job->copy_if_rename_fails =
         aug_get(aug, AUGEAS_COPY_IF_RENAME_FAILS, NULL) == 1;
 
-    if (asprintf(&augorig, "%s%s", aug->root, filename) == -1) {
-        augorig = NULL;
+    if (asprintf(&job->augorig, "%s%s", aug->root, filename) == -1) {
+        job->augorig = NULL;
         goto done;
     }
 
-    augorig_canon = canonicalize_file_name(augorig);
-    augorig_exists = 1;
-    if (augorig_canon == NULL) {
+    job->augorig_canon = canonicalize_file_name(job->augorig);
+    job->augorig_exists = 1;
+    if (job->augorig_canon == NULL) {
         if (errno == ENOENT) {
-            augorig_canon = augorig;
-            augorig_exists = 0;
+            job->augorig_canon = job->augorig;
+            job->augorig_exists = 0;
         } else {
-            err_status = "canon_augorig";
+            job->err_status = "canon_augorig";
             goto done;
         }
     }
 
-    if (access(augorig_canon, R_OK) == 0) {
-        augorig_canon_fp = fopen(augorig_canon, "r");
-        text = xfread_file(augorig_canon_fp);
+    if (access(job->augorig_canon, R_OK) == 0) {
+        augorig_canon_fp = fopen(job->augorig_canon, "r");
+        job->text = xfread_file(augorig_canon_fp);
     } else {
-        text = strdup("");
+        job->text = strdup("");
     }
 
-    if (text == NULL) {
-        err_status = "put_read";
+    if (job->text == NULL) {
+        job->err_status = "put_read";
         goto done;
     }
 
-    text = append_newline(text, strlen(text));
+    job->text_size = strlen(job->text);
+    job->text = append_newline(job->text, job->text_size);
+
+    /* Render the file in memory first; files whose text does not change
+     * need neither a temp file nor a sync */
+    r = lns_put(job->lens,
+                job->file->tree == NULL ? NULL : job->file->tree->children,
+                job->text, &job->new_text, &job->new_size, &job->err);
+    if (r < 0) {
+        job->err_status = "put_oom";
+        goto done;
+    }
+
+    if (job->err != NULL) {
+        job->err_status =
+            job->err->pos >= 0 ? "parse_skel_failed" : "put_failed";
+        goto done;
+    }
+
+    if (job->new_size == strlen(job->text)
+        && memcmp(job->new_text, job->text, job->new_size) == 0) {
+        job->result = 0;
+        goto done;
+    } else if (aug->flags & AUG_SAVE_NOOP) {
+        const char *fname = job->file->path + strlen(AUGEAS_FILES_TREE);
+        job->diff = text_diff(job->augorig_exists ? fname : "/dev/null",
+                              job->text, job->text_size,
+                              fname, job->new_text, job->new_size);
+        if (job->diff == NULL) {
+            job->err_status = "diff";
+            goto done;
+        }
+        job->result = 1;
+        goto done;
+    }
 
     /* Figure out where to put the .augnew and temp file. If no .augnew file
        then put the temp file next to augorig_canon, else next to .augnew. */
     if (aug->flags & AUG_SAVE_NEWFILE) {
-        if (xasprintf(&augnew, "%s" EXT_AUGNEW, augorig) < 0) {
-            err_status = "augnew_oom";
+        if (xasprintf(&job->augnew, "%s" EXT_AUGNEW, job->augorig) < 0) {
+            job->err_status = "augnew_oom";
             goto done;
         }
-        augdest = augnew;
+        job->augdest = job->augnew;
     } else {
-        augdest = augorig_canon;
+        job->augdest = job->augorig_canon;
     }
 
-    if (xasprintf(&augtemp, "%s.XXXXXX", augdest) < 0) {
-        err_status = "augtemp_oom";
+    if (xasprintf(&job->augtemp, "%s.XXXXXX", job->augdest) < 0) {
+        job->err_status = "augtemp_oom";
         goto done;
     }
 
     // FIXME: We might have to create intermediate directories
     // to be able to write augnew, but we have no idea what permissions
     // etc. they should get. Just the process default ?
-    fd = mkstemp(augtemp);
+    fd = mkstemp(job->augtemp);
     if (fd < 0) {
-        err_status = "mk_augtemp";
+        job->err_status = "mk_augtemp";
         goto done;
     }
-    fp = fdopen(fd, "w");
-    if (fp == NULL) {
-        err_status = "open_augtemp";
+    job->fp = fdopen(fd, "w");
+    if (job->fp == NULL) {
+        job->err_status = "open_augtemp";
         goto done;
     }
 
-    if (augorig_exists) {
-        if (transfer_file_attrs(augorig_canon_fp, fp, &err_status) != 0) {
-            err_status = "xfer_attrs";
+    if (job->augorig_exists) {
+        if (transfer_file_attrs(augorig_canon_fp, job->fp,
+                                &job->err_status) != 0) {
+            job->err_status = "xfer_attrs";
             goto done;
         }
     } else {
@@ -1144,137 +1845,447 @@ int transform_save(struct augeas *aug, struct tree *xfm,
         mode_t curumsk = umask(022);
         umask(curumsk);
 
-        if (fchmod(fileno(fp), 0666 & ~curumsk) < 0) {
-            err_status = "create_chmod";
-            return -1;
+        if (fchmod(fileno(job->fp), 0666 & ~curumsk) < 0) {
+            job->err_status = "create_chmod";
+            goto done;
         }
     }
 
-    if (tree != NULL)
-        lns_put(fp, lens, tree->children, text, &err);
-
-    if (ferror(fp)) {
-        err_status = "error_augtemp";
+    if (fwrite(job->new_text, 1, job->new_size, job->fp) != job->new_size
+        || ferror(job->fp)) {
+        job->err_status = "error_augtemp";
         goto done;
     }
 
-    if (fflush(fp) != 0) {
-        err_status = "flush_augtemp";
+    if (fflush(job->fp) != 0) {
+        job->err_status = "flush_augtemp";
         goto done;
     }
 
-    if (fsync(fileno(fp)) < 0) {
-        err_status = "sync_augtemp";
-        goto done;
-    }
+    job->finished = false;
+ done:
+    job->errnum = errno;
+    if (augorig_canon_fp != NULL)
+        fclose(augorig_canon_fp);
+}
 
-    if (fclose(fp) != 0) {
-        err_status = "close_augtemp";
-        fp = NULL;
-        goto done;
-    }
+static void save_write(struct save_job *job) {
+    FILE *fp = job->fp;
+    int r;
 
-    fp = NULL;
+    errno = 0;
+    job->fp = NULL;
 
-    if (err != NULL) {
-        err_status = err->pos >= 0 ? "parse_skel_failed" : "put_failed";
-        unlink(augtemp);
+    if (job->sync_temp && fsync(fileno(fp)) < 0) {
+        job->err_status = "sync_augtemp";
+        fclose(fp);
         goto done;
     }
 
-    {
-        char *new_text = xread_file(augtemp);
-        int same = 0;
-        if (new_text == NULL) {
-            err_status = "read_augtemp";
-            goto done;
-        }
-        same = STREQ(text, new_text);
-        FREE(new_text);
-        if (same) {
-            result = 0;
-            unlink(augtemp);
-            goto done;
-        } else if (aug->flags & AUG_SAVE_NOOP) {
-            result = 1;
-            unlink(augtemp);
-            goto done;
-        }
+    if (fclose(fp) != 0) {
+        job->err_status = "close_augtemp";
+        goto done;
     }
 
-    if (!(aug->flags & AUG_SAVE_NEWFILE)) {
-        if (augorig_exists && (aug->flags & AUG_SAVE_BACKUP)) {
-            r = xasprintf(&augsave, "%s" EXT_AUGSAVE, augorig);
+    if (!(job->flags & AUG_SAVE_NEWFILE)) {
+        if (job->augorig_exists && (job->flags & AUG_SAVE_BACKUP)) {
+            r = xasprintf(&job->augsave, "%s" EXT_AUGSAVE, job->augorig);
             if (r == -1) {
-                augsave = NULL;
+                job->augsave = NULL;
                 goto done;
             }
 
-            r = clone_file(augorig_canon, augsave, &err_status, 1, 1);
+            r = clone_file(job->augorig_canon, job->augsave,
+                           &job->err_status, 1, 1);
             if (r != 0) {
-                dyn_err_status = strappend(err_status, "_augsave");
+                job->dyn_err_status = strappend(job->err_status, "_augsave");
                 goto done;
             }
         }
     }
 
-    r = clone_file(augtemp, augdest, &err_status, copy_if_rename_fails, 0);
+    r = clone_file(job->augtemp, job->augdest, &job->err_status,
+                   job->copy_if_rename_fails, 0);
     if (r != 0) {
-        dyn_err_status = strappend(err_status, "_augtemp");
+        job->dyn_err_status = strappend(job->err_status, "_augtemp");
         goto done;
     }
 
-    result = 1;
-
+    job->result = 1;
  done:
-    force_reload = aug->flags & AUG_SAVE_NEWFILE;
-    r = add_file_info(aug, path, lens, lens_name, augorig, force_reload);
+    job->errnum = errno;
+    job->finished = true;
+}
+
+static int save_finish(struct augeas *aug, struct save_job *job) {
+    const char *path = job->file->path;
+    const char *filename = path + strlen(AUGEAS_FILES_TREE) + 1;
+    bool force_reload;
+    int r;
+
+    force_reload = job->flags & AUG_SAVE_NEWFILE;
+    r = add_file_info(aug, path, job->lens, job->lens_name, job->augorig,
+                      force_reload);
     if (r < 0) {
-        err_status = "file_info";
-        result = -1;
+        job->err_status = "file_info";
+        job->result = -1;
     }
-    if (result > 0) {
+    /* A file that a noop save would not change has no diff, even if an
+     * earlier noop save recorded one */
+    if ((job->flags & AUG_SAVE_NOOP) && job->result >= 0) {
+        r = store_diff(aug, path, &job->diff);
+        if (r < 0) {
+            job->err_status = "diff";
+            job->result = -1;
+        }
+    }
+    if (job->result > 0) {
         r = file_saved_event(aug, path);
         if (r < 0) {
-            err_status = "saved_event";
-            result = -1;
+            job->err_status = "saved_event";
+            job->result = -1;
         }
     }
     {
-        const char *emsg =
-            dyn_err_status == NULL ? err_status : dyn_err_status;
-        store_error(aug, filename, path, emsg, errno, err, text);
+        const char *emsg = job->dyn_err_status == NULL ?
+            job->err_status : job->dyn_err_status;
+        store_error(aug, filename, path, emsg, job->errnum, job->err,
+                    job->text);
+    }
+    store_sync_warning(aug, filename, job->sync_errnum);
+    free(job->dyn_err_status);
+    lens_release(job->lens);
+    free(job->text);
+    free(job->new_text);
+    free(job->diff);
+    free(job->augtemp);
+    free(job->augnew);
+    if (job->augorig_canon != job->augorig)
+        free(job->augorig_canon);
+    free(job->augorig);
+    free(job->augsave);
+    free_lns_error(job->err);
+
+    if (job->fp != NULL)
+        fclose(job->fp);
+    return job->result;
+}
+
+#if HAVE_PTHREAD
+/* Hand out the jobs in POOL to the threads running SAVE_WORKER */
+struct save_pool {
+    struct save_job *jobs;
+    size_t           njobs;
+    size_t           next;
+    pthread_mutex_t  lock;
+};
+
+static void *save_worker(void *arg) {
+    struct save_pool *pool = arg;
+
+    for (;;) {
+        size_t i;
+
+        pthread_mutex_lock(&pool->lock);
+        i = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (i >= pool->njobs)
+            break;
+        if (! pool->jobs[i].finished)
+            save_write(pool->jobs + i);
     }
-    free(dyn_err_status);
-    lens_release(lens);
-    free(text);
-    free(augtemp);
-    free(augnew);
-    if (augorig_canon != augorig)
-        free(augorig_canon);
-    free(augorig);
-    free(augsave);
-    free_lns_error(err);
+    return NULL;
+}
 
-    if (fp != NULL)
-        fclose(fp);
-    if (augorig_canon_fp != NULL)
-        fclose(augorig_canon_fp);
+/* Run SAVE_WRITE for all unfinished jobs in JOBS, using up to
+ * SAVE_MAX_THREADS threads including the calling one. If we can't start
+ * threads, the calling thread does all the work. */
+static void save_write_all(struct save_job *jobs, size_t njobs) {
+    struct save_pool pool = { .jobs = jobs, .njobs = njobs, .next = 0 };
+    pthread_t threads[SAVE_MAX_THREADS - 1];
+    size_t nthreads = 0, pending = 0;
+
+    for (size_t i=0; i < njobs; i++)
+        if (! jobs[i].finished)
+            pending += 1;
+
+    pthread_mutex_init(&pool.lock, NULL);
+    while (nthreads + 1 < pending && nthreads + 1 < SAVE_MAX_THREADS) {
+        if (pthread_create(threads + nthreads, NULL, save_worker, &pool) != 0)
+            break;
+        nthreads += 1;
+    }
+    save_worker(&pool);
+    for (size_t i=0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&pool.lock);
+}
+#else
+static void save_write_all(struct save_job *jobs, size_t njobs) {
+    for (size_t i=0; i < njobs; i++)
+        if (! jobs[i].finished)
+            save_write(jobs + i);
+}
+#endif
+
+/* Return true if two of the unfinished jobs in JOBS write the same
+ * file, e.g. because of symlinks, in which case they must not be written
+ * concurrently */
+static bool save_jobs_overlap(struct save_job *jobs, size_t njobs) {
+    hash_t *dests = hash_create(HASHCOUNT_T_MAX, NULL, NULL);
+    bool result = true;
+
+    if (dests == NULL)
+        return true;
+
+    for (size_t i=0; i < njobs; i++) {
+        if (jobs[i].finished)
+            continue;
+        if (hash_lookup(dests, jobs[i].augdest) != NULL)
+            goto done;
+        if (hash_alloc_insert(dests, jobs[i].augdest, NULL) < 0)
+            goto done;
+    }
+    result = false;
+ done:
+    hash_free_nodes(dests);
+    hash_destroy(dests);
+    return result;
+}
+
+/* Read the durability mode for saving files from AUGEAS_SAVE_SYNC into
+ * MODE. Return -1 and report an error if the value is not one we know */
+static int save_sync_mode(struct augeas *aug, enum save_sync *mode) {
+    const char *v = NULL;
+    int r;
+
+    *mode = SAVE_SYNC_FILE;
+    r = aug_get(aug, AUGEAS_SAVE_SYNC, &v);
+    if (r == 0 || (r == 1 && v == NULL))
+        return 0;
+
+    if (r == 1 && STREQ(v, AUG_SAVE_SYNC_FILE_TEXT)) {
+        *mode = SAVE_SYNC_FILE;
+    } else if (r == 1 && STREQ(v, AUG_SAVE_SYNC_BATCH_TEXT)) {
+        *mode = SAVE_SYNC_BATCH;
+    } else if (r == 1 && STREQ(v, AUG_SAVE_SYNC_NONE_TEXT)) {
+        *mode = SAVE_SYNC_NONE;
+    } else {
+        ERR_REPORT(aug, AUG_EBADARG,
+                   "%s must be one of '%s', '%s' or '%s'", AUGEAS_SAVE_SYNC,
+                   AUG_SAVE_SYNC_FILE_TEXT, AUG_SAVE_SYNC_BATCH_TEXT,
+                   AUG_SAVE_SYNC_NONE_TEXT);
+        return -1;
+    }
+    return 0;
+}
+
+/* Flush the temp files of all unfinished jobs in JOBS to disk with one
+ * syncfs per file system, so that SAVE_WRITE does not have to fsync them
+ * one by one. Jobs whose file system can not be synced that way, or all
+ * of them if we don't have syncfs, keep syncing their temp file */
+static void save_sync_temps(struct save_job *jobs, size_t njobs) {
+#if HAVE_SYNCFS
+    struct stat *st = NULL;
+    bool *pending = NULL;
+
+    if (ALLOC_N(st, njobs) < 0 || ALLOC_N(pending, njobs) < 0)
+        goto done;
+
+    for (size_t i=0; i < njobs; i++) {
+        pending[i] = ! jobs[i].finished && jobs[i].sync_temp
+            && fstat(fileno(jobs[i].fp), st + i) == 0;
+    }
+
+    for (size_t i=0; i < njobs; i++) {
+        if (! pending[i])
+            continue;
+        if (syncfs(fileno(jobs[i].fp)) < 0)
+            continue;
+        for (size_t j=i; j < njobs; j++) {
+            if (pending[j] && st[j].st_dev == st[i].st_dev) {
+                jobs[j].sync_temp = false;
+                pending[j] = false;
+            }
+        }
+    }
+ done:
+    free(st);
+    free(pending);
+#else
+    (void) jobs;
+    (void) njobs;
+#endif
+}
+
+/* Sync the directory DIR. Return 0 on success, or the errno of the
+ * failure */
+static int sync_dir(const char *dir) {
+    int fd, result = 0;
+
+    fd = open(dir, O_RDONLY);
+    if (fd < 0)
+        return errno;
+    if (fsync(fd) < 0)
+        result = errno;
+    close(fd);
+    return result;
+}
+
+/* Sync the directories that the jobs in JOBS renamed files into, so that
+ * the renames themselves are durable. Each directory is synced only once.
+ * By the time we get here, the files have been renamed into place; a
+ * failure is therefore not a failure to save the file, and is reported
+ * as a warning by SAVE_FINISH */
+static void save_sync_dirs(struct save_job *jobs, size_t njobs) {
+    hash_t *dirs = hash_create(HASHCOUNT_T_MAX, NULL, NULL);
+    hscan_t scan;
+    hnode_t *node;
+
+    for (size_t i=0; i < njobs; i++) {
+        struct save_job *job = jobs + i;
+        const char *dests[] = { job->augdest, job->augsave };
+
+        if (job->result <= 0 || (job->flags & AUG_SAVE_NOOP))
+            continue;
+
+        for (size_t k=0; k < ARRAY_CARDINALITY(dests); k++) {
+            const char *slash;
+            char *dir;
+            int errnum;
+
+            if (dests[k] == NULL || (slash = strrchr(dests[k], SEP)) == NULL)
+                continue;
+            dir = strndup(dests[k], slash == dests[k] ? 1 : slash - dests[k]);
+            if (dir == NULL) {
+                errnum = ENOMEM;
+            } else if (dirs != NULL
+                       && (node = hash_lookup(dirs, dir)) != NULL) {
+                errnum = (intptr_t) hnode_get(node);
+                free(dir);
+            } else {
+                errnum = sync_dir(dir);
+                if (dirs == NULL
+                    || hash_alloc_insert(dirs, dir,
+                                         (void *) (intptr_t) errnum) < 0)
+                    free(dir);
+            }
+            if (errnum != 0) {
+                job->sync_errnum = errnum;
+                break;
+            }
+        }
+    }
+
+    if (dirs == NULL)
+        return;
+    hash_scan_begin(&scan, dirs);
+    while ((node = hash_scan_next(&scan)) != NULL)
+        free((char *) hnode_getkey(node));
+    hash_free_nodes(dirs);
+    hash_destroy(dirs);
+}
+
+/*
+ * For each FILE in FILES, save FILE->TREE->CHILDREN into the file
+ * FILE->PATH using the lens from FILE->XFM. Errors are noted in the
+ * /augeas/files hierarchy in AUG->ORIGIN under PATH/error.
+ *
+ * Writing the file happens by first writing into a temp file, transferring all
+ * file attributes of PATH to the temp file, and then renaming the temp file
+ * back to PATH.
+ *
+ * Temp files are created alongside the destination file to enable the rename,
+ * which may be the canonical path (PATH_canon) if PATH is a symlink.
+ *
+ * If the AUG_SAVE_NEWFILE flag is set, instead rename to PATH.augnew rather
+ * than PATH.  If AUG_SAVE_BACKUP is set, move the original to PATH.augsave.
+ * (Always PATH.aug{new,save} irrespective of whether PATH is a symlink.)
+ *
+ * If the rename fails, and the entry AUGEAS_COPY_IF_FAILURE exists in
+ * AUG->ORIGIN, PATH is instead overwritten by copying file contents.
+ *
+ * The table below shows the locations for each permutation.
+ *
+ * PATH       save flag    temp file           dest file      backup?
+ * regular    -            PATH.XXXX           PATH           -
+ * regular    BACKUP       PATH.XXXX           PATH           PATH.augsave
+ * regular    NEWFILE      PATH.augnew.XXXX    PATH.augnew    -
+ * symlink    -            PATH_canon.XXXX     PATH_canon     -
+ * symlink    BACKUP       PATH_canon.XXXX     PATH_canon     PATH.augsave
+ * symlink    NEWFILE      PATH.augnew.XXXX    PATH.augnew    -
+ *
+ * Flushing and moving the temp files into place is done by up to
+ * SAVE_MAX_THREADS threads in parallel, unless two files in the same batch
+ * would be written to the same destination.
+ *
+ * How the files are made durable depends on AUGEAS_SAVE_SYNC: by default
+ * every temp file is synced before it is renamed; in 'batch' mode the temp
+ * files of each batch are flushed with syncfs before they are renamed, and
+ * the directories they were renamed into are synced afterwards.
+ *
+ * Return 0 on success, -1 on failure.
+ */
+int transform_save_files(struct augeas *aug, struct save_file *files,
+                         size_t nfiles) {
+    struct save_job *jobs = NULL;
+    enum save_sync sync;
+    int result = 0;
+
+    if (save_sync_mode(aug, &sync) < 0)
+        return -1;
+
+    if (ALLOC_N(jobs, SAVE_BATCH_SIZE) < 0)
+        return -1;
+
+    /* Work in batches so that we do not run out of file descriptors for
+     * the temp files that are open between SAVE_PREPARE and SAVE_WRITE */
+    for (size_t start = 0; start < nfiles; start += SAVE_BATCH_SIZE) {
+        size_t njobs = nfiles - start;
+        if (njobs > SAVE_BATCH_SIZE)
+            njobs = SAVE_BATCH_SIZE;
+
+        MEMZERO(jobs, njobs);
+        for (size_t i=0; i < njobs; i++) {
+            jobs[i].file = files + start + i;
+            jobs[i].sync_temp = (sync != SAVE_SYNC_NONE);
+            save_prepare(aug, jobs + i);
+        }
+
+        if (sync == SAVE_SYNC_BATCH)
+            save_sync_temps(jobs, njobs);
+
+        if (save_jobs_overlap(jobs, njobs)) {
+            for (size_t i=0; i < njobs; i++)
+                if (! jobs[i].finished)
+                    save_write(jobs + i);
+        } else {
+            save_write_all(jobs, njobs);
+        }
+
+        if (sync == SAVE_SYNC_BATCH)
+            save_sync_dirs(jobs, njobs);
+
+        for (size_t i=0; i < njobs; i++) {
+            if (save_finish(aug, jobs + i) == -1)
+                result = -1;
+        }
+    }
+    free(jobs);
     return result;
 }
 
 int text_retrieve(struct augeas *aug, const char *lens_name,
                   const char *path, struct tree *tree,
                   const char *text_in, char **text_out) {
-    struct memstream ms;
-    bool ms_open = false;
     const char *err_status = NULL;
     char *dyn_err_status = NULL;
     struct lns_error *err = NULL;
     struct lens *lens = NULL;
+    size_t size;
     int result = -1, r;
 
-    MEMZERO(&ms, 1);
+    *text_out = NULL;
     errno = 0;
 
     lens = lens_from_name(aug, lens_name);
@@ -1283,25 +2294,12 @@ int text_retrieve(struct augeas *aug, const char *lens_name,
         goto done;
     }
 
-    r = init_memstream(&ms);
+    r = lns_put(lens, tree == NULL ? NULL : tree->children, text_in,
+                text_out, &size, &err);
     if (r < 0) {
-        err_status = "init_memstream";
+        err_status = "put_oom";
         goto done;
     }
-    ms_open = true;
-
-    if (tree != NULL)
-        lns_put(ms.stream, lens, tree->children, text_in, &err);
-
-    r = close_memstream(&ms);
-    ms_open = false;
-    if (r < 0) {
-        err_status = "close_memstream";
-        goto done;
-    }
-
-    *text_out = ms.buf;
-    ms.buf = NULL;
 
     if (err != NULL) {
         err_status = err->pos >= 0 ? "parse_skel_failed" : "put_failed";
@@ -1324,8 +2322,6 @@ int text_retrieve(struct augeas *aug, const char *lens_name,
     }
     free_lns_error(err);
 
-    if (ms_open)
-        close_memstream(&ms);
     return result;
 }
 
@@ -1378,8 +2374,26 @@ int remove_file(struct augeas *aug, struct tree *tree) {
         goto error;
     }
 
-    if (aug->flags & AUG_SAVE_NOOP)
+    if (aug->flags & AUG_SAVE_NOOP) {
+        char *text = xread_file(augorig_canon);
+        char *diff = NULL;
+
+        if (text != NULL)
+            diff = text_diff(file_path, text, strlen(text),
+                             "/dev/null", "", 0);
+        free(text);
+        if (diff == NULL) {
+            err_status = "diff";
+            goto error;
+        }
+        r = store_diff(aug, meta_path + strlen(AUGEAS_META_TREE), &diff);
+        free(diff);
+        if (r < 0) {
+            err_status = "diff";
+            goto error;
+        }
         goto done;
+    }
 
     if (aug->flags & AUG_SAVE_BACKUP) {
         /* Move file to one with extension .augsave */
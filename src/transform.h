@@ -68,17 +68,34 @@ int transform_validate(struct augeas *aug, struct tree *xfm);
  */
 int transform_load(struct augeas *aug, struct tree *xfm);
 
-/* Return 1 if TRANSFORM applies to PATH, 0 otherwise. The TRANSFORM
- * applies to PATH if (1) PATH starts with "/files/" and (2) the rest of
- * PATH matches the transform's filter
+/* Return 1 if TRANSFORM applies to PATH, 0 otherwise, and -1 if we run
+ * out of memory. The TRANSFORM applies to PATH if (1) PATH starts with
+ * "/files/" and (2) the rest of PATH matches the transform's filter
 */
-int transform_applies(struct tree *xfm, const char *path);
+int transform_applies(struct augeas *aug, struct tree *xfm,
+                      const char *path);
 
-/* Save TREE into the file corresponding to PATH. It is assumed that the
- * TRANSFORM applies to that PATH
+/* Free the filters of transforms compiled by transform_load and
+ * transform_applies */
+void free_xfm_filters(struct augeas *aug);
+
+/* A file that needs saving: TREE is saved into the file corresponding to
+ * PATH. It is assumed that the transform XFM applies to that PATH
+ */
+struct save_file {
+    struct tree *xfm;
+    char        *path;
+    struct tree *tree;
+};
+
+/* Save the NFILES files in FILES. Writing the files to disk is done in
+ * parallel; everything that modifies the tree, like reporting errors or
+ * recording saved events, happens in the order of FILES.
+ *
+ * Return 0 on success, -1 if saving any of the files failed.
  */
-int transform_save(struct augeas *aug, struct tree *xfm,
-                   const char *path, struct tree *tree);
+int transform_save_files(struct augeas *aug, struct save_file *files,
+                         size_t nfiles);
 
 /* Transform TEXT into a tree and store it at PATH
  */
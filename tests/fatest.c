@@ -286,6 +286,20 @@ static void testContains(CuTest *tc) {
     CuAssertTrue(tc, ! fa_contains(fa3, fa1));
 }
 
+static void testContainsHighChars(CuTest *tc) {
+    struct fa *fa1, *fa2, *fa3;
+
+    /* FA3 is FA1 without the character '\xff' */
+    fa1 = make_good_fa(tc, ".");
+    fa2 = make_good_fa(tc, "\xff");
+    fa3 = mark(fa_minus(fa1, fa2));
+    CuAssertPtrNotNull(tc, fa3);
+
+    CuAssertTrue(tc, fa_contains(fa3, fa1));
+    CuAssertTrue(tc, ! fa_contains(fa1, fa3));
+    CuAssertTrue(tc, ! fa_contains(fa2, fa3));
+}
+
 static void testIntersect(CuTest *tc) {
     struct fa *fa1, *fa2, *fa;
 
@@ -297,6 +311,35 @@ static void testIntersect(CuTest *tc) {
     CuAssertTrue(tc, ! fa_equals(fa, fa1));
 }
 
+static void testIntersects(CuTest *tc) {
+    struct fa *fa1, *fa2, *fa3, *fa4;
+    char *xmpl;
+    size_t xmpl_len;
+
+    fa1 = make_good_fa(tc, "[a-z]+=[0-9]*");
+    fa2 = make_good_fa(tc, "(ab|cd)*=[0-9][0-9]");
+    fa3 = make_good_fa(tc, "[A-Z]+=.*");
+    fa4 = make_good_fa(tc, "x*");
+
+    CuAssertIntEquals(tc, 1, fa_intersects(fa1, fa2, &xmpl, &xmpl_len));
+    CuAssertStrEquals(tc, "ab=00", xmpl);
+    CuAssertIntEquals(tc, 5, xmpl_len);
+    free(xmpl);
+
+    CuAssertIntEquals(tc, 0, fa_intersects(fa1, fa3, &xmpl, &xmpl_len));
+    CuAssertPtrEquals(tc, NULL, xmpl);
+    CuAssertIntEquals(tc, 0, fa_intersects(fa2, fa3, NULL, NULL));
+
+    /* The empty word is a common word, too */
+    CuAssertIntEquals(tc, 1, fa_intersects(fa4, fa4, &xmpl, &xmpl_len));
+    CuAssertStrEquals(tc, "", xmpl);
+    CuAssertIntEquals(tc, 0, xmpl_len);
+    free(xmpl);
+
+    fa_nocase(fa1);
+    CuAssertIntEquals(tc, 1, fa_intersects(fa1, fa3, NULL, NULL));
+}
+
 static void testComplement(CuTest *tc) {
     struct fa *fa1 = make_good_fa(tc, "[b-y]+");
     struct fa *fa2 = mark(fa_complement(fa1));
@@ -599,6 +642,251 @@ static void testNoCaseComplement(CuTest *tc) {
     CuAssertIntEquals(tc, 1, fa_is_basic(isect, FA_EMPTY));
 }
 
+static void testClone(CuTest *tc) {
+    struct fa *fa1 = make_good_fa(tc, "(ab|cd)*");
+    struct fa *fa2 = make_good_fa(tc, "[a-z]+");
+    struct fa *clone;
+
+    fa_minimize(fa1);
+    clone = mark(fa_clone(fa1));
+    CuAssertIntEquals(tc, 1, fa_equals(fa1, clone));
+
+    /* Changing the copy leaves the original alone */
+    fa_nocase(clone);
+    CuAssertIntEquals(tc, 1, fa_match(clone, "ABcd", 4));
+    CuAssertIntEquals(tc, 0, fa_match(fa1, "ABcd", 4));
+    CuAssertIntEquals(tc, 1, fa_match(fa1, "abcd", 4));
+
+    fa_nocase(fa2);
+    clone = mark(fa_clone(fa2));
+    CuAssertIntEquals(tc, 1, fa_is_nocase(clone));
+    CuAssertIntEquals(tc, 1, fa_equals(fa2, clone));
+    CuAssertIntEquals(tc, 1, fa_match(clone, "aBc", 3));
+}
+
+/* The number of states of FA, as recorded in its serialized header */
+static unsigned int fa_nstates(CuTest *tc, struct fa *fa) {
+    char *buf;
+    size_t buf_len;
+    unsigned char *w;
+    unsigned int n;
+
+    CuAssertIntEquals(tc, 0, fa_serialize(fa, &buf, &buf_len));
+    w = (unsigned char *) buf + 4*3;
+    n = w[0] | w[1] << 8 | w[2] << 16 | (unsigned int) w[3] << 24;
+    free(buf);
+    return n;
+}
+
+/* Minimize FA with both algorithms, and check that they produce automata
+ * for the language of LANG with the same number of states */
+static void assert_minimize_same(CuTest *tc, struct fa *fa, struct fa *lang) {
+    int algorithm = fa_minimization_algorithm;
+    struct fa *hop = mark(fa_clone(fa));
+    struct fa *val = mark(fa_clone(fa));
+
+    fa_minimization_algorithm = FA_MIN_HOPCROFT;
+    CuAssertIntEquals(tc, 0, fa_minimize(hop));
+    fa_minimization_algorithm = FA_MIN_VALMARI;
+    CuAssertIntEquals(tc, 0, fa_minimize(val));
+    fa_minimization_algorithm = algorithm;
+
+    CuAssertIntEquals(tc, 1, fa_equals(lang, val));
+    CuAssertIntEquals(tc, 1, fa_equals(hop, val));
+    CuAssertIntEquals(tc, fa_nstates(tc, hop), fa_nstates(tc, val));
+}
+
+static void testMinimizeValmari(CuTest *tc) {
+    static const char *const regexps[] = {
+        "", "(.|\n)*", "(ab|cd)*", "[a-z]*a[a-z]{4}", "(a|b)*abb(a|b)*",
+        "[a-z]+|[0-9]+|[a-z0-9]+@[a-z]+", "x(y|z)*|xy*|xz*", "[^\n]*\n",
+        "(foo|bar|baz|frob|barf)(\\.[a-z]+)?"
+    };
+    /* A deterministic automaton for a|ab with a dead state 3 and a
+     * state 4 that can not be reached; states 1 and 4 are equivalent */
+    static const unsigned int words[] = {
+        1, 1, 5, 8,                                   /* version to ntrans */
+        0, 2, 4, 5, 6, 8,                             /* tstart */
+        1, 'a' | 'a' << 8, 3, 'b' | 'z' << 8,         /* state 0 */
+        2, 'b' | 'b' << 8, 3, 'c' | 'z' << 8,         /* state 1 */
+        3, 'a' | 'z' << 8,                            /* state 2 */
+        3, 'a' | 'z' << 8,                            /* state 3 */
+        2, 'b' | 'b' << 8, 3, 'c' | 'z' << 8,         /* state 4 */
+        0x16                                          /* accept 1, 2, 4 */
+    };
+    unsigned char buf[4 + 4*ARRAY_CARDINALITY(words)];
+    struct fa *fa, *fa2, *lang;
+    int r;
+
+    for (int i=0; i < ARRAY_CARDINALITY(regexps); i++) {
+        r = fa_compile(regexps[i], strlen(regexps[i]), &fa);
+        CuAssertIntEquals(tc, REG_NOERROR, r);
+        mark(fa);
+        assert_minimize_same(tc, fa, fa);
+    }
+
+    /* Products and complements that have not been minimized */
+    fa = make_good_fa(tc, "[a-z]*a[a-z]{2}");
+    fa2 = make_good_fa(tc, "(ab|cd)*");
+    lang = mark(fa_complement(fa));
+    assert_minimize_same(tc, lang, lang);
+    lang = mark(fa_intersect(fa, fa2));
+    assert_minimize_same(tc, lang, lang);
+    lang = mark(fa_minus(fa2, fa));
+    assert_minimize_same(tc, lang, lang);
+    lang = mark(fa_complement(mark(fa_complement(fa2))));
+    assert_minimize_same(tc, lang, lang);
+
+    memcpy(buf, "AuFA", 4);
+    for (int i=0; i < ARRAY_CARDINALITY(words); i++) {
+        for (int b=0; b < 4; b++)
+            buf[4 + 4*i + b] = (words[i] >> (8*b)) & 0xff;
+    }
+    r = fa_deserialize((char *) buf, sizeof(buf), &fa);
+    CuAssertIntEquals(tc, 0, r);
+    mark(fa);
+    CuAssertIntEquals(tc, 5, fa_nstates(tc, fa));
+    /* FA_CONTAINS expects automata without dead states, compare with an
+     * automaton for a|ab instead */
+    assert_minimize_same(tc, fa, make_good_fa(tc, "a|ab"));
+
+    struct fa *empty = mark(fa_make_basic(FA_EMPTY));
+    int algorithm = fa_minimization_algorithm;
+    fa_minimization_algorithm = FA_MIN_VALMARI;
+    CuAssertIntEquals(tc, 0, fa_minimize(empty));
+    fa_minimization_algorithm = algorithm;
+    CuAssertIntEquals(tc, 1, fa_is_basic(empty, FA_EMPTY));
+}
+
+static void testSerialize(CuTest *tc) {
+    static const char *const regexps[] = {
+        "", "(.|\n)*", "(ab|cd)*", "[a-z]+|[0-9]+|[a-z0-9]+@[a-z]+",
+        "/etc/([^/]*/)*[^/]*\\.conf", "[^\001-\004]*\377"
+    };
+    char *buf, *buf2;
+    size_t buf_len, buf2_len;
+    struct fa *fa, *copy;
+    int r;
+
+    for (int i=0; i < ARRAY_CARDINALITY(regexps); i++) {
+        r = fa_compile(regexps[i], strlen(regexps[i]), &fa);
+        CuAssertIntEquals(tc, REG_NOERROR, r);
+        mark(fa);
+        if (i % 2 == 0)
+            fa_minimize(fa);
+
+        r = fa_serialize(fa, &buf, &buf_len);
+        CuAssertIntEquals(tc, 0, r);
+        CuAssertIntEquals(tc, 0, buf_len % 4);
+        r = fa_deserialize(buf, buf_len, &copy);
+        CuAssertIntEquals(tc, 0, r);
+        mark(copy);
+
+        /* Serializing the copy produces the same bytes */
+        r = fa_serialize(copy, &buf2, &buf2_len);
+        CuAssertIntEquals(tc, 0, r);
+        CuAssertIntEquals(tc, buf_len, buf2_len);
+        CuAssertIntEquals(tc, 0, memcmp(buf, buf2, buf_len));
+        free(buf2);
+        free(buf);
+
+        CuAssertIntEquals(tc, 1, fa_equals(fa, copy));
+    }
+
+    fa = mark(fa_make_basic(FA_EMPTY));
+    r = fa_serialize(fa, &buf, &buf_len);
+    CuAssertIntEquals(tc, 0, r);
+    r = fa_deserialize(buf, buf_len, &copy);
+    CuAssertIntEquals(tc, 0, r);
+    CuAssertIntEquals(tc, 1, fa_is_basic(mark(copy), FA_EMPTY));
+    free(buf);
+
+    fa = make_good_fa(tc, "[a-z]+");
+    fa_nocase(fa);
+    r = fa_serialize(fa, &buf, &buf_len);
+    CuAssertIntEquals(tc, 0, r);
+    r = fa_deserialize(buf, buf_len, &copy);
+    CuAssertIntEquals(tc, 0, r);
+    mark(copy);
+    CuAssertIntEquals(tc, 1, fa_is_nocase(copy));
+    CuAssertIntEquals(tc, 1, fa_match(copy, "aBc", 3));
+
+    /* Broken buffers: truncated, bad magic, unknown version, and a
+     * transition to a state that does not exist */
+    r = fa_deserialize(buf, buf_len - 4, &copy);
+    CuAssertIntEquals(tc, -2, r);
+    CuAssertPtrEquals(tc, NULL, copy);
+    buf[0] = 'X';
+    r = fa_deserialize(buf, buf_len, &copy);
+    CuAssertIntEquals(tc, -2, r);
+    buf[0] = 'A';
+    buf[4] = 2;
+    r = fa_deserialize(buf, buf_len, &copy);
+    CuAssertIntEquals(tc, -2, r);
+    buf[4] = 1;
+    r = fa_deserialize(buf, buf_len, &copy);
+    CuAssertIntEquals(tc, 0, r);
+    fa_free(copy);
+    /* The first transition follows the five words of the header and
+     * NSTATES + 1 offsets; NSTATES is the fourth word */
+    int nstates = buf[12];
+    buf[4 * (5 + nstates + 1)] = nstates;
+    r = fa_deserialize(buf, buf_len, &copy);
+    CuAssertIntEquals(tc, -2, r);
+    free(buf);
+
+    /* A buffer that claims that a non-minimal automaton is minimal; the
+     * third word holds the flags, and SER_MINIMAL is 1 << 1 */
+    fa = make_good_fa(tc, "x(y|z)*|xy*|xz*");
+    struct fa *min = mark(fa_clone(fa));
+    fa_minimize(min);
+    CuAssertTrue(tc, fa_nstates(tc, min) < fa_nstates(tc, fa));
+    r = fa_serialize(fa, &buf, &buf_len);
+    CuAssertIntEquals(tc, 0, r);
+    buf[8] |= 1 << 1;
+    r = fa_deserialize(buf, buf_len, &copy);
+    CuAssertIntEquals(tc, 0, r);
+    mark(copy);
+    free(buf);
+    CuAssertIntEquals(tc, 0, fa_minimize(copy));
+    CuAssertIntEquals(tc, fa_nstates(tc, min), fa_nstates(tc, copy));
+    CuAssertIntEquals(tc, 1, fa_equals(min, copy));
+
+    /* A buffer that claims that an automaton with transitions on [A-Z] is
+     * nocase, with SER_NOCASE 1 << 2 */
+    fa = make_good_fa(tc, "[A-Z]+");
+    r = fa_serialize(fa, &buf, &buf_len);
+    CuAssertIntEquals(tc, 0, r);
+    buf[8] |= 1 << 2;
+    r = fa_deserialize(buf, buf_len, &copy);
+    CuAssertIntEquals(tc, -2, r);
+    CuAssertPtrEquals(tc, NULL, copy);
+    free(buf);
+}
+
+static void testMatch(CuTest *tc) {
+    struct fa *fa1 = make_good_fa(tc, "/etc/([^/]*/)*[^/]*\\.conf");
+    struct fa *fa2 = make_good_fa(tc, "[a-z]+");
+    struct fa *fa3 = make_good_fa(tc, "a?");
+    static const char word[] = "ab\0c";
+
+    CuAssertIntEquals(tc, 1, fa_match(fa1, "/etc/x.conf", 11));
+    CuAssertIntEquals(tc, 1, fa_match(fa1, "/etc/a/b/.conf", 14));
+    CuAssertIntEquals(tc, 0, fa_match(fa1, "/etc/xconf", 10));
+    CuAssertIntEquals(tc, 0, fa_match(fa1, "/etc/x.conf~", 12));
+    CuAssertIntEquals(tc, 0, fa_match(fa1, "/etc/x.con", 10));
+
+    fa_nocase(fa2);
+    CuAssertIntEquals(tc, 1, fa_match(fa2, "MiXeD", 5));
+    CuAssertIntEquals(tc, 0, fa_match(fa2, "", 0));
+    CuAssertIntEquals(tc, 0, fa_match(fa2, word, sizeof(word) - 1));
+    CuAssertIntEquals(tc, 1, fa_match(fa2, word, 2));
+
+    CuAssertIntEquals(tc, 1, fa_match(fa3, "", 0));
+    CuAssertIntEquals(tc, 1, fa_match(fa3, "a", 1));
+    CuAssertIntEquals(tc, 0, fa_match(fa3, "aa", 2));
+}
+
 static void testEnumerate(CuTest *tc) {
     struct fa *fa1 = make_good_fa(tc, "[ab](cc|dd)");
     static const char *const fa1_expected[] =
@@ -652,7 +940,9 @@ int main(int argc, char **argv) {
         SUITE_ADD_TEST(suite, testChars);
         SUITE_ADD_TEST(suite, testManualAmbig);
         SUITE_ADD_TEST(suite, testContains);
+        SUITE_ADD_TEST(suite, testContainsHighChars);
         SUITE_ADD_TEST(suite, testIntersect);
+        SUITE_ADD_TEST(suite, testIntersects);
         SUITE_ADD_TEST(suite, testComplement);
         SUITE_ADD_TEST(suite, testOverlap);
         SUITE_ADD_TEST(suite, testExample);
@@ -667,6 +957,10 @@ int main(int argc, char **argv) {
         SUITE_ADD_TEST(suite, testExpandNoCase);
         SUITE_ADD_TEST(suite, testNoCaseComplement);
         SUITE_ADD_TEST(suite, testEnumerate);
+        SUITE_ADD_TEST(suite, testClone);
+        SUITE_ADD_TEST(suite, testMinimizeValmari);
+        SUITE_ADD_TEST(suite, testSerialize);
+        SUITE_ADD_TEST(suite, testMatch);
 
         CuSuiteRun(suite);
         CuSuiteSummary(suite, &output);
@@ -642,6 +642,190 @@ static void testAugEscape(CuTest *tc) {
     free(out);
 }
 
+static void testMatchNodes(CuTest *tc) {
+    struct augeas *aug;
+    aug_node *nodes, *children;
+    const char *label, *value;
+    char *path;
+    int r;
+
+    aug = aug_init(root, loadpath, AUG_NO_STDINC|AUG_NO_LOAD);
+    CuAssertPtrNotNull(tc, aug);
+
+    r = aug_set(aug, "/a/b", "1");
+    CuAssertRetSuccess(tc, r);
+    r = aug_set(aug, "/a/b[2]", "2");
+    CuAssertRetSuccess(tc, r);
+    r = aug_set(aug, "/a/b[2]/c", NULL);
+    CuAssertRetSuccess(tc, r);
+    r = aug_set(aug, "/a/b[2]/d", "4");
+    CuAssertRetSuccess(tc, r);
+
+    /* Count only */
+    r = aug_match_nodes(aug, "/a/b", NULL);
+    CuAssertIntEquals(tc, 2, r);
+
+    r = aug_match_nodes(aug, "/a/b", &nodes);
+    CuAssertIntEquals(tc, 2, r);
+
+    r = aug_node_label(aug, nodes + 1, &label);
+    CuAssertRetSuccess(tc, r);
+    CuAssertStrEquals(tc, "b", label);
+
+    r = aug_node_value(aug, nodes + 1, &value);
+    CuAssertRetSuccess(tc, r);
+    CuAssertStrEquals(tc, "2", value);
+
+    r = aug_node_path(aug, nodes + 1, &path);
+    CuAssertRetSuccess(tc, r);
+    CuAssertStrEquals(tc, "/a/b[2]", path);
+    free(path);
+
+    r = aug_node_children(aug, nodes, NULL);
+    CuAssertIntEquals(tc, 0, r);
+
+    r = aug_node_children(aug, nodes + 1, &children);
+    CuAssertIntEquals(tc, 2, r);
+
+    r = aug_node_label(aug, children + 1, &label);
+    CuAssertRetSuccess(tc, r);
+    CuAssertStrEquals(tc, "d", label);
+
+    r = aug_node_value(aug, children, &value);
+    CuAssertRetSuccess(tc, r);
+    CuAssertPtrEquals(tc, NULL, value);
+
+    /* Hidden nodes are skipped, like in aug_match */
+    r = aug_match_nodes(aug, "/", NULL);
+    CuAssertIntEquals(tc, aug_match(aug, "/", NULL), r);
+
+    /* Handles go stale when the tree is modified */
+    r = aug_rm(aug, "/a/b[2]");
+    CuAssertIntEquals(tc, 3, r);
+
+    r = aug_node_value(aug, nodes + 1, &value);
+    CuAssertIntEquals(tc, -1, r);
+    CuAssertIntEquals(tc, AUG_EBADARG, aug_error(aug));
+
+    r = aug_node_children(aug, nodes, NULL);
+    CuAssertIntEquals(tc, -1, r);
+    CuAssertIntEquals(tc, AUG_EBADARG, aug_error(aug));
+
+    free(nodes);
+    free(children);
+
+    /* Invalid paths are reported like aug_match does */
+    r = aug_match_nodes(aug, "/a[", &nodes);
+    CuAssertIntEquals(tc, -1, r);
+    CuAssertIntEquals(tc, AUG_EPATHX, aug_error(aug));
+    CuAssertPtrEquals(tc, NULL, nodes);
+
+    aug_close(aug);
+}
+
+static void testBatch(CuTest *tc) {
+    struct augeas *aug;
+    const char *v;
+    int r;
+
+    aug = aug_init(root, loadpath, AUG_NO_STDINC|AUG_NO_LOAD);
+    CuAssertPtrNotNull(tc, aug);
+
+    struct aug_op ops[] = {
+        { .op = AUG_OP_SET, .path = "/a/b[last()+1]", .value = "1" },
+        { .op = AUG_OP_SET, .path = "/a/b[last()+1]", .value = "2" },
+        { .op = AUG_OP_SET, .path = "/a/b[last()+1]", .value = "3" },
+        { .op = AUG_OP_INSERT, .path = "/a/b[1]", .label = "c", .before = 1 },
+        { .op = AUG_OP_RM, .path = "/a/b[. = '2']" },
+        { .op = AUG_OP_SET, .path = "/a/b", .value = "x" },
+        { .op = AUG_OP_INSERT, .path = "/a/b[1]", .label = "c/d" },
+        { .op = AUG_OP_SET, .path = "/augeas/context", .value = "/a" },
+        { .op = AUG_OP_SET, .path = "c", .value = "ctx" },
+        { .op = AUG_OP_RM, .path = "/a" },
+        { .op = AUG_OP_SET, .path = "e", .value = "new ctx" },
+    };
+
+    r = aug_batch(aug, ops, sizeof(ops)/sizeof(ops[0]));
+    CuAssertIntEquals(tc, 2, r);
+    CuAssertIntEquals(tc, AUG_EMMATCH, aug_error(aug));
+
+    CuAssertIntEquals(tc, 0, ops[2].result);
+    CuAssertIntEquals(tc, AUG_NOERROR, ops[2].error);
+    CuAssertIntEquals(tc, 1, ops[4].result);
+    CuAssertIntEquals(tc, -1, ops[5].result);
+    CuAssertIntEquals(tc, AUG_EMMATCH, ops[5].error);
+    CuAssertIntEquals(tc, -1, ops[6].result);
+    CuAssertIntEquals(tc, AUG_ELABEL, ops[6].error);
+    CuAssertIntEquals(tc, 4, ops[9].result);
+
+    r = aug_get(aug, "/a/e", &v);
+    CuAssertIntEquals(tc, 1, r);
+    CuAssertStrEquals(tc, "new ctx", v);
+
+    r = aug_match(aug, "/a/*", NULL);
+    CuAssertIntEquals(tc, 1, r);
+
+    aug_close(aug);
+}
+
+/* A broken context only fails the operations that need it, and a batch
+ * can repair it by setting /augeas/context */
+static void testBatchBrokenContext(CuTest *tc) {
+    struct augeas *aug;
+    const char *v;
+    int r;
+
+    aug = aug_init(root, loadpath, AUG_NO_STDINC|AUG_NO_LOAD);
+    CuAssertPtrNotNull(tc, aug);
+
+    r = aug_set(aug, "/augeas/context", "/files[");
+    CuAssertRetSuccess(tc, r);
+
+    struct aug_op repair[] = {
+        { .op = AUG_OP_SET, .path = "/augeas/context", .value = "/x" },
+        { .op = AUG_OP_SET, .path = "y", .value = "1" },
+    };
+
+    r = aug_batch(aug, repair, sizeof(repair)/sizeof(repair[0]));
+    CuAssertIntEquals(tc, 0, r);
+    r = aug_get(aug, "/x/y", &v);
+    CuAssertIntEquals(tc, 1, r);
+    CuAssertStrEquals(tc, "1", v);
+
+    struct aug_op ops[] = {
+        { .op = AUG_OP_SET, .path = "a", .value = "1" },
+        { .op = AUG_OP_SET, .path = "/augeas/context", .value = "/files[" },
+        { .op = AUG_OP_SET, .path = "b", .value = "2" },
+        { .op = AUG_OP_RM, .path = "c" },
+        { .op = AUG_OP_SET, .path = "/augeas/context", .value = "/z" },
+        { .op = AUG_OP_SET, .path = "d", .value = "3" },
+    };
+
+    r = aug_batch(aug, ops, sizeof(ops)/sizeof(ops[0]));
+    CuAssertIntEquals(tc, 2, r);
+    CuAssertIntEquals(tc, AUG_EPATHX, aug_error(aug));
+
+    CuAssertIntEquals(tc, 0, ops[0].result);
+    CuAssertIntEquals(tc, 0, ops[1].result);
+    CuAssertIntEquals(tc, -1, ops[2].result);
+    CuAssertIntEquals(tc, AUG_EPATHX, ops[2].error);
+    CuAssertIntEquals(tc, -1, ops[3].result);
+    CuAssertIntEquals(tc, AUG_EPATHX, ops[3].error);
+    CuAssertIntEquals(tc, 0, ops[4].result);
+    CuAssertIntEquals(tc, AUG_NOERROR, ops[4].error);
+    CuAssertIntEquals(tc, 0, ops[5].result);
+    CuAssertIntEquals(tc, AUG_NOERROR, ops[5].error);
+
+    r = aug_get(aug, "/x/a", &v);
+    CuAssertIntEquals(tc, 1, r);
+    CuAssertStrEquals(tc, "1", v);
+    r = aug_get(aug, "/z/d", &v);
+    CuAssertIntEquals(tc, 1, r);
+    CuAssertStrEquals(tc, "3", v);
+
+    aug_close(aug);
+}
+
 int main(void) {
     char *output = NULL;
     CuSuite* suite = CuSuiteNew();
@@ -661,6 +845,9 @@ int main(void) {
     SUITE_ADD_TEST(suite, testTextStore);
     SUITE_ADD_TEST(suite, testTextRetrieve);
     SUITE_ADD_TEST(suite, testAugEscape);
+    SUITE_ADD_TEST(suite, testMatchNodes);
+    SUITE_ADD_TEST(suite, testBatch);
+    SUITE_ADD_TEST(suite, testBatchBrokenContext);
 
     abs_top_srcdir = getenv("abs_top_srcdir");
     if (abs_top_srcdir == NULL)
@@ -603,6 +603,95 @@ static void testLoadTrailingExcl(CuTest *tc) {
     CuAssertIntEquals(tc, 0, r);
 }
 
+/* Test that filters are recompiled when their globs change, and that
+ * load and save agree on which files a transform applies to */
+static void testFilterChanged(CuTest *tc) {
+    augeas *aug = NULL;
+    static const char *const cmds =
+        "set /augeas/context /augeas/load/Shellvars\n"
+        "set lens Shellvars.lns\n"
+        "set incl /etc/sysconfig/network-scripts/ifcfg-lo*\n"
+        "set excl[1] *.rpmsave\n"
+        "set excl[2] /etc/sysconfig/network-scripts/ifcfg-lo\n"
+        "load";
+    int r;
+
+    aug = aug_init(root, loadpath,
+                   AUG_NO_STDINC|AUG_NO_MODL_AUTOLOAD|AUG_SAVE_NOOP);
+    CuAssertPtrNotNull(tc, aug);
+
+    r = aug_srun(aug, stderr, cmds);
+    CuAssertIntEquals(tc, 6, r);
+
+    r = aug_match(aug, "/augeas/files/etc/sysconfig/network-scripts/*", NULL);
+    CuAssertIntEquals(tc, 0, r);
+
+    r = aug_rm(aug, "/augeas/load/Shellvars/excl[2]");
+    CuAssertIntEquals(tc, 1, r);
+    r = aug_load(aug);
+    CuAssertRetSuccess(tc, r);
+
+    r = aug_match(aug, "/augeas/files/etc/sysconfig/network-scripts/*", NULL);
+    CuAssertIntEquals(tc, 1, r);
+    r = aug_match(aug, "/augeas/files/etc/sysconfig/network-scripts/ifcfg-lo", NULL);
+    CuAssertIntEquals(tc, 1, r);
+
+    /* The excl glob *.rpmsave also keeps the file from being saved */
+    r = aug_set(aug, "/files/etc/sysconfig/network-scripts/ifcfg-lo.rpmsave/X", "1");
+    CuAssertRetSuccess(tc, r);
+    r = aug_set(aug, "/files/etc/sysconfig/network-scripts/ifcfg-lo/X", "1");
+    CuAssertRetSuccess(tc, r);
+    r = aug_save(aug);
+    CuAssertRetSuccess(tc, r);
+
+    r = aug_match(aug, "/augeas/events/saved", NULL);
+    CuAssertIntEquals(tc, 1, r);
+    r = aug_match(aug, "/augeas/events/saved[. = '/files/etc/sysconfig/network-scripts/ifcfg-lo']", NULL);
+    CuAssertIntEquals(tc, 1, r);
+
+    aug_close(aug);
+}
+
+/* Test that a range containing '/' in a bracket expression of a glob
+ * does not match a '/', just like fnmatch with FNM_PATHNAME. Load uses
+ * glob(3) to find files, so check which files save would write */
+static void testFilterSlashRange(CuTest *tc) {
+    augeas *aug = NULL;
+    static const char *const cmds =
+        "set /augeas/context /augeas/load/Shellvars\n"
+        "set lens Shellvars.lns\n"
+        "set incl /etc/sysconfig[+-0]network-scripts/ifcfg-lo\n"
+        "load";
+    int r;
+
+    aug = aug_init(root, loadpath,
+                   AUG_NO_STDINC|AUG_NO_MODL_AUTOLOAD|AUG_SAVE_NOOP);
+    CuAssertPtrNotNull(tc, aug);
+
+    r = aug_srun(aug, stderr, cmds);
+    CuAssertIntEquals(tc, 4, r);
+
+    r = aug_set(aug, "/files/etc/sysconfig/network-scripts/ifcfg-lo/X", "1");
+    CuAssertRetSuccess(tc, r);
+    r = aug_save(aug);
+    CuAssertRetSuccess(tc, r);
+    r = aug_match(aug, "/augeas/events/saved", NULL);
+    CuAssertIntEquals(tc, 0, r);
+
+    /* The same range matches the '-' in the directory name */
+    r = aug_set(aug, "/augeas/load/Shellvars/incl",
+                "/etc/sysconfig/network[+-0]scripts/ifcfg-lo");
+    CuAssertRetSuccess(tc, r);
+    r = aug_set(aug, "/files/etc/sysconfig/network-scripts/ifcfg-lo/X", "2");
+    CuAssertRetSuccess(tc, r);
+    r = aug_save(aug);
+    CuAssertRetSuccess(tc, r);
+    r = aug_match(aug, "/augeas/events/saved[. = '/files/etc/sysconfig/network-scripts/ifcfg-lo']", NULL);
+    CuAssertIntEquals(tc, 1, r);
+
+    aug_close(aug);
+}
+
 int main(void) {
     char *output = NULL;
     CuSuite* suite = CuSuiteNew();
@@ -624,6 +713,8 @@ int main(void) {
     SUITE_ADD_TEST(suite, testPermsErrorReported);
     SUITE_ADD_TEST(suite, testLoadExclWithRoot);
     SUITE_ADD_TEST(suite, testLoadTrailingExcl);
+    SUITE_ADD_TEST(suite, testFilterChanged);
+    SUITE_ADD_TEST(suite, testFilterSlashRange);
 
     abs_top_srcdir = getenv("abs_top_srcdir");
     if (abs_top_srcdir == NULL)
@@ -177,6 +177,138 @@ static void testMtime(CuTest *tc) {
     CuAssertStrNotEqual(tc, "0", mtime2);
 }
 
+/* Saving a file whose text does not change must not touch its directory,
+ * not even with a temp file that is removed again */
+static void testSaveUnchanged(CuTest *tc) {
+    struct stat before, after;
+    char *dir = NULL;
+    int r;
+
+    r = asprintf(&dir, "%s/etc", root);
+    CuAssertPositive(tc, r);
+    r = stat(dir, &before);
+    CuAssertRetSuccess(tc, r);
+
+    r = aug_set(aug, "/files/etc/hosts/1/alias[1]", "changed");
+    CuAssertRetSuccess(tc, r);
+    r = aug_set(aug, "/files/etc/hosts/1/alias[1]", "localhost");
+    CuAssertRetSuccess(tc, r);
+    r = aug_save(aug);
+    CuAssertRetSuccess(tc, r);
+
+    r = aug_match(aug, "/augeas/events/saved", NULL);
+    CuAssertIntEquals(tc, 0, r);
+    r = aug_match(aug, "/augeas//error", NULL);
+    CuAssertIntEquals(tc, 0, r);
+
+    r = stat(dir, &after);
+    CuAssertRetSuccess(tc, r);
+    CuAssertIntEquals(tc, before.st_mtim.tv_sec, after.st_mtim.tv_sec);
+    CuAssertIntEquals(tc, before.st_mtim.tv_nsec, after.st_mtim.tv_nsec);
+    free(dir);
+}
+
+/* Replace AUG with a handle that loaded all files with span information;
+ * setting /augeas/span and loading again would not reread the files that
+ * setup already loaded */
+static void reopen_with_span(CuTest *tc) {
+    char *lensdir;
+
+    if (asprintf(&lensdir, "%s/lenses", abs_top_srcdir) < 0)
+        CuFail(tc, "asprintf lensdir failed");
+
+    aug_close(aug);
+    aug = aug_init(root, lensdir, AUG_NO_STDINC|AUG_ENABLE_SPAN);
+    CuAssertPtrNotNull(tc, aug);
+    free(lensdir);
+}
+
+/* With span information, parts of a file that did not change are copied
+ * from the original; the result must be the same as without it */
+static void testSaveSpan(CuTest *tc) {
+    static const char *const expected =
+        "# Do not remove the following line, or various programs\n"
+        "# that require network functionality will fail.\n"
+        "127.0.0.1\tlocalhost.localdomain\tlh galia.watzmann.net galia\n"
+        "#172.31.122.254   granny.watzmann.net granny puppet\n"
+        "#172.31.122.1     galia.watzmann.net galia\n"
+        "192.168.0.1\tnew\n";
+    char *fname = NULL, buf[1024];
+    FILE *fp;
+    size_t len;
+    int r;
+
+    reopen_with_span(tc);
+
+    r = aug_set(aug, "/files/etc/hosts/1/alias[1]", "lh");
+    CuAssertRetSuccess(tc, r);
+    r = aug_set(aug, "/files/etc/hosts/3/ipaddr", "192.168.0.1");
+    CuAssertRetSuccess(tc, r);
+    r = aug_set(aug, "/files/etc/hosts/3/canonical", "new");
+    CuAssertRetSuccess(tc, r);
+    r = aug_rm(aug, "/files/etc/hosts/2");
+    CuAssertPositive(tc, r);
+    r = aug_save(aug);
+    CuAssertRetSuccess(tc, r);
+
+    r = asprintf(&fname, "%s/etc/hosts", root);
+    CuAssertPositive(tc, r);
+    fp = fopen(fname, "r");
+    CuAssertPtrNotNull(tc, fp);
+    len = fread(buf, 1, sizeof(buf) - 1, fp);
+    buf[len] = '\0';
+    fclose(fp);
+    free(fname);
+
+    CuAssertStrEquals(tc, expected, buf);
+}
+
+/* The text of a file may change after it was loaded; trees loaded with
+ * span information must not be taken as a copy of the new text */
+static void testSaveSpanChanged(CuTest *tc) {
+    static const char *const changed =
+        "# Do not remove the following line, or various programs\n"
+        "# that require network functionality will fail.\n"
+        "127.0.0.1\tlocalhost.localdomain\tlocalhostXYZ galia.watzmann.net galia\n"
+        "#172.31.122.254   granny.watzmann.net granny puppet\n"
+        "#172.31.122.1     galia.watzmann.net galia\n"
+        "172.31.122.14   orange.watzmann.net orange\n";
+    static const char *const expected =
+        "# Do not remove the following line, or various programs\n"
+        "# that require network functionality will fail.\n"
+        "127.0.0.1\tlocalhost.localdomain\tlocalhost galia.watzmann.net galia\n"
+        "#172.31.122.254   granny.watzmann.net granny puppet\n"
+        "#172.31.122.1     galia.watzmann.net galia\n"
+        "172.31.122.14   bar orange\n";
+    char *fname = NULL, buf[1024];
+    FILE *fp;
+    size_t len;
+    int r;
+
+    reopen_with_span(tc);
+
+    r = asprintf(&fname, "%s/etc/hosts", root);
+    CuAssertPositive(tc, r);
+    fp = fopen(fname, "w");
+    CuAssertPtrNotNull(tc, fp);
+    fputs(changed, fp);
+    fclose(fp);
+
+    r = aug_set(aug, "/files/etc/hosts/2/canonical", "bar");
+    CuAssertRetSuccess(tc, r);
+    r = aug_save(aug);
+    CuAssertRetSuccess(tc, r);
+
+    fp = fopen(fname, "r");
+    CuAssertPtrNotNull(tc, fp);
+    len = fread(buf, 1, sizeof(buf) - 1, fp);
+    buf[len] = '\0';
+    fclose(fp);
+    free(fname);
+
+    CuAssertStrEquals(tc, expected, buf);
+}
+
 /* Check that loading and saving a file given with a relative path
  * works. Bug #238
  */
@@ -348,6 +480,236 @@ static void testPathEscaping(CuTest *tc) {
     CuAssertIntEquals(tc, ENOENT, errno);
 }
 
+/* Save more files than are written in one batch, and make sure they all
+ * get written and that the saved events are in tree order */
+static void testSaveManyFiles(CuTest *tc) {
+    static const int nfiles = 100;
+    char *path = NULL, *fname = NULL;
+    const char *v;
+    int r;
+
+    for (int i=0; i < nfiles; i++) {
+        r = asprintf(&path,
+                     "/files/etc/yum.repos.d/many%03d.repo/repo/baseurl", i);
+        CuAssertPositive(tc, r);
+        r = aug_set(aug, path, "http://example.com/");
+        CuAssertRetSuccess(tc, r);
+        free(path);
+    }
+
+    r = aug_save(aug);
+    CuAssertRetSuccess(tc, r);
+
+    r = aug_match(aug, "/augeas/events/saved", NULL);
+    CuAssertIntEquals(tc, nfiles, r);
+
+    for (int i=0; i < nfiles; i++) {
+        r = asprintf(&path, "/augeas/events/saved[%d]", i + 1);
+        CuAssertPositive(tc, r);
+        r = aug_get(aug, path, &v);
+        CuAssertIntEquals(tc, 1, r);
+        free(path);
+
+        r = asprintf(&path, "/files/etc/yum.repos.d/many%03d.repo", i);
+        CuAssertPositive(tc, r);
+        CuAssertStrEquals(tc, path, v);
+        free(path);
+
+        r = asprintf(&fname, "%s/etc/yum.repos.d/many%03d.repo", root, i);
+        CuAssertPositive(tc, r);
+        r = access(fname, R_OK);
+        CuAssertIntEquals(tc, 0, r);
+        free(fname);
+    }
+}
+
+/* Remove every other file from a directory with many files, and make
+ * sure exactly those files get deleted */
+static void testRemoveManyFiles(CuTest *tc) {
+    static const int nfiles = 100;
+    char *path = NULL, *fname = NULL;
+    int r;
+
+    for (int i=0; i < nfiles; i++) {
+        r = asprintf(&path,
+                     "/files/etc/yum.repos.d/many%03d.repo/repo/baseurl", i);
+        CuAssertPositive(tc, r);
+        r = aug_set(aug, path, "http://example.com/");
+        CuAssertRetSuccess(tc, r);
+        free(path);
+    }
+    r = aug_save(aug);
+    CuAssertRetSuccess(tc, r);
+
+    for (int i=0; i < nfiles; i += 2) {
+        r = asprintf(&path, "/files/etc/yum.repos.d/many%03d.repo", i);
+        CuAssertPositive(tc, r);
+        r = aug_rm(aug, path);
+        CuAssertPositive(tc, r);
+        free(path);
+    }
+    r = aug_save(aug);
+    CuAssertRetSuccess(tc, r);
+    r = aug_match(aug, "/augeas/events/saved", NULL);
+    CuAssertIntEquals(tc, nfiles / 2, r);
+
+    for (int i=0; i < nfiles; i++) {
+        r = asprintf(&fname, "%s/etc/yum.repos.d/many%03d.repo", root, i);
+        CuAssertPositive(tc, r);
+        r = access(fname, F_OK);
+        CuAssertIntEquals(tc, (i % 2 == 0) ? -1 : 0, r);
+        free(fname);
+    }
+    r = aug_match(aug, "/augeas/files/etc/yum.repos.d/*", NULL);
+    CuAssertIntEquals(tc, nfiles / 2 + 3, r);
+}
+
+static void testSaveSync(CuTest *tc) {
+    static const char *const modes[] = { "batch", "none", "file" };
+    char *path = NULL, *fname = NULL;
+    const char *v;
+    int r;
+
+    r = aug_set(aug, "/augeas/save", "backup");
+    CuAssertRetSuccess(tc, r);
+
+    for (int m=0; m < ARRAY_CARDINALITY(modes); m++) {
+        r = aug_set(aug, "/augeas/save/sync", modes[m]);
+        CuAssertRetSuccess(tc, r);
+
+        r = aug_set(aug, "/files/etc/hosts/1/alias[last()+1]", modes[m]);
+        CuAssertRetSuccess(tc, r);
+
+        r = asprintf(&path, "/files/etc/yum.repos.d/sync%d.repo/repo/baseurl",
+                     m);
+        CuAssertPositive(tc, r);
+        r = aug_set(aug, path, "http://example.com/");
+        CuAssertRetSuccess(tc, r);
+        free(path);
+
+        r = aug_save(aug);
+        CuAssertRetSuccess(tc, r);
+
+        r = aug_match(aug, "/augeas/events/saved", NULL);
+        CuAssertIntEquals(tc, 2, r);
+        r = aug_match(aug, "/augeas/files//warning", NULL);
+        CuAssertIntEquals(tc, 0, r);
+
+        r = asprintf(&fname, "%s/etc/yum.repos.d/sync%d.repo", root, m);
+        CuAssertPositive(tc, r);
+        r = access(fname, R_OK);
+        CuAssertIntEquals(tc, 0, r);
+        free(fname);
+    }
+
+    r = asprintf(&fname, "%s/etc/hosts.augsave", root);
+    CuAssertPositive(tc, r);
+    r = access(fname, R_OK);
+    CuAssertIntEquals(tc, 0, r);
+    free(fname);
+
+    r = aug_load(aug);
+    CuAssertRetSuccess(tc, r);
+    r = aug_match(aug, "/files/etc/hosts/1/alias", NULL);
+    CuAssertIntEquals(tc, 6, r);
+    r = aug_get(aug, "/files/etc/hosts/1/alias[last()]", &v);
+    CuAssertIntEquals(tc, 1, r);
+    CuAssertStrEquals(tc, "file", v);
+
+    r = aug_set(aug, "/augeas/save/sync", "sometimes");
+    CuAssertRetSuccess(tc, r);
+    r = aug_set(aug, "/files/etc/hosts/1/alias[last()+1]", "bad");
+    CuAssertRetSuccess(tc, r);
+    r = aug_save(aug);
+    CuAssertIntEquals(tc, -1, r);
+    CuAssertIntEquals(tc, AUG_EBADARG, aug_error(aug));
+}
+
+/* In noop mode, the changes that saving would make are recorded as a
+ * unified diff for each file, and nothing on disk changes */
+static void testSaveNoopDiff(CuTest *tc) {
+    static const char *const hosts_diff =
+        "--- /etc/hosts\n"
+        "+++ /etc/hosts\n"
+        "@@ -3,4 +3,4 @@\n"
+        " 127.0.0.1\tlocalhost.localdomain\tlocalhost galia.watzmann.net galia\n"
+        " #172.31.122.254   granny.watzmann.net granny puppet\n"
+        " #172.31.122.1     galia.watzmann.net galia\n"
+        "-172.31.122.14   orange.watzmann.net orange\n"
+        "+172.31.122.14   orange.watzmann.net apple\n";
+    static const char *const repo_diff =
+        "--- /dev/null\n"
+        "+++ /etc/yum.repos.d/diff.repo\n"
+        "@@ -0,0 +1,2 @@\n"
+        "+[diff]\n"
+        "+baseurl=http://example.com/\n";
+    static const char *const login_diff =
+        "--- /etc/pam.d/login\n"
+        "+++ /dev/null\n"
+        "@@ -1,15 +0,0 @@\n"
+        "-#%PAM-1.0\n";
+    char *fname = NULL;
+    const char *v;
+    int r;
+
+    r = aug_set(aug, "/augeas/save", "noop");
+    CuAssertRetSuccess(tc, r);
+    r = aug_set(aug, "/files/etc/hosts/2/alias", "apple");
+    CuAssertRetSuccess(tc, r);
+    r = aug_set(aug, "/files/etc/yum.repos.d/diff.repo/diff/baseurl",
+                "http://example.com/");
+    CuAssertRetSuccess(tc, r);
+    r = aug_rm(aug, "/files/etc/pam.d/login");
+    CuAssertPositive(tc, r);
+
+    r = aug_save(aug);
+    CuAssertRetSuccess(tc, r);
+    r = aug_match(aug, "/augeas/events/saved", NULL);
+    CuAssertIntEquals(tc, 3, r);
+
+    r = aug_get(aug, "/augeas/files/etc/hosts/diff", &v);
+    CuAssertIntEquals(tc, 1, r);
+    CuAssertStrEquals(tc, hosts_diff, v);
+    r = aug_get(aug, "/augeas/files/etc/yum.repos.d/diff.repo/diff", &v);
+    CuAssertIntEquals(tc, 1, r);
+    CuAssertStrEquals(tc, repo_diff, v);
+    r = aug_get(aug, "/augeas/files/etc/pam.d/login/diff", &v);
+    CuAssertIntEquals(tc, 1, r);
+    CuAssertTrue(tc, STREQLEN(v, login_diff, strlen(login_diff)));
+
+    r = asprintf(&fname, "%s/etc/yum.repos.d/diff.repo", root);
+    CuAssertPositive(tc, r);
+    r = access(fname, F_OK);
+    CuAssertIntEquals(tc, -1, r);
+    free(fname);
+    r = asprintf(&fname, "%s/etc/pam.d/login", root);
+    CuAssertPositive(tc, r);
+    r = access(fname, F_OK);
+    CuAssertIntEquals(tc, 0, r);
+    free(fname);
+
+    /* Once the tree agrees with the file again, a noop save drops its
+     * diff */
+    r = aug_set(aug, "/files/etc/hosts/2/alias", "orange");
+    CuAssertRetSuccess(tc, r);
+    r = aug_save(aug);
+    CuAssertRetSuccess(tc, r);
+    r = aug_match(aug, "/augeas/events/saved", NULL);
+    CuAssertIntEquals(tc, 2, r);
+    r = aug_match(aug, "/augeas/files/etc/hosts/diff", NULL);
+    CuAssertIntEquals(tc, 0, r);
+    r = aug_match(aug, "/augeas/files//diff", NULL);
+    CuAssertIntEquals(tc, 2, r);
+
+    /* Actually saving the files removes the diffs */
+    r = aug_set(aug, "/augeas/save", "overwrite");
+    CuAssertRetSuccess(tc, r);
+    r = aug_save(aug);
+    CuAssertRetSuccess(tc, r);
+    r = aug_match(aug, "/augeas/files//diff", NULL);
+    CuAssertIntEquals(tc, 0, r);
+}
+
 int main(void) {
     char *output = NULL;
     CuSuite* suite = CuSuiteNew();
@@ -371,12 +733,19 @@ int main(void) {
     SUITE_ADD_TEST(suite, testNonExistentLens);
     SUITE_ADD_TEST(suite, testMultipleXfm);
     SUITE_ADD_TEST(suite, testMtime);
+    SUITE_ADD_TEST(suite, testSaveUnchanged);
+    SUITE_ADD_TEST(suite, testSaveSpan);
+    SUITE_ADD_TEST(suite, testSaveSpanChanged);
     SUITE_ADD_TEST(suite, testRelPath);
     SUITE_ADD_TEST(suite, testDoubleSlashPath);
     SUITE_ADD_TEST(suite, testUmask077);
     SUITE_ADD_TEST(suite, testUmask027);
     SUITE_ADD_TEST(suite, testUmask022);
     SUITE_ADD_TEST(suite, testPathEscaping);
+    SUITE_ADD_TEST(suite, testSaveManyFiles);
+    SUITE_ADD_TEST(suite, testRemoveManyFiles);
+    SUITE_ADD_TEST(suite, testSaveSync);
+    SUITE_ADD_TEST(suite, testSaveNoopDiff);
 
     CuSuiteRun(suite);
     CuSuiteSummary(suite, &output);
@@ -0,0 +1,86 @@
+#! /bin/bash
+
+# Test that augparse --typecheck-cache records the modules that passed
+# their typechecks, and that changing a module invalidates its entry and
+# the entries of the modules that use it
+
+root=$abs_top_builddir/build/test-typecheck-cache
+cache=$root/tc.cache
+
+rm -rf $root
+mkdir -p $root
+
+run_augparse() {
+    exp=$1
+    augparse --nostdinc -I $root --typecheck-cache $cache $root/$2 \
+        > /dev/null 2>&1
+    status=$?
+    if [ $exp = ok -a $status -ne 0 ] ; then
+        echo "augparse $2 failed"
+        exit 1
+    elif [ $exp = fail -a $status -eq 0 ] ; then
+        echo "augparse $2 succeeded but should have failed"
+        exit 1
+    fi
+}
+
+assert_entries() {
+    act=$(wc -l < $cache)
+    if [ $act -ne $1 ] ; then
+        printf "Expected %d cache entries, but found %d\n" $1 $act
+        cat $cache
+        exit 1
+    fi
+}
+
+cat > $root/dep.aug <<EOF
+module Dep =
+  let word = [ key /[a-z]+/ . del /[ \t]+/ " " . store /[0-9]+/ ]
+EOF
+
+cat > $root/top.aug <<EOF
+module Top =
+  let lns = (Dep.word . del "\n" "\n")*
+  test lns get "a 1\nb 2\n" = { "a" = "1" } { "b" = "2" }
+EOF
+
+run_augparse ok top.aug
+assert_entries 2
+
+# Nothing changed, nothing gets checked or recorded again
+run_augparse ok top.aug
+assert_entries 2
+
+# Changing Dep invalidates the entries for both Dep and Top
+echo "(* changed *)" >> $root/dep.aug
+run_augparse ok top.aug
+assert_entries 4
+
+# Top is not changed, but the new Dep makes it ambiguous; it must be
+# checked again, not passed because of its old entry
+cat > $root/top.aug <<EOF
+module Top =
+  let lns = (Dep.word . del "\n" "\n")*
+  let pair = Dep.word . Dep.word
+EOF
+run_augparse ok top.aug
+assert_entries 5
+cat > $root/dep.aug <<EOF
+module Dep =
+  let word = [ key /[a-z]+/ . del /[ \t]+/ " " . store /[a-z0-9]+/ ]
+EOF
+run_augparse fail top.aug
+assert_entries 6
+
+# Ambiguous lenses in changed modules are still caught
+cat > $root/dep.aug <<EOF
+module Dep =
+  let word = [ key /[a-z]+/ . del /[ \t]+/ " " . store /[a-z0-9]+/ ]
+EOF
+cat > $root/top.aug <<EOF
+module Top =
+  let lns = (Dep.word . del "\n" "\n")*
+  let ambig = Dep.word . Dep.word
+EOF
+run_augparse fail top.aug
+assert_entries 6
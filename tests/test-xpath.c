@@ -241,6 +241,77 @@ static int test_rm_var(struct augeas *aug) {
     return -1;
 }
 
+/* Removing nodes must update all variables that reference them, including
+ * variables that were redefined or undefined in the meantime */
+static int test_rm_var_shared(struct augeas *aug) {
+    int r, n = 5;
+
+    printf("%-30s ... ", "rm_var_shared");
+    for (int i=0; i < n; i++) {
+        if (aug_set(aug, "/shared/e[last()+1]/x", "x") < 0)
+            die("aug_set failed");
+        if (aug_set(aug, "/shared/e[last()]/y", "y") < 0)
+            die("aug_set failed");
+    }
+
+    r = aug_defvar(aug, "a", "/shared/e/x");
+    if (r != n)
+        die("aug_defvar $a failed");
+    r = aug_defvar(aug, "b", "/shared/e/x | /shared/e/y");
+    if (r != 2 * n)
+        die("aug_defvar $b failed");
+    r = aug_defvar(aug, "a", "/shared/e");
+    if (r != n)
+        die("aug_defvar $a failed");
+
+    r = aug_rm(aug, "/shared/e[last()]");
+    if (r != 3) {
+        fprintf(stderr, "expected 3 nodes removed, got %d\n", r);
+        goto fail;
+    }
+
+    r = aug_match(aug, "$a", NULL);
+    if (r != n - 1) {
+        fprintf(stderr, "expected %d matches for $a, got %d\n", n - 1, r);
+        goto fail;
+    }
+    r = aug_match(aug, "$b", NULL);
+    if (r != 2 * (n - 1)) {
+        fprintf(stderr, "expected %d matches for $b, got %d\n",
+                2 * (n - 1), r);
+        goto fail;
+    }
+
+    r = aug_defvar(aug, "b", NULL);
+    if (r < 0)
+        die("aug_defvar undefining $b failed");
+    r = aug_rm(aug, "/shared/e/x");
+    if (r != n - 1) {
+        fprintf(stderr, "expected %d nodes removed, got %d\n", n - 1, r);
+        goto fail;
+    }
+    r = aug_match(aug, "$a", NULL);
+    if (r != n - 1) {
+        fprintf(stderr, "expected %d matches for $a, got %d\n", n - 1, r);
+        goto fail;
+    }
+
+    r = aug_rm(aug, "/shared");
+    if (r != 1 + 2 * (n - 1))
+        die("aug_rm /shared failed");
+    r = aug_match(aug, "$a", NULL);
+    if (r != 0) {
+        fprintf(stderr, "expected no matches for $a, got %d\n", r);
+        goto fail;
+    }
+
+    printf("PASS\n");
+    return 0;
+ fail:
+    printf("FAIL\n");
+    return -1;
+}
+
 static int test_defvar_nonexistent(struct augeas *aug) {
     int r;
 
@@ -363,6 +434,9 @@ static int run_tests(struct test *tests, int argc, char **argv) {
         if (test_rm_var(aug) < 0)
             result = EXIT_FAILURE;
 
+        if (test_rm_var_shared(aug) < 0)
+            result = EXIT_FAILURE;
+
         if (test_defvar_nonexistent(aug) < 0)
             result = EXIT_FAILURE;
 